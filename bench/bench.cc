@@ -0,0 +1,107 @@
+#include "bench/bench.hh"
+
+#include <cstdio>
+#include <random>
+
+#include "src/language/alloc_count.hh"
+
+using rendezllama::AllocCount;
+using rendezllama::Bench;
+
+// Run for at least this long to smooth out noise.
+static const Bench::Clock::duration min_duration = std::chrono::milliseconds(500);
+static const uint64_t min_iteration_count = 3;
+
+Bench::Bench(std::string name, uint64_t op_count)
+  : name_(std::move(name))
+  , op_count_(op_count > 0 ? op_count : 1)
+{}
+
+Bench::~Bench()
+{
+  this->pause();
+  const double op_count = (double)(iteration_count_ * op_count_);
+  const double ns = std::chrono::duration<double, std::nano>(elapsed_).count();
+  printf("%-48s %12.1f ns/op %12.1f B/op %10.3f allocs/op\n",
+         name_.c_str(),
+         ns / op_count,
+         allocated_byte_count_ / op_count,
+         allocation_count_ / op_count);
+  fflush(stdout);
+}
+
+/** Whether to run the loop body again.**/
+  bool
+Bench::running()
+{
+  if (!started_) {
+    started_ = true;
+    this->resume();
+    return true;
+  }
+  iteration_count_ += 1;
+  if (iteration_count_ < min_iteration_count) {
+    return true;
+  }
+  const Clock::duration elapsed = (
+      paused_ ? elapsed_ : elapsed_ + (Clock::now() - begin_));
+  if (elapsed < min_duration) {
+    return true;
+  }
+  this->pause();
+  return false;
+}
+
+/** Stop timing and counting, such as to set up the next iteration.**/
+  void
+Bench::pause()
+{
+  if (paused_) {return;}
+  elapsed_ += Clock::now() - begin_;
+  const AllocCount count = rendezllama::alloc_count();
+  allocated_byte_count_ +=
+    count.allocated_byte_count - begin_allocated_byte_count_;
+  allocation_count_ += count.allocation_count - begin_allocation_count_;
+  paused_ = true;
+}
+
+  void
+Bench::resume()
+{
+  if (!paused_) {return;}
+  paused_ = false;
+  const AllocCount count = rendezllama::alloc_count();
+  begin_allocated_byte_count_ = count.allocated_byte_count;
+  begin_allocation_count_ = count.allocation_count;
+  begin_ = Clock::now();
+}
+
+/** Chat-like text of about `byte_count` bytes that is the same every run.**/
+  std::string
+rendezllama::bench_text(size_t byte_count)
+{
+  static const char* const words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+    "and", "then", "I", "said", "hello", "to", "everyone", "in", "chat",
+    "because", "nobody", "knows", "what", "happens", "next", "tomorrow",
+    "naïve", "café", "résumé", "42", "3.14", "it's", "don't", "(maybe)",
+  };
+  const unsigned word_count = sizeof(words)/sizeof(*words);
+  std::mt19937 rng(1);
+  std::string text;
+  text.reserve(byte_count + 64);
+  unsigned line_word_count = 0;
+  while (text.size() < byte_count) {
+    if (line_word_count == 0) {
+      text += (rng() % 2 == 0 ? "User:" : "Char:");
+    }
+    text += ' ';
+    text += words[rng() % word_count];
+    line_word_count += 1;
+    if (line_word_count >= 8 && rng() % 4 == 0) {
+      text += ".\n";
+      line_word_count = 0;
+    }
+  }
+  return text;
+}
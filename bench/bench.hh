@@ -0,0 +1,47 @@
+#ifndef RENDEZLLAMA_BENCH_BENCH_HH_
+#define RENDEZLLAMA_BENCH_BENCH_HH_
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace rendezllama {
+
+/** Times a loop body and counts the bytes it allocates.
+ *
+ * Use it like:
+ *   for (Bench bench("name", op_count); bench.running();) {...}
+ * The body repeats until enough time passes to be measured reliably.
+ * Results are printed per op when the Bench goes out of scope.
+ **/
+class Bench {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit Bench(std::string name, uint64_t op_count = 1);
+  Bench(const Bench&) = delete;
+  ~Bench();
+  Bench& operator=(const Bench&) = delete;
+
+  bool running();
+  void pause();
+  void resume();
+
+ private:
+  std::string name_;
+  uint64_t op_count_;
+  uint64_t iteration_count_ = 0;
+  bool started_ = false;
+  bool paused_ = true;
+  Clock::time_point begin_;
+  Clock::duration elapsed_{};
+  uint64_t allocated_byte_count_ = 0;
+  uint64_t allocation_count_ = 0;
+  uint64_t begin_allocated_byte_count_ = 0;
+  uint64_t begin_allocation_count_ = 0;
+};
+
+std::string
+bench_text(size_t byte_count);
+
+}  // namespace rendezllama
+#endif
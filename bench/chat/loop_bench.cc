@@ -0,0 +1,164 @@
+#include <chrono>
+#include <vector>
+
+#include <fildesh/ostream.hh>
+
+#include "bench/bench.hh"
+#include "src/chat/display.hh"
+#include "src/chat/guide.hh"
+#include "src/chat/loop.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/latency.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::Bench;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::Vocabulary;
+
+/** Generate tokens with nothing but sampling and decoding in the loop.
+ *
+ * The trajectory rolls forward whenever it reaches context_token_limit,
+ * so long runs include the re-decoding that follows each rollforget.
+ **/
+static
+  bool
+bench_generation(
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    rendezllama::ChatDisplay& chat_disp,
+    ChatTrajectory& chat_traj,
+    Inference& inference)
+{
+  const llama_model* model = llama_get_model(ctx);
+  bool good = true;
+  for (Bench bench("commit_to_context+sample_to_trajectory");
+       good && bench.running();)
+  {
+    good = (
+        inference.sample_to_trajectory(chat_traj, false) &&
+        inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model));
+  }
+  return good;
+}
+
+/** Print what the run did and how fast it went.**/
+static
+  void
+print_summary(
+    std::ostream& out,
+    const char* name,
+    double seconds,
+    const Inference& inference,
+    const ChatTrajectory& chat_traj)
+{
+  const Inference::Counts& counts = inference.counts();
+  const unsigned decoded_count = (
+      counts.prefill_token_count + counts.generated_token_count);
+  out
+    << name << ":"
+    << " " << seconds << " s"
+    << ", " << counts.generated_token_count << " generated"
+    << ", " << counts.prefill_token_count << " prefilled"
+    << ", " << counts.redecode_token_count << " redecoded"
+    << ", " << chat_traj.rollforget_count_ << " rollforgets"
+    << ", " << counts.sampler_rebuild_count << " sampler rebuilds";
+  if (seconds > 0) {
+    out
+      << ", " << counts.generated_token_count / seconds << " generated tok/s"
+      << ", " << decoded_count / seconds << " decoded tok/s";
+  }
+  out << '\n';
+}
+
+int main(int argc, char** argv)
+{
+  rendezllama::GlobalScope rendezllama_global_scope;
+  fildesh::ofstream eout("/dev/stderr");
+  const char* script_filename = NULL;
+  int exstatus = 0;
+
+  // Take our own flags. Leave the rest for parse_options().
+  std::vector<char*> chat_argv;
+  exstatus = rendezllama::take_tool_flags(chat_argv, argc, argv, {
+    {"--x_script", &script_filename, nullptr, 0},
+  });
+
+  ChatOptions opt;
+  if (exstatus == 0) {
+    exstatus = parse_options(opt, (int)chat_argv.size(), chat_argv.data());
+  }
+  if (exstatus != 0) {
+    return exstatus;
+  }
+
+  llama_log_set(rendezllama::noop_log_callback, NULL);
+  llama_context* ctx = NULL;
+  llama_model* model = NULL;
+  std::tie(model, ctx) = rendezllama::make_llama_context(opt, 1);
+  if (!ctx) {return 1;}
+
+  Vocabulary vocabulary(model);
+  rendezllama::ChatDisplay chat_disp;
+  std::vector<Vocabulary::Token_id> priming_tokens;
+  Vocabulary::Token_id first_priming_token_id = vocabulary.bos_token_id();
+  if (!rendezllama::assign_vocabulary_substitution(vocabulary, opt)) {
+    exstatus = 65;
+  }
+  if (exstatus == 0) {
+    // Output is gibberish from random weights, so drop it.
+    chat_disp.out_ = open_FildeshOF("/dev/null");
+    first_priming_token_id = rendezllama::tokenize_priming_prompt(
+        priming_tokens, opt, vocabulary, model);
+  }
+
+  ChatTrajectory chat_traj(first_priming_token_id);
+  rendezllama::ChatGuide chat_guide(vocabulary, chat_traj, opt);
+  Inference inference(vocabulary);
+  if (exstatus == 0) {
+    rendezllama::prime_chat_trajectory(
+        chat_traj, chat_guide, priming_tokens, opt, vocabulary);
+    priming_tokens.clear();
+  }
+
+  FildeshX* script_in = NULL;
+  if (exstatus == 0 && script_filename) {
+    script_in = open_FildeshXF(script_filename);
+    if (!script_in) {
+      fildesh_log_error("Cannot open --x_script file.");
+      exstatus = 66;
+    }
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  if (exstatus == 0 && script_in) {
+    // The loop closes the script when done.
+    exstatus = rendezllama::chat_loop(
+        script_in, eout, ctx, opt, vocabulary,
+        chat_disp, chat_traj, chat_guide, inference);
+  }
+  else if (exstatus == 0) {
+    if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model) ||
+        !bench_generation(ctx, opt, chat_disp, chat_traj, inference))
+    {
+      fildesh_log_error("Failed to eval.");
+      exstatus = 1;
+    }
+  }
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+
+  if (exstatus == 0) {
+    fildesh::ofstream out("/dev/stdout");
+    print_summary(out, (script_filename ? script_filename : "generation"),
+                  seconds, inference, chat_traj);
+    rendezllama::latency_stats().print_to(out);
+  }
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return exstatus;
+}
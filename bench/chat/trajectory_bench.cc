@@ -0,0 +1,184 @@
+#include "src/chat/trajectory.hh"
+
+#include <cassert>
+#include <random>
+
+#include "llama.h"
+
+#include "bench/bench.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::Bench;
+using rendezllama::ChatTrajectory;
+using rendezllama::Vocabulary;
+typedef ChatTrajectory::size_type size_type;
+
+/** Pre-tokenized chat lines to build trajectories from.**/
+struct BenchLines {
+  std::vector<Vocabulary::Token_id> prefix_tokens[2];
+  std::vector<std::vector<Vocabulary::Token_id>> lines;
+};
+
+static
+  void
+tokenize_bench_lines(BenchLines& bench_lines, const Vocabulary& vocabulary)
+{
+  vocabulary.tokenize_to(bench_lines.prefix_tokens[0], "User:");
+  vocabulary.tokenize_to(bench_lines.prefix_tokens[1], "Char:");
+  std::vector<Vocabulary::Token_id> tokens;
+  vocabulary.tokenize_to(tokens, rendezllama::bench_text(64 << 10));
+  bench_lines.lines.emplace_back();
+  for (Vocabulary::Token_id token_id : tokens) {
+    bench_lines.lines.back().push_back(token_id);
+    if (token_id == vocabulary.newline_token_id()) {
+      bench_lines.lines.emplace_back();
+    }
+  }
+  bench_lines.lines.pop_back();
+}
+
+/** Append messages until the trajectory has `token_count` tokens.**/
+static
+  void
+append_messages(
+    ChatTrajectory& traj,
+    size_type token_count,
+    const BenchLines& bench_lines)
+{
+  size_t line_index = 0;
+  while (traj.token_count() < token_count) {
+    const unsigned id = line_index % 2;
+    const auto& line = bench_lines.lines[line_index % bench_lines.lines.size()];
+    line_index += 1;
+    const size_type beg = traj.token_count();
+    traj.insert_all_at(beg, bench_lines.prefix_tokens[id]);
+    traj.assign_range_message_prefix_id(id, beg, traj.token_count());
+    traj.insert_all_at(traj.token_count(), line);
+  }
+  traj.erase_all_at(token_count);
+  traj.erased_since_eval_ = false;
+}
+
+/** Fixed positions to search from in a trajectory.**/
+static
+  std::vector<size_type>
+random_positions(const ChatTrajectory& traj, unsigned count)
+{
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<size_type> dist(
+      traj.priming_token_count(), traj.token_count()-1);
+  std::vector<size_type> positions(count);
+  for (size_type& i : positions) {
+    i = dist(rng);
+  }
+  return positions;
+}
+
+static
+  void
+rfind_bench(const BenchLines& bench_lines, size_type token_count)
+{
+  const std::string n = std::to_string(token_count);
+  ChatTrajectory traj(0);
+  append_messages(traj, token_count, bench_lines);
+  const std::vector<size_type> positions = random_positions(traj, 1000);
+  size_type sum = 0;
+
+  for (Bench bench("rfind_message_prefix_at/" + n, positions.size());
+       bench.running();)
+  {
+    for (size_type i : positions) {
+      sum += traj.rfind_message_prefix_at(i);
+    }
+  }
+  for (Bench bench("rfind_message_prefix_begin_at/" + n, positions.size());
+       bench.running();)
+  {
+    for (size_type i : positions) {
+      sum += traj.rfind_message_prefix_begin_at(i);
+    }
+  }
+  for (Bench bench("rfind_last_message_prefix_end_at/" + n, positions.size());
+       bench.running();)
+  {
+    for (size_type i : positions) {
+      sum += traj.rfind_last_message_prefix_end_at(i);
+    }
+  }
+  for (Bench bench("last_message_prefix_id_at/" + n, positions.size());
+       bench.running();)
+  {
+    for (size_type i : positions) {
+      sum += traj.last_message_prefix_id_at(i);
+    }
+  }
+  assert(sum > 0);
+}
+
+static
+  void
+rollforget_bench(
+    const BenchLines& bench_lines,
+    size_type token_count,
+    const Vocabulary& vocabulary)
+{
+  ChatTrajectory traj(0);
+  append_messages(traj, token_count, bench_lines);
+  for (Bench bench("maybe_rollforget_within_limit/" + std::to_string(token_count));
+       bench.running();)
+  {
+    bench.pause();
+    append_messages(traj, token_count, bench_lines);
+    bench.resume();
+    traj.maybe_rollforget_within_limit(token_count - 1, vocabulary);
+  }
+}
+
+static
+  void
+suffix_bench(
+    const BenchLines& bench_lines,
+    size_type token_count,
+    const Vocabulary& vocabulary)
+{
+  const std::string n = std::to_string(token_count);
+  ChatTrajectory traj(0);
+  append_messages(traj, token_count, bench_lines);
+  unsigned match_count = 0;
+  for (Bench bench("endswith_nonempty/" + n, 1000); bench.running();) {
+    for (unsigned i = 0; i < 1000; ++i) {
+      if (traj.endswith_nonempty("\n", vocabulary)) {
+        match_count += 1;
+      }
+    }
+  }
+  assert(match_count > 0);
+  for (Bench bench("trim_message_suffix/" + n); bench.running();) {
+    traj.push_back(vocabulary.newline_token_id());
+    traj.trim_message_suffix("\n", vocabulary);
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  assert(argc == 2 && "need model filename");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  llama_model* model = llama_model_load_from_file(argv[1], model_params);
+  assert(model);
+  {
+    const Vocabulary vocabulary(model);
+    BenchLines bench_lines;
+    tokenize_bench_lines(bench_lines, vocabulary);
+    for (size_type token_count : {10000u, 100000u, 1000000u}) {
+      rfind_bench(bench_lines, token_count);
+      rollforget_bench(bench_lines, token_count, vocabulary);
+      suffix_bench(bench_lines, token_count, vocabulary);
+    }
+  }
+  llama_model_free(model);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "src/language/vocabulary.hh"
+
+#include <cassert>
+
+#include <fildesh/string.hh>
+
+#include "llama.h"
+
+#include "bench/bench.hh"
+
+using rendezllama::Bench;
+using rendezllama::Vocabulary;
+
+
+static
+  void
+tokenize_bench(const Vocabulary& vocabulary)
+{
+  std::vector<Vocabulary::Token_id> tokens;
+  const std::string line = "The quick brown fox jumps over the lazy dog.\n";
+  for (Bench bench("tokenize_to/line", 1); bench.running();) {
+    vocabulary.tokenize_to(tokens, line);
+  }
+
+  const std::string text = rendezllama::bench_text(4 << 20);
+  vocabulary.tokenize_to(tokens, text);
+  // Count ops per token to compare with the short line.
+  const size_t token_count = tokens.size();
+  for (Bench bench("tokenize_to/4MB (per token)", token_count); bench.running();) {
+    vocabulary.tokenize_to(tokens, text);
+  }
+}
+
+static
+  void
+detokenize_bench(const Vocabulary& vocabulary)
+{
+  std::vector<Vocabulary::Token_id> tokens;
+  vocabulary.tokenize_to(tokens, rendezllama::bench_text(64 << 10));
+  fildesh::ostringstream oss;
+
+  for (Bench bench("detokenize_to/single", tokens.size()); bench.running();) {
+    oss.truncate();
+    for (Vocabulary::Token_id token_id : tokens) {
+      vocabulary.detokenize_to(oss.c_struct(), token_id);
+    }
+  }
+  for (Bench bench("detokenize_to/bulk (per token)", tokens.size());
+       bench.running();)
+  {
+    oss.truncate();
+    vocabulary.detokenize_to(oss.c_struct(), tokens.data(), tokens.size());
+  }
+  for (Bench bench("detokenize_to/ostream (per token)", tokens.size());
+       bench.running();)
+  {
+    oss.truncate();
+    vocabulary.detokenize_to(oss, tokens.data(), tokens.size());
+  }
+}
+
+static
+  void
+last_char_of_bench(const Vocabulary& vocabulary)
+{
+  std::vector<Vocabulary::Token_id> tokens;
+  vocabulary.tokenize_to(tokens, rendezllama::bench_text(64 << 10));
+  unsigned newline_count = 0;
+  for (Bench bench("last_char_of", tokens.size()); bench.running();) {
+    for (Vocabulary::Token_id token_id : tokens) {
+      if (vocabulary.last_char_of(token_id) == '\n') {
+        newline_count += 1;
+      }
+    }
+  }
+  assert(newline_count > 0);
+}
+
+
+int main(int argc, char** argv)
+{
+  assert(argc == 2 && "need model filename");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  llama_model* model = llama_model_load_from_file(argv[1], model_params);
+  assert(model);
+  {
+    const Vocabulary vocabulary(model);
+    tokenize_bench(vocabulary);
+    detokenize_bench(vocabulary);
+    last_char_of_bench(vocabulary);
+  }
+  llama_model_free(model);
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ggml.h>
+#include <gguf.h>
+
+/** Writes a tiny llama-architecture model with random weights.
+ *
+ * The vocabulary comes from a vocab-only GGUF file,
+ * so tokenization matches the real model that the vocabulary is from.
+ * Weights are drawn from a fixed seed, so every build writes the same file.
+ * Outputs are gibberish, but the compute graph is the real one,
+ * which is all that throughput benchmarks need.
+ **/
+
+static const unsigned layer_count = 2;
+static const unsigned embedding_length = 64;
+static const unsigned feed_forward_length = 128;
+static const unsigned head_count = 4;
+static const unsigned context_length = 2048;
+
+static
+  struct ggml_tensor*
+new_weight(
+    struct ggml_context* ctx,
+    std::mt19937& rng,
+    const std::string& name,
+    int64_t ne0,
+    int64_t ne1)
+{
+  struct ggml_tensor* t = (
+      ne1 == 0
+      ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0)
+      : ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+  ggml_set_name(t, name.c_str());
+  float* data = (float*)t->data;
+  const int64_t n = ggml_nelements(t);
+  if (ne1 == 0) {
+    // Norm weights are vectors that scale each element.
+    for (int64_t i = 0; i < n; ++i) {
+      data[i] = 1.0f;
+    }
+  }
+  else {
+    std::normal_distribution<float> normal(0.0f, 0.02f);
+    for (int64_t i = 0; i < n; ++i) {
+      data[i] = normal(rng);
+    }
+  }
+  return t;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s VOCAB_GGUF OUTPUT_GGUF\n", argv[0]);
+    return 64;
+  }
+  const char* vocab_filename = argv[1];
+  const char* out_filename = argv[2];
+
+  struct gguf_init_params vocab_params = {true, NULL};
+  struct gguf_context* vocab = gguf_init_from_file(vocab_filename, vocab_params);
+  if (!vocab) {
+    fprintf(stderr, "Cannot read vocab file: %s\n", vocab_filename);
+    return 66;
+  }
+  const auto tokens_key_id = gguf_find_key(vocab, "tokenizer.ggml.tokens");
+  if (tokens_key_id < 0) {
+    fprintf(stderr, "No tokens in vocab file: %s\n", vocab_filename);
+    gguf_free(vocab);
+    return 65;
+  }
+  const int64_t vocab_size = (int64_t)gguf_get_arr_n(vocab, tokens_key_id);
+
+  struct gguf_context* gguf = gguf_init_empty();
+  gguf_set_kv(gguf, vocab);
+  gguf_free(vocab);
+  gguf_set_val_str(gguf, "general.architecture", "llama");
+  gguf_set_val_str(gguf, "general.name", "tiny random llama");
+  gguf_set_val_u32(gguf, "general.file_type", 0);
+  gguf_set_val_u32(gguf, "llama.block_count", layer_count);
+  gguf_set_val_u32(gguf, "llama.context_length", context_length);
+  gguf_set_val_u32(gguf, "llama.embedding_length", embedding_length);
+  gguf_set_val_u32(gguf, "llama.feed_forward_length", feed_forward_length);
+  gguf_set_val_u32(gguf, "llama.attention.head_count", head_count);
+  gguf_set_val_u32(gguf, "llama.attention.head_count_kv", head_count);
+  gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+  gguf_set_val_u32(gguf, "llama.rope.dimension_count",
+                   embedding_length / head_count);
+  gguf_set_val_f32(gguf, "llama.rope.freq_base", 10000.0f);
+
+  const size_t tensor_count = 3 + 9 * layer_count;
+  const size_t weight_count = (
+      2 * vocab_size * embedding_length + embedding_length
+      + layer_count * (
+          4 * embedding_length * embedding_length
+          + 3 * embedding_length * feed_forward_length
+          + 2 * embedding_length));
+  struct ggml_init_params ctx_params = {
+    tensor_count * ggml_tensor_overhead() + weight_count * sizeof(float),
+    NULL,
+    false,
+  };
+  struct ggml_context* ctx = ggml_init(ctx_params);
+
+  std::mt19937 rng(1);
+  std::vector<struct ggml_tensor*> tensors;
+  tensors.push_back(new_weight(
+          ctx, rng, "token_embd.weight", embedding_length, vocab_size));
+  for (unsigned i = 0; i < layer_count; ++i) {
+    const std::string blk = "blk." + std::to_string(i) + ".";
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "attn_norm.weight", embedding_length, 0));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "attn_q.weight", embedding_length, embedding_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "attn_k.weight", embedding_length, embedding_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "attn_v.weight", embedding_length, embedding_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "attn_output.weight",
+            embedding_length, embedding_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "ffn_norm.weight", embedding_length, 0));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "ffn_gate.weight",
+            embedding_length, feed_forward_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "ffn_down.weight",
+            feed_forward_length, embedding_length));
+    tensors.push_back(new_weight(
+            ctx, rng, blk + "ffn_up.weight",
+            embedding_length, feed_forward_length));
+  }
+  tensors.push_back(new_weight(
+          ctx, rng, "output_norm.weight", embedding_length, 0));
+  tensors.push_back(new_weight(
+          ctx, rng, "output.weight", embedding_length, vocab_size));
+
+  for (struct ggml_tensor* t : tensors) {
+    gguf_add_tensor(gguf, t);
+  }
+  gguf_write_to_file(gguf, out_filename, false);
+  gguf_free(gguf);
+  ggml_free(ctx);
+
+  // Check that it was written by reading it back.
+  struct gguf_init_params check_params = {true, NULL};
+  struct gguf_context* check = gguf_init_from_file(out_filename, check_params);
+  if (!check) {
+    fprintf(stderr, "Cannot write model file: %s\n", out_filename);
+    return 73;
+  }
+  gguf_free(check);
+  return 0;
+}
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include <fildesh/ostream.hh>
+#include <fildesh/string.hh>
+#include <fildesh/sxproto.h>
+
+#include "src/chat/display.hh"
+#include "src/chat/guide.hh"
+#include "src/chat/loop.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/pool.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/scheduler.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatOptions;
+using rendezllama::Vocabulary;
+
+/** State shared by all generating threads.
+ *
+ * Each thread generates replies on its own KV cache sequences,
+ * and their decodes are batched together.
+ **/
+struct BatchGeneration {
+  struct llama_context* ctx = nullptr;
+  const ChatOptions* opt = nullptr;
+  Vocabulary* vocabulary = nullptr;
+  Vocabulary::Token_id first_priming_token_id = 0;
+  const std::vector<Vocabulary::Token_id>* priming_tokens = nullptr;
+  llama_seq_id priming_seq_id = 0;
+  unsigned priming_token_count = 0;
+  unsigned reply_token_limit = 0;
+  rendezllama::DecodeScheduler* scheduler = nullptr;
+  rendezllama::SequencePool* pool = nullptr;
+  const std::vector<std::vector<std::string>>* conversations = nullptr;
+  std::vector<std::string> replies;
+  // Guards the fields below.
+  std::mutex mutex;
+  size_t next_index = 0;
+  bool all_good = true;
+};
+
+static
+  bool
+slurp_conversations(
+    std::vector<std::vector<std::string>>& conversations,
+    const char* filename)
+{
+  static FildeshSxprotoField conversation_message[] = {
+    {"lines", FILL_DEFAULT_FildeshSxprotoField_STRINGS},
+  };
+  static FildeshSxprotoField toplevel_fields[] = {
+    {"conversations", FILL_FildeshSxprotoField_MESSAGES(conversation_message)},
+  };
+  DECLARE_TOPLEVEL_FildeshSxprotoField(schema, toplevel_fields);
+  lone_toplevel_initialization_FildeshSxprotoField(schema);
+
+  FildeshX* in = open_FildeshXF(filename);
+  if (!in) {return false;}
+  FildeshO* err_out = open_FildeshOF("/dev/stderr");
+  FildeshSxpb* const sxpb = slurp_sxpb_close_FildeshX(in, schema, err_out);
+  close_FildeshO(err_out);
+  if (!sxpb) {return false;}
+
+  FildeshSxpbIT it = lookup_subfield_at_FildeshSxpb(
+      sxpb, top_of_FildeshSxpb(sxpb), "conversations");
+  if (!nullish_FildeshSxpbIT(it)) {
+    for (it = first_at_FildeshSxpb(sxpb, it); !nullish_FildeshSxpbIT(it);
+         it = next_at_FildeshSxpb(sxpb, it)) {
+      conversations.emplace_back();
+      FildeshSxpbIT line_it = lookup_subfield_at_FildeshSxpb(sxpb, it, "lines");
+      if (nullish_FildeshSxpbIT(line_it)) {continue;}
+      for (line_it = first_at_FildeshSxpb(sxpb, line_it);
+           !nullish_FildeshSxpbIT(line_it);
+           line_it = next_at_FildeshSxpb(sxpb, line_it)) {
+        conversations.back().push_back(str_value_at_FildeshSxpb(sxpb, line_it));
+      }
+    }
+  }
+  close_FildeshSxpb(sxpb);
+  return true;
+}
+
+/** Append the given lines, alternating between protagonist and confidant.**/
+static
+  void
+append_conversation_lines(
+    rendezllama::ChatGuide& chat_guide,
+    rendezllama::ChatTrajectory& chat_traj,
+    const std::vector<std::string>& lines,
+    const Vocabulary& vocabulary,
+    const ChatOptions& opt)
+{
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const unsigned turn_index = (i % 2 == 0 ? 0 : opt.message_opts.size()-1);
+    chat_guide.yield_turn(turn_index);
+    std::string s = lines[i];
+    const std::string& prefix = opt.message_opts[turn_index].prefix;
+    if (!prefix.empty() && prefix.back() == '\n' && opt.linespace_on) {
+      if (!s.empty() && s.front() != ' ') {
+        s.insert(0, " ");
+      }
+    }
+    chat_traj.tokenize_append(s, vocabulary);
+  }
+  chat_guide.yield_turn();
+}
+
+/** Generate replies for conversations until none are left.**/
+static
+  void
+generate_replies(BatchGeneration* batch, unsigned slot)
+{
+  const Vocabulary& vocabulary = *batch->vocabulary;
+  const llama_model* model = llama_get_model(batch->ctx);
+  while (true) {
+    size_t index;
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      if (batch->next_index == batch->conversations->size()) {break;}
+      index = batch->next_index;
+      batch->next_index += 1;
+    }
+    {
+      std::lock_guard<std::mutex> context_lock(batch->scheduler->context_mutex());
+      batch->pool->add(slot);
+    }
+    ChatOptions opt = *batch->opt;
+    rendezllama::ChatDisplay chat_disp;
+    chat_disp.out_ = open_FildeshOF("/dev/null");
+    rendezllama::ChatTrajectory chat_traj(batch->first_priming_token_id);
+    rendezllama::ChatGuide chat_guide(*batch->vocabulary, chat_traj, opt);
+    rendezllama::Inference inference(vocabulary);
+    inference.share_context(batch->scheduler, batch->pool, slot);
+    rendezllama::prime_chat_trajectory(
+        chat_traj, chat_guide, *batch->priming_tokens, opt, vocabulary);
+    if (batch->priming_token_count > 0) {
+      inference.copy_prefix_kv(
+          batch->ctx, chat_traj,
+          batch->priming_seq_id, batch->priming_token_count);
+    }
+    append_conversation_lines(
+        chat_guide, chat_traj, (*batch->conversations)[index],
+        vocabulary, opt);
+
+    fildesh::ostringstream oss;
+    bool preventing_newline = true;
+    for (unsigned i = 0; i < batch->reply_token_limit; ++i) {
+      if (!inference.commit_to_context(
+              batch->ctx, chat_disp, chat_traj, opt, model))
+      {
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        batch->all_good = false;
+        break;
+      }
+      if (!inference.sample_to_trajectory(chat_traj, preventing_newline)) {
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        batch->all_good = false;
+        break;
+      }
+      preventing_newline = false;
+      chat_disp.displaystring_to(oss.c_struct(), chat_traj.token(), vocabulary);
+      if (chat_guide.maybe_yield_turn() && chat_traj.message_prefix_id_ == 0) {
+        break;
+      }
+    }
+    batch->replies[index] = oss.view();
+    {
+      std::lock_guard<std::mutex> context_lock(batch->scheduler->context_mutex());
+      batch->pool->remove(slot, batch->ctx);
+    }
+  }
+}
+
+/** Write a string in sxpb syntax.**/
+static
+  void
+put_quoted_string(FildeshO* out, std::string_view s)
+{
+  putc_FildeshO(out, '"');
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      putc_FildeshO(out, '\\');
+      putc_FildeshO(out, c);
+    }
+    else if (c == '\n') {
+      putstr_FildeshO(out, "\\n");
+    }
+    else {
+      putc_FildeshO(out, c);
+    }
+  }
+  putc_FildeshO(out, '"');
+}
+
+int main(int argc, char** argv)
+{
+  rendezllama::GlobalScope rendezllama_global_scope;
+  const char* conversations_filename = NULL;
+  const char* replies_filename = "/dev/stdout";
+  unsigned sequence_limit = 8;
+  unsigned reply_token_limit = 256;
+  int exstatus = 0;
+
+  // Take our own flags. Leave the rest for parse_options().
+  std::vector<char*> chat_argv;
+  exstatus = rendezllama::take_tool_flags(chat_argv, argc, argv, {
+    {"--x_conversations", &conversations_filename, nullptr, 0},
+    {"--o_replies", &replies_filename, nullptr, 0},
+    {"--sequence_limit", nullptr, &sequence_limit, 1},
+    {"--reply_token_limit", nullptr, &reply_token_limit, 1},
+  });
+
+  ChatOptions opt;
+  if (exstatus == 0) {
+    exstatus = parse_options(opt, (int)chat_argv.size(), chat_argv.data());
+  }
+  if (exstatus == 0 && !conversations_filename) {
+    fildesh_log_error("Please provide a --x_conversations file.");
+    exstatus = 64;
+  }
+  std::vector<std::vector<std::string>> conversations;
+  if (exstatus == 0 &&
+      !slurp_conversations(conversations, conversations_filename))
+  {
+    fildesh_log_error("Cannot read --x_conversations file.");
+    exstatus = 1;
+  }
+  if (exstatus != 0) {
+    return exstatus;
+  }
+
+  const unsigned session_count = std::max<size_t>(
+      1, std::min<size_t>(sequence_limit, conversations.size()));
+  llama_log_set(rendezllama::noop_log_callback, NULL);
+  llama_context* ctx = NULL;
+  llama_model* model = NULL;
+  // Conversations start from a shared priming sequence.
+  std::tie(model, ctx) = rendezllama::make_llama_context(
+      opt, session_count, true);
+  if (!ctx) {return 1;}
+
+  Vocabulary vocabulary(model);
+  std::vector<Vocabulary::Token_id> priming_tokens;
+  Vocabulary::Token_id first_priming_token_id = vocabulary.bos_token_id();
+  if (!rendezllama::assign_vocabulary_substitution(vocabulary, opt)) {
+    exstatus = 65;
+  }
+  if (exstatus == 0) {
+    first_priming_token_id = rendezllama::tokenize_priming_prompt(
+        priming_tokens, opt, vocabulary, model);
+  }
+
+  if (exstatus == 0) {
+    rendezllama::SequencePool pool(session_count, session_count, "");
+    rendezllama::DecodeScheduler scheduler(
+        &ctx, opt.batch_count, opt.batch_count, vocabulary.cardinality());
+    BatchGeneration batch;
+    batch.ctx = ctx;
+    batch.opt = &opt;
+    batch.vocabulary = &vocabulary;
+    batch.first_priming_token_id = first_priming_token_id;
+    batch.priming_tokens = &priming_tokens;
+    batch.reply_token_limit = reply_token_limit;
+    batch.scheduler = &scheduler;
+    batch.pool = &pool;
+    batch.conversations = &conversations;
+    batch.replies.resize(conversations.size());
+
+    // Evaluate the priming prompt once for all conversations.
+    batch.priming_seq_id = 2*session_count;
+    {
+      std::vector<Vocabulary::Token_id> tokens;
+      tokens.push_back(first_priming_token_id);
+      tokens.insert(tokens.end(), priming_tokens.begin(), priming_tokens.end());
+      std::vector<float> logits;
+      if (tokens.size() == scheduler.decode(
+              batch.priming_seq_id, tokens.data(), tokens.size(), 0, logits,
+              nullptr))
+      {
+        batch.priming_token_count = tokens.size();
+      }
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < session_count; ++i) {
+      threads.push_back(std::thread(generate_replies, &batch, i));
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    if (!batch.all_good) {
+      fildesh_log_error("Failed to eval.");
+      exstatus = 1;
+    }
+
+    FildeshO* out = open_FildeshOF(replies_filename);
+    if (!out) {
+      fildesh_log_error("Cannot open --o_replies file.");
+      exstatus = 1;
+    }
+    else {
+      putstr_FildeshO(out, "((replies)\n");
+      for (const std::string& reply : batch.replies) {
+        putc_FildeshO(out, ' ');
+        put_quoted_string(out, reply);
+        putc_FildeshO(out, '\n');
+      }
+      putstr_FildeshO(out, ")\n");
+      close_FildeshO(out);
+    }
+  }
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return exstatus;
+}
@@ -1,16 +1,25 @@
 #include <cassert>
+#include <future>
 
 #include <fildesh/ostream.hh>
 #include <fildesh/string.hh>
 
 #include "src/chat/display.hh"
-#include "src/chat/cmd.hh"
 #include "src/chat/guide.hh"
+#include "src/chat/loop.hh"
+#include "src/chat/memory.hh"
 #include "src/chat/opt.hh"
+#include "src/chat/server.hh"
+#include "src/chat/session.hh"
 #include "src/chat/trajectory.hh"
 #include "src/language/inference.hh"
+#include "src/language/latency.hh"
 #include "src/language/vocabulary.hh"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 using rendezllama::Vocabulary;
 
 static
@@ -63,14 +72,50 @@ open_transcript_outfile(
   return transcript_out;
 }
 
+typedef std::future<std::tuple<llama_model*, llama_context*> >
+  LlamaContextFuture;
+
+/** Wait for the model that loads in the background, then apply any LoRA.
+ *
+ * Returns nonzero on failure. Does nothing if already awaited.
+ **/
+static
+  int
+await_llama_context(
+    LlamaContextFuture& model_loading,
+    llama_model*& model,
+    llama_context*& ctx,
+    const rendezllama::ChatOptions& opt)
+{
+  if (!model_loading.valid()) {
+    return (ctx ? 0 : 1);
+  }
+  std::tie(model, ctx) = model_loading.get();
+  if (!ctx) {return 1;}
+
+  if (!opt.lora_filename.empty()) {
+    const float scale = 1.0f;
+    struct llama_adapter_lora* lora = llama_adapter_lora_init(
+        model, opt.lora_filename.c_str());
+    if (lora) {
+      int istat = llama_set_adapter_lora(ctx, lora, scale);
+      if (istat != 0) {
+        llama_adapter_lora_free(lora);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
+/** Write recent trace spans to the o_trace file if tracing.**/
 static
   void
-noop_log_callback(enum ggml_log_level level, const char* text, void* user_data)
+maybe_write_trace(const rendezllama::ChatOptions& opt)
 {
-  (void) level;
-  (void) text;
-  (void) user_data;
+  if (opt.trace_filename.empty()) {return;}
+  fildesh::ofstream trace_out(opt.trace_filename);
+  rendezllama::trace_buffer().write_chrome_trace_to(trace_out);
 }
 
 
@@ -78,104 +123,162 @@ int main(int argc, char** argv)
 {
   rendezllama::GlobalScope rendezllama_global_scope;
   fildesh::ofstream eout("/dev/stderr");
-  FildeshX* in = NULL;
   int exstatus = 0;
   rendezllama::ChatOptions opt;
   exstatus = parse_options(opt, argc, argv);
+  if (exstatus == 0 && !opt.trace_filename.empty()) {
+    // Keep the most recent spans, which take about 2 MB.
+    rendezllama::trace_buffer().enable(1u << 16);
+  }
 
-  llama_log_set(noop_log_callback, NULL);
+  // Keep quiet, but remember the buffer sizes for /mem.
+  llama_log_set(rendezllama::memory_log_callback, NULL);
   llama_context* ctx = NULL;
   llama_model* model = NULL;
+  // Tokenize with just the vocabulary while the weights load.
+  llama_model* vocabulary_model = NULL;
+  LlamaContextFuture model_loading;
   if (exstatus == 0) {
-    std::tie(model, ctx) = rendezllama::make_llama_context(opt);
-    if (!ctx) {exstatus = 1;}
-  }
-
-  if (exstatus == 0 && !opt.lora_filename.empty()) {
-    const float scale = 1.0f;
-    struct llama_adapter_lora* lora = llama_adapter_lora_init(
-        model, opt.lora_filename.c_str());
-    if (lora) {
-      int istat = llama_set_adapter_lora(ctx, lora, scale);
-      if (istat != 0) {
+    // Server sessions start from a shared priming sequence.
+    const bool priming_sequence_on = !opt.server_socket_filename.empty();
+    const unsigned session_count = (
+        priming_sequence_on
+        ? rendezllama::server_resident_session_count(opt) : 1);
+    rendezllama::prefetch_model_file(opt.model_filename);
+    vocabulary_model = rendezllama::load_vocabulary_model(opt.model_filename);
+    if (vocabulary_model) {
+      // Settle options first so the loading thread does not modify them.
+      if (rendezllama::adapt_options_to_model(
+              opt, vocabulary_model, session_count, priming_sequence_on))
+      {
+        model_loading = std::async(
+            std::launch::async, rendezllama::make_llama_context,
+            std::ref(opt), session_count, priming_sequence_on);
+      }
+      else {
         exstatus = 1;
-        llama_adapter_lora_free(lora);
       }
     }
+    else {
+      fildesh_log_error("Failed to open model.");
+      exstatus = 1;
+    }
   }
 
-  Vocabulary vocabulary(model);
+  Vocabulary vocabulary(vocabulary_model);
   rendezllama::ChatDisplay chat_disp;
   Vocabulary::Token_id first_priming_token_id = vocabulary.bos_token_id();
   std::vector<Vocabulary::Token_id> priming_tokens;
+  // A saved session or state replaces the priming and rolling prompts.
+  rendezllama::MappedFile session_in;
+  // Server sessions always start fresh.
+  rendezllama::MappedFile state_in;
+  if (exstatus == 0 && opt.server_socket_filename.empty() &&
+      !opt.state_in_filename.empty())
+  {
+    state_in.open(opt.state_in_filename);
+  }
+  if (exstatus == 0 && opt.server_socket_filename.empty() &&
+      !state_in.is_open() && !opt.session_in_filename.empty())
+  {
+    session_in.open(opt.session_in_filename);
+  }
+  uint64_t vocabulary_fingerprint = 0;
+  if (exstatus == 0 &&
+      (session_in.is_open() || state_in.is_open() ||
+       !opt.session_out_filename.empty() ||
+       !opt.state_out_filename.empty()))
+  {
+    vocabulary_fingerprint = vocabulary.fingerprint();
+  }
   if (exstatus == 0) {
-    const auto& substitution = opt.substitution;
-    if (!substitution.bos_token_alias.empty()) {
-      vocabulary.assign_substitution(
-          substitution.bos_token_alias, vocabulary.bos_token_id());
-    }
-    if (!substitution.eos_token_alias.empty()) {
-      vocabulary.assign_substitution(
-          substitution.eos_token_alias, vocabulary.eos_token_id());
-    }
-    for (const auto& special : substitution.special_tokens) {
-      Vocabulary::Token_id token_id = Vocabulary::null_token_id;
-      for (const auto& name : special.candidates) {
-        token_id = vocabulary.tokenize_special(name);
-        if (token_id != Vocabulary::null_token_id) {break;}
-      }
-      if (token_id != Vocabulary::null_token_id) {
-        vocabulary.assign_substitution(special.alias, token_id);
-      }
-      else {
-        exstatus = 65;
-        fildesh_log_errorf("Unknown special token: %s", special.alias.c_str());
-      }
+    if (!rendezllama::assign_vocabulary_substitution(vocabulary, opt)) {
+      exstatus = 65;
     }
     chat_disp.out_ = open_FildeshOF("/dev/stdout");
+    chat_disp.framing_on_ = opt.framed_output_on;
     if (!opt.answer_prompt.empty()) {
       vocabulary.tokenize_to(
           chat_disp.answer_prompt_tokens_,
           opt.answer_prompt);
     }
-    vocabulary.tokenize_to(priming_tokens, opt.priming_prompt);
-    if (!priming_tokens.empty()) {
-      auto begin = priming_tokens.begin();
-      if (0 != llama_vocab_get_add_bos(llama_model_get_vocab(model))) {
-        if (*begin == vocabulary.bos_token_id()) {
-          priming_tokens.erase(begin, begin+1);
-        }
-      }
-      else {
-        first_priming_token_id = *begin;
-        priming_tokens.erase(begin, begin+1);
-      }
+    if (!session_in.is_open() && !state_in.is_open()) {
+      first_priming_token_id = rendezllama::tokenize_priming_prompt(
+          priming_tokens, opt, vocabulary, vocabulary_model);
     }
   }
 
+  if (exstatus == 0 && !opt.server_socket_filename.empty()) {
+    exstatus = await_llama_context(model_loading, model, ctx, opt);
+  }
+  if (exstatus == 0 && !opt.server_socket_filename.empty()) {
+    exstatus = rendezllama::serve_chat_sessions(
+        ctx, opt, vocabulary,
+        chat_disp.answer_prompt_tokens_,
+        first_priming_token_id, priming_tokens);
+    rendezllama::latency_stats().print_to(eout);
+    eout.flush();
+    maybe_write_trace(opt);
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_model_free(vocabulary_model);
+    return exstatus;
+  }
+
   rendezllama::ChatTrajectory chat_traj(first_priming_token_id);
-  if (exstatus == 0) {
+  // Forked sessions would all append to the same transcript.
+  if (exstatus == 0 && opt.fork_server_socket_filename.empty()) {
     chat_traj.transcript_out_ = open_transcript_outfile(
         exstatus, opt.transcript_sibling_filename, opt.transcript_filename);
   }
 
   rendezllama::ChatGuide chat_guide(vocabulary, chat_traj, opt);
   rendezllama::Inference inference(vocabulary);
+  if (exstatus == 0 && state_in.is_open()) {
+    exstatus = await_llama_context(model_loading, model, ctx, opt);
+  }
   // Tokenize the prompt.
-  const std::vector<llama_token>& chat_tokens = chat_traj.tokens();
-  if (exstatus == 0) {
-    chat_traj.insert_all_at(1, priming_tokens);
+  if (exstatus == 0 && state_in.is_open()) {
+    if (!rendezllama::load_chat_state(
+            state_in.view(), chat_traj, chat_disp, inference,
+            model, ctx, opt, vocabulary_fingerprint))
+    {
+      fildesh_log_error("Cannot load --x_state file. Is it for this model?");
+      exstatus = 1;
+    }
+    state_in.close();
+    print_initialization(eout, vocabulary, opt, chat_traj);
+  }
+  else if (exstatus == 0 && session_in.is_open()) {
+    if (!chat_traj.assign_session(session_in.view(), vocabulary_fingerprint)) {
+      fildesh_log_error("Cannot load --x_session file. Is it for this model?");
+      exstatus = 1;
+    }
+    session_in.close();
+    print_initialization(eout, vocabulary, opt, chat_traj);
+  }
+  else if (exstatus == 0) {
+    rendezllama::prime_chat_trajectory(
+        chat_traj, chat_guide, priming_tokens, opt, vocabulary);
     priming_tokens.clear();
-    // No need for --keep, we just directly compute the priming prompt number of tokens.
-    chat_traj.priming_token_count_ = chat_traj.token_count();
-    chat_traj.tokenize_append(opt.rolling_prompt, vocabulary);
-    chat_traj.message_prefix_id_ = 0;
-    chat_guide.yield_turn(1);
     print_initialization(eout, vocabulary, opt, chat_traj);
   }
+  if (exstatus == 0) {
+    exstatus = await_llama_context(model_loading, model, ctx, opt);
+  }
+  if (exstatus == 0 && !opt.session_out_filename.empty()) {
+    FildeshO* session_out = open_FildeshOF(opt.session_out_filename.c_str());
+    if (session_out) {
+      chat_traj.begin_session_out(session_out, vocabulary_fingerprint);
+    }
+    else {
+      fildesh_log_error("cannot open --o_session file for writing");
+      exstatus = 1;
+    }
+  }
 
   if (exstatus == 0) {
-    assert(opt.context_token_limit <= llama_n_ctx(ctx));
+    assert(opt.context_token_limit <= llama_n_ctx(ctx) || opt.context_growth_on);
     // It's convenient to save a long transcript and reload it later,
     // so we allow the full prompt to exceed context limit with the expectation
     // that the earlier part of the rolling prompt won't even be evaluated.
@@ -185,7 +288,48 @@ int main(int argc, char** argv)
     }
   }
 
+  if (exstatus == 0 && !opt.fork_server_socket_filename.empty()) {
+    // Evaluate the prompt once so every forked session starts with it.
+    chat_traj.display_token_count_ = chat_traj.token_count();
+    if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+      fildesh_log_error("Failed to eval prompt.");
+      exstatus = 1;
+    }
+  }
+
   if (exstatus == 0) {
+    rendezllama::MemoryMonitor memory_monitor;
+    rendezllama::MemoryUsage memory_usage;
+    memory_monitor.sample(memory_usage, opt, ctx, chat_traj, vocabulary);
+    rendezllama::print_memory_usage(eout, memory_usage);
+    if (opt.memory_plan.context_token_limit > 0) {
+      rendezllama::print_memory_plan(eout, opt.memory_plan);
+    }
+    eout << '\n';
+  }
+
+  // A forked session runs over its connection instead of stdin and stdout.
+  FildeshX* connection_in = NULL;
+  if (exstatus == 0 && !opt.fork_server_socket_filename.empty()) {
+    // Children would write anything still buffered again.
+    eout.flush();
+    flush_FildeshO(chat_disp.out_);
+    FildeshO* connection_out = NULL;
+    exstatus = rendezllama::fork_chat_sessions(opt, connection_in, connection_out);
+    if (connection_out) {
+      close_FildeshO(chat_disp.out_);
+      chat_disp.out_ = connection_out;
+    }
+#ifndef _WIN32
+    if (connection_in && !opt.trace_filename.empty()) {
+      // Each session traces to its own file, without the parent's spans.
+      opt.trace_filename += "." + std::to_string(getpid());
+      rendezllama::trace_buffer().clear();
+    }
+#endif
+  }
+
+  if (exstatus == 0 && !connection_in) {
     eout
       << "=== Chat CLI ===\n"
       << "- Token generation will frequently wait for input.\n"
@@ -195,266 +339,40 @@ int main(int argc, char** argv)
     eout.flush();
   }
 
-  unsigned line_byte_limit = 0;
-  unsigned line_byte_count = 0;
-  unsigned sentence_count = 0;
-  unsigned sentence_token_count = 0;
-  bool preventing_newline = false;
-  // Skip straight to user input when in coprocess mode.
-  bool token_generation_on = !opt.coprocess_mode_on;
-  fildesh::ostringstream oss;
+  if (exstatus == 0) {
+    // A forked session's command output goes to its client.
+    rendezllama::ChatDisplayStreambuf connection_eout_buf(chat_disp);
+    std::ostream connection_eout(&connection_eout_buf);
+    exstatus = rendezllama::chat_loop(
+        (connection_in ? connection_in : open_FildeshXF("/dev/stdin")),
+        (connection_in ? connection_eout : eout), ctx, opt, vocabulary,
+        chat_disp, chat_traj, chat_guide, inference);
+  }
 
-  in = open_FildeshXF("/dev/stdin");
-  while (exstatus == 0) {
-    if (opt.coprocess_mode_on) {
-      // Print nothing except for prompted.
-      chat_traj.display_token_count_ = chat_traj.token_count();
-    }
-    chat_disp.maybe_insert_answer_prompt(chat_traj, vocabulary);
-    if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+  if (exstatus == 0 && !opt.state_out_filename.empty()) {
+    if (!rendezllama::save_chat_state(
+            opt.state_out_filename, chat_traj, chat_disp, inference,
+            model, ctx, vocabulary_fingerprint))
+    {
+      fildesh_log_error("Cannot write --o_state file.");
       exstatus = 1;
-      break;
-    }
-
-    bool inputting = false;
-    std::string matched_antiprompt;
-    if (!token_generation_on) {
-      // Just skip the first token.
-      token_generation_on = true;
-      inputting = true;
-    }
-    else {
-      inference.sample_to_trajectory(chat_traj, ctx, preventing_newline);
-      preventing_newline = false;
-
-      chat_disp.show_new(chat_traj, vocabulary);
-
-      oss.truncate();
-      chat_disp.displaystring_to(oss.c_struct(), chat_traj.token(), vocabulary);
-      const std::string_view s = oss.view();
-      line_byte_count += s.size();
-      // Check if each of the reverse prompts appears at the end of the output.
-      // We use single-character antiprompts, so they aren't split across tokens.
-      // (If we used longer antiprompts, they could be split across iterations.)
-      matched_antiprompt = rendezllama::antiprompt_suffix(s, opt.antiprompts);
-    }
-
-    if (line_byte_limit > 0 && line_byte_count >= line_byte_limit) {
-      inputting = true;
-      chat_guide.end_turn();
-      if (matched_antiprompt != "\n") {
-        chat_disp.show_new(chat_traj, vocabulary);
-      }
-    }
-    else if (chat_guide.maybe_yield_turn()) {
-      if (matched_antiprompt != "\n") {
-        matched_antiprompt = "\n";
-      }
-      if (chat_traj.message_prefix_id_ == 0) {
-        inputting = true;
-      }
-      chat_disp.show_new(chat_traj, vocabulary);
-      sentence_count = 0;
-      sentence_token_count = 0;
-    }
-    else if (!matched_antiprompt.empty()) {
-      if (sentence_count + 1 == opt.sentence_limit) {
-        // Reached the limit on number of sentences.
-        inputting = true;
-      }
-      else {
-        sentence_count += 1;
-        sentence_token_count = 0;
-      }
-    }
-    else {
-      if (sentence_token_count + 1 == opt.sentence_token_limit) {
-        // Reached the limit on number of tokens in a sentence.
-        inputting = true;
-      }
-      else {
-        sentence_token_count += 1;
-      }
-    }
-
-    chat_disp.maybe_remove_answer_prompt(chat_traj, inputting);
-
-    if (inputting) {
-      line_byte_count = 0;
-      sentence_token_count = 0;
-      sentence_count = 0;
-
-      std::string buffer;
-
-      FildeshX slice;
-      for (slice = sliceline_FildeshX(in); slice.at;
-           slice = sliceline_FildeshX(in))
-      {
-        if (slice.size == 0) {break;}
-
-        if (!peek_char_FildeshX(&slice, opt.command_prefix_char)) {
-          if (slice.at[slice.size-1] == '\\') {
-            // Overwrite the continue character.
-            slice.at[slice.size-1] = '\n';
-            buffer += fildesh::make_string_view(slice);
-            continue;
-          }
-          if (slice.at[0] == ' ' && buffer.empty() && matched_antiprompt == "\n") {
-            // Prepare to append to the previous message.
-            chat_guide.maybe_erase_trailing_message_prefix();
-            chat_guide.maybe_erase_trailing_message_suffix();
-            matched_antiprompt.clear();
-          }
-          buffer += fildesh::make_string_view(slice);
-          break;
-        }
-
-        if (!buffer.empty()) {
-          fildesh_log_warning("Pending input cleared. Cannot mix with commands.");
-        }
-        buffer.clear();
-
-        slice.off += 1;
-        if (peek_char_FildeshX(&slice, '(')) {
-          rendezllama::slurp_sxpb_dynamic_options_close_FildeshX(&slice, opt);
-        }
-        else if (skipstr_FildeshX(&slice, "opt")) {
-          rendezllama::print_options(eout, opt);
-        }
-        else if (
-            skipstr_FildeshX(&slice, "forget") ||
-            skipstr_FildeshX(&slice, "rollforget"))
-        {
-          unsigned n = 10;
-          {
-            int tmp_n = 0;
-            if (skipchrs_FildeshX(&slice, opt.command_delim_chars) &&
-                parse_int_FildeshX(&slice, &tmp_n) &&
-                tmp_n > 0)
-            {
-              n = tmp_n;
-            }
-            else {
-              eout << "Ignoring /forget command without line count.\n"; eout.flush();
-              continue;
-            }
-          }
-          for (unsigned i = chat_traj.priming_token_count_;
-               i < chat_traj.token_count();
-               ++i)
-          {
-            if (vocabulary.last_char_of(chat_tokens[i]) == '\n') {
-              n -= 1;
-              if (n == 0) {
-                chat_traj.rollforget(i+1, vocabulary);
-                break;
-              }
-            }
-          }
-          if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
-            exstatus = 1;
-            break;
-          }
-        }
-        else if (maybe_do_head_command(&slice, eout, vocabulary, chat_traj, opt)) {
-          // Nothing else.
-        }
-        else if (maybe_do_tail_command(&slice, eout, vocabulary, chat_traj, opt)) {
-          // Nothing else.
-        }
-        else if (rendezllama::maybe_do_back_command(
-                chat_traj, &slice, eout, vocabulary, opt))
-        {
-          oss.truncate();
-          vocabulary.detokenize_to(oss, chat_tokens.back());
-          matched_antiprompt = rendezllama::antiprompt_suffix(
-              oss.view(),
-              opt.antiprompts);
-        }
-        else if (skipstr_FildeshX(&slice, "puts ") ||
-                 (slice.off + 4 == slice.size &&
-                  skipstr_FildeshX(&slice, "puts")))
-        {
-          chat_traj.tokenize_append(
-              fildesh::make_string(slice) + '\n',
-              vocabulary);
-          matched_antiprompt = '\n';
-          // Might as well process now.
-          chat_traj.display_token_count_ = chat_traj.token_count();
-          if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
-            exstatus = 1;
-            break;
-          }
-        }
-        else if (skipstr_FildeshX(&slice, "gets ") ||
-                 (slice.off + 4 == slice.size &&
-                  skipstr_FildeshX(&slice, "gets")))
-        {
-          preventing_newline = true;
-          matched_antiprompt.clear();  // For clarity.
-          line_byte_limit = 0;
-          int tmp_n = 0;
-          if (parse_int_FildeshX(&slice, &tmp_n) && tmp_n > 0) {
-            line_byte_limit = (unsigned)tmp_n;
-          }
-          skipchrs_FildeshX(&slice, " ");
-          // Prefix with user text.
-          chat_traj.tokenize_append(
-              fildesh::make_string_view(slice),
-              vocabulary);
-          // Set this index so token generation stops after 1 line.
-          chat_traj.message_prefix_id_ = opt.message_opts.size();
-          // Not printing any inserted text.
-          chat_traj.display_token_count_ = chat_traj.token_count();
-          break;
-        }
-        else if (rendezllama::maybe_do_delete_command(&slice, chat_traj, opt)) {
-          matched_antiprompt = '\n';
-        }
-        else if (rendezllama::maybe_do_delete_inline_command(
-                &slice, chat_traj, vocabulary, opt)) {
-          matched_antiprompt = '\n';
-        }
-        else if (rendezllama::maybe_do_regen_command(&slice, chat_traj, opt)) {
-          preventing_newline = true;
-          matched_antiprompt.clear();  // For clarity.
-          break;
-        }
-        else if (rendezllama::maybe_do_regen_inline_command(
-                &slice, chat_traj, opt)) {
-          preventing_newline = true;
-          matched_antiprompt.clear();  // For clarity.
-          break;
-        }
-        else if (rendezllama::maybe_parse_yield_command(buffer, &slice, opt)) {
-          break;
-        }
-        else {
-          eout << "Unknown command: "
-            << fildesh::make_string_view(slice) << '\n';
-          eout.flush();
-        }
-      }
-      // Break out of main loop when no more input.
-      if (exstatus != 0 || !slice.at) {break;}
-
-      if (buffer.length() > 0) {
-        rendezllama::augment_tokenize_chat_input(
-            chat_guide,
-            chat_traj,
-            preventing_newline,
-            buffer,
-            vocabulary,
-            opt);
-      }
     }
   }
-
-  close_FildeshX(in);
+  // Keep the whole trajectory in the session log before forgetting it.
+  chat_traj.end_session_out();
   if (exstatus == 0) {
     chat_traj.rollforget(chat_traj.token_count(), vocabulary);
   }
+  // Summarize where time went.
+  rendezllama::latency_stats().print_to(eout);
+  eout.flush();
+  maybe_write_trace(opt);
+  if (model_loading.valid()) {
+    // Never awaited because of an earlier error.
+    std::tie(model, ctx) = model_loading.get();
+  }
   if (ctx) {llama_free(ctx);}
   if (model) {llama_model_free(model);}
+  if (vocabulary_model) {llama_model_free(vocabulary_model);}
   return exstatus;
 }
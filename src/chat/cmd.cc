@@ -75,6 +75,7 @@ rendezllama::maybe_do_back_command(
   parse_unsigned_FildeshX(in, &n);
   bool skipping_contiguous_space = space_delim_on;
   fildesh::ostringstream oss;
+  chat_traj.push_checkpoint();
   while (n > 0) {
     if (chat_traj.token_count() <= chat_traj.priming_token_count_) {
       break;
@@ -116,6 +117,7 @@ rendezllama::maybe_do_delete_command(
   if (offset > chat_traj.priming_token_count_) {
     offset = chat_traj.rfind_message_prefix_begin_at(offset-1);
   }
+  chat_traj.push_checkpoint();
   chat_traj.erase_all_at(offset);
   return true;
 }
@@ -143,6 +145,7 @@ rendezllama::maybe_do_delete_inline_command(
       n -= 1;
     }
   }
+  chat_traj.push_checkpoint();
   chat_traj.erase_all_at(offset);
   return true;
 }
@@ -183,6 +186,7 @@ rendezllama::maybe_do_regen_command(
     return false;
   }
   size_t offset = chat_traj.rfind_last_message_prefix_end_at(chat_traj.token_count()-1);
+  chat_traj.push_checkpoint();
   chat_traj.erase_all_at(offset);
   return true;
 }
@@ -204,6 +208,28 @@ rendezllama::maybe_do_regen_inline_command(
   return true;
 }
 
+  bool
+rendezllama::maybe_do_undo_command(
+    ChatTrajectory& chat_traj,
+    FildeshX* in,
+    std::ostream& out,
+    const Vocabulary& vocabulary,
+    const ChatOptions& opt)
+{
+  if (!skip_cmd_prefix(in, "undo", opt)) {
+    return false;
+  }
+  if (!chat_traj.undo_checkpoint()) {
+    out << "Nothing to undo.\n";
+    out.flush();
+    return true;
+  }
+  // Restored text is shown here instead of as new output.
+  chat_traj.display_token_count_ = chat_traj.token_count();
+  print_tail_lines(out, vocabulary, chat_traj, 1);
+  return true;
+}
+
   bool
 rendezllama::maybe_do_tail_command(
     FildeshX* in,
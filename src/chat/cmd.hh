@@ -49,6 +49,13 @@ maybe_do_regen_inline_command(
     ChatTrajectory& chat_traj,
     const ChatOptions& opt);
 bool
+maybe_do_undo_command(
+    ChatTrajectory& chat_traj,
+    FildeshX* in,
+    std::ostream& out,
+    const Vocabulary& vocabulary,
+    const ChatOptions& opt);
+bool
 maybe_do_tail_command(
     FildeshX* in,
     std::ostream& out,
@@ -1,17 +1,56 @@
 #include "display.hh"
 
 #include <cassert>
+#include <chrono>
+#include <cstring>
 
 #include <fildesh/fildesh.h>
 
+#include "src/language/latency.hh"
+
 using rendezllama::ChatDisplay;
+using rendezllama::ChatDisplayStreambuf;
 using rendezllama::ChatTrajectory;
+using rendezllama::LatencyPhase;
+using rendezllama::LatencyTimer;
+using rendezllama::TraceSpan;
 using rendezllama::Vocabulary;
 
 ChatDisplay::~ChatDisplay() {
   close_FildeshO(out_);
 }
 
+/** Microseconds on a monotonic clock, split into low and high words.**/
+static
+  void
+put_timestamp_words(unsigned* words)
+{
+  const uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  words[0] = (unsigned)(t & 0xFFFFFFFF);
+  words[1] = (unsigned)(t >> 32);
+}
+
+/** Write a frame: kind, payload byte count, words, then text.**/
+  void
+ChatDisplay::put_frame(
+    unsigned kind, const unsigned* words, unsigned word_count,
+    std::string_view text)
+{
+  const unsigned head[2] = {
+    kind,
+    (unsigned)(sizeof(unsigned) * word_count + text.size()),
+  };
+  char* s = grow_FildeshO(out_, sizeof(head) + head[1]);
+  memcpy(s, head, sizeof(head));
+  s += sizeof(head);
+  memcpy(s, words, sizeof(unsigned) * word_count);
+  s += sizeof(unsigned) * word_count;
+  if (!text.empty()) {
+    memcpy(s, text.data(), text.size());
+  }
+}
+
   void
 ChatDisplay::displaystring_to(
     FildeshO* out,
@@ -33,6 +72,8 @@ ChatDisplay::show_new(
     const Vocabulary& vocabulary)
 {
   assert(end <= chat_traj.token_count());
+  if (chat_traj.display_token_count_ >= end) {return;}
+  LatencyTimer timer(LatencyPhase::display, end - chat_traj.display_token_count_);
   while (chat_traj.display_token_count_ < end) {
     const ChatTrajectory::size_type i = chat_traj.display_token_count_;
     chat_traj.display_token_count_ += 1;
@@ -42,9 +83,25 @@ ChatDisplay::show_new(
     {
       continue;
     }
-    this->displaystring_to(out_, chat_traj.token_at(i), vocabulary);
+    if (!framing_on_) {
+      this->displaystring_to(out_, chat_traj.token_at(i), vocabulary);
+      continue;
+    }
+    unsigned words[4] = {
+      (unsigned)chat_traj.token_at(i),
+      chat_traj.last_message_prefix_id_at(i+1),
+      0, 0,
+    };
+    put_timestamp_words(&words[2]);
+    frame_oss_.truncate();
+    this->displaystring_to(frame_oss_.c_struct(), chat_traj.token_at(i), vocabulary);
+    this->put_frame(1, words, 4, frame_oss_.view());
+  }
+  if (!framing_on_) {
+    // Frames are flushed at the end of each turn instead.
+    TraceSpan span("display_flush");
+    flush_FildeshO(out_);
   }
-  flush_FildeshO(out_);
 }
 
   void
@@ -56,6 +113,72 @@ ChatDisplay::show_new(
   assert(chat_traj.display_token_count_ == chat_traj.token_count());
 }
 
+/** Mark the end of a reply when framing. Text output has no marker.**/
+  void
+ChatDisplay::show_end_of_turn()
+{
+  if (!framing_on_) {return;}
+  unsigned words[2];
+  put_timestamp_words(words);
+  this->put_frame(2, words, 2, std::string_view());
+  TraceSpan span("display_flush");
+  flush_FildeshO(out_);
+}
+
+/** Report an error to a client reading frames.**/
+  void
+ChatDisplay::show_error(std::string_view message)
+{
+  if (!framing_on_) {return;}
+  unsigned words[2];
+  put_timestamp_words(words);
+  this->put_frame(3, words, 2, message);
+  flush_FildeshO(out_);
+}
+
+/** Show text that isn't part of the chat, like command output.**/
+  void
+ChatDisplay::show_text(std::string_view text)
+{
+  if (!framing_on_) {
+    if (!text.empty()) {
+      memcpy(grow_FildeshO(out_, text.size()), text.data(), text.size());
+    }
+  }
+  else {
+    unsigned words[2];
+    put_timestamp_words(words);
+    this->put_frame(4, words, 2, text);
+  }
+  flush_FildeshO(out_);
+}
+
+  ChatDisplayStreambuf::int_type
+ChatDisplayStreambuf::overflow(int_type c)
+{
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    text_.push_back(traits_type::to_char_type(c));
+  }
+  return traits_type::not_eof(c);
+}
+
+  std::streamsize
+ChatDisplayStreambuf::xsputn(const char* s, std::streamsize n)
+{
+  text_.append(s, n);
+  return n;
+}
+
+  int
+ChatDisplayStreambuf::sync()
+{
+  if (!text_.empty()) {
+    chat_disp_.show_text(text_);
+    text_.clear();
+  }
+  return 0;
+}
+
   void
 ChatDisplay::maybe_insert_answer_prompt(
     ChatTrajectory& chat_traj,
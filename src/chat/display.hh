@@ -1,5 +1,11 @@
 #ifndef RENDEZLLAMA_CHAT_DISPLAY_HH_
 #define RENDEZLLAMA_CHAT_DISPLAY_HH_
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+#include <fildesh/string.hh>
+
 #include "src/chat/trajectory.hh"
 
 namespace rendezllama {
@@ -23,11 +29,43 @@ class ChatDisplay {
   void maybe_insert_answer_prompt(ChatTrajectory& chat_traj,
                                   const Vocabulary& vocabulary);
   void maybe_remove_answer_prompt(ChatTrajectory& chat_traj, bool inputting);
+  void show_end_of_turn();
+  void show_error(std::string_view message);
+  void show_text(std::string_view text);
+
+ private:
+  void put_frame(unsigned kind, const unsigned* words, unsigned word_count,
+                 std::string_view text);
 
  public:
   FildeshO* out_ = nullptr;
   unsigned answer_prompt_offset_ = 0;
   std::vector<Vocabulary::Token_id> answer_prompt_tokens_;
+  // Write binary frames instead of text. See doc/setting/stdio.md.
+  bool framing_on_ = false;
+
+ private:
+  fildesh::ostringstream frame_oss_;
+};
+
+/** Stream buffer that shows its text with a ChatDisplay on every flush.
+ *
+ * Lets command output reach a client instead of the server's stderr.
+ **/
+class ChatDisplayStreambuf : public std::streambuf {
+ public:
+  explicit ChatDisplayStreambuf(ChatDisplay& chat_disp)
+    : chat_disp_(chat_disp)
+  {}
+
+ protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char* s, std::streamsize n) override;
+  int sync() override;
+
+ private:
+  ChatDisplay& chat_disp_;
+  std::string text_;
 };
 
 }  // namespace rendezllama
@@ -0,0 +1,83 @@
+#include "src/chat/input.hh"
+
+using rendezllama::ChatInput;
+
+/** Start reading lines. Takes ownership of `in`.**/
+ChatInput::ChatInput(FildeshX* in, char command_prefix_char)
+  : state_(std::make_shared<State>())
+  , thread_(read_lines, state_, in, command_prefix_char)
+{}
+
+ChatInput::~ChatInput()
+{
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    done = state_->done;
+  }
+  if (done) {
+    thread_.join();
+  }
+  else {
+    // Still blocked on a read. It closes the input once the read ends.
+    thread_.detach();
+  }
+}
+
+  void
+ChatInput::read_lines(
+    std::shared_ptr<State> state,
+    FildeshX* in,
+    char command_prefix_char)
+{
+  const std::string stop_command = std::string(1, command_prefix_char) + "stop";
+  const std::string cancel_command = std::string(1, command_prefix_char) + "cancel";
+  FildeshX slice;
+  for (slice = sliceline_FildeshX(in); slice.at;
+       slice = sliceline_FildeshX(in))
+  {
+    std::string line(slice.at, slice.size);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if ((line == stop_command || line == cancel_command) &&
+        !state->waiting && state->lines.empty())
+    {
+      // Something is running since nothing is waiting on input.
+      state->stopping = true;
+      continue;
+    }
+    state->lines.push_back(std::move(line));
+    state->cond.notify_one();
+  }
+  close_FildeshX(in);
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->done = true;
+  state->cond.notify_one();
+}
+
+/** Wait for the next line.
+ *
+ * Like sliceline_FildeshX(), the result has a NULL `at` at end of input.
+ * It stays valid until the next call.
+ **/
+  FildeshX
+ChatInput::sliceline()
+{
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  // Asking for input means nothing is running, so there is nothing to stop.
+  state_->stopping = false;
+  state_->waiting = true;
+  state_->cond.wait(lock, [this]() {
+    return state_->done || !state_->lines.empty();
+  });
+  state_->waiting = false;
+  FildeshX slice = FildeshX_of_strlit("");
+  if (state_->lines.empty()) {
+    slice.at = NULL;
+    return slice;
+  }
+  line_ = std::move(state_->lines.front());
+  state_->lines.pop_front();
+  slice.at = &line_[0];
+  slice.size = line_.size();
+  return slice;
+}
@@ -0,0 +1,53 @@
+#ifndef RENDEZLLAMA_CHAT_INPUT_HH_
+#define RENDEZLLAMA_CHAT_INPUT_HH_
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fildesh/fildesh.h>
+
+namespace rendezllama {
+
+/** Reads input lines on a separate thread.
+ *
+ * This lets a `/stop` or `/cancel` command interrupt token generation
+ * or a long prefill without waiting for the chat loop to ask for input.
+ **/
+class ChatInput {
+ public:
+  ChatInput(FildeshX* in, char command_prefix_char);
+  ChatInput(const ChatInput&) = delete;
+  ~ChatInput();
+  ChatInput& operator=(const ChatInput&) = delete;
+
+  FildeshX sliceline();
+  const std::atomic<bool>* stop_flag() const {return &state_->stopping;}
+  bool stop_requested() const {return state_->stopping.load();}
+
+ private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::string> lines;
+    bool done = false;
+    bool waiting = false;
+    std::atomic<bool> stopping{false};
+  };
+
+  static void read_lines(
+      std::shared_ptr<State> state,
+      FildeshX* in,
+      char command_prefix_char);
+
+ private:
+  std::shared_ptr<State> state_;
+  std::thread thread_;
+  std::string line_;
+};
+
+}  // namespace rendezllama
+#endif
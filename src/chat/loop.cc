@@ -0,0 +1,587 @@
+#include "src/chat/loop.hh"
+
+#include <chrono>
+#include <cstring>
+
+#include <fildesh/ostream.hh>
+#include <fildesh/string.hh>
+
+#include "src/chat/cmd.hh"
+#include "src/chat/display.hh"
+#include "src/chat/guide.hh"
+#include "src/chat/input.hh"
+#include "src/chat/memory.hh"
+#include "src/chat/metrics.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/session.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/latency.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatDisplay;
+using rendezllama::ChatGuide;
+using rendezllama::ChatInput;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::MappedFile;
+using rendezllama::MemoryMonitor;
+using rendezllama::MemoryUsage;
+using rendezllama::MetricsLog;
+using rendezllama::ToolFlag;
+using rendezllama::Vocabulary;
+
+/** Log callback for tools that keep llama.cpp quiet.**/
+  void
+rendezllama::noop_log_callback(
+    enum ggml_log_level level,
+    const char* text,
+    void* user_data)
+{
+  (void) level;
+  (void) text;
+  (void) user_data;
+}
+
+/** Take a tool's own flags, leaving the rest for parse_options().
+ *
+ * Returns a nonzero exit status if a flag's argument is bad.
+ **/
+  int
+rendezllama::take_tool_flags(
+    std::vector<char*>& chat_argv,
+    int argc,
+    char** argv,
+    const std::vector<ToolFlag>& flags)
+{
+  chat_argv.assign(1, argv[0]);
+  for (int argi = 1; argi < argc; ++argi) {
+    const ToolFlag* flag = nullptr;
+    if (argi + 1 < argc) {
+      for (const ToolFlag& f : flags) {
+        if (0 == strcmp(f.name, argv[argi])) {
+          flag = &f;
+          break;
+        }
+      }
+    }
+    if (!flag) {
+      chat_argv.push_back(argv[argi]);
+      continue;
+    }
+    argi += 1;
+    if (flag->text) {
+      *flag->text = argv[argi];
+      continue;
+    }
+    int n = 0;
+    if (fildesh_parse_int(&n, argv[argi]) && n >= (int)flag->count_min) {
+      *flag->count = n;
+    }
+    else {
+      fildesh_log_errorf(
+          "%s needs %s arg", flag->name,
+          (flag->count_min > 0 ? "positive" : "nonnegative"));
+      return 64;
+    }
+  }
+  return 0;
+}
+
+/** Apply token aliases from the options.
+ *
+ * Returns false if a special token is unknown.
+ **/
+  bool
+rendezllama::assign_vocabulary_substitution(
+    Vocabulary& vocabulary,
+    const ChatOptions& opt)
+{
+  bool all_good = true;
+  const auto& substitution = opt.substitution;
+  if (!substitution.bos_token_alias.empty()) {
+    vocabulary.assign_substitution(
+        substitution.bos_token_alias, vocabulary.bos_token_id());
+  }
+  if (!substitution.eos_token_alias.empty()) {
+    vocabulary.assign_substitution(
+        substitution.eos_token_alias, vocabulary.eos_token_id());
+  }
+  for (const auto& special : substitution.special_tokens) {
+    Vocabulary::Token_id token_id = Vocabulary::null_token_id;
+    for (const auto& name : special.candidates) {
+      token_id = vocabulary.tokenize_special(name);
+      if (token_id != Vocabulary::null_token_id) {break;}
+    }
+    if (token_id != Vocabulary::null_token_id) {
+      vocabulary.assign_substitution(special.alias, token_id);
+    }
+    else {
+      all_good = false;
+      fildesh_log_errorf("Unknown special token: %s", special.alias.c_str());
+    }
+  }
+  return all_good;
+}
+
+/** Tokenize the priming prompt, returning the first token separately.**/
+  Vocabulary::Token_id
+rendezllama::tokenize_priming_prompt(
+    std::vector<Vocabulary::Token_id>& priming_tokens,
+    const ChatOptions& opt,
+    const Vocabulary& vocabulary,
+    const struct llama_model* model)
+{
+  Vocabulary::Token_id first_priming_token_id = vocabulary.bos_token_id();
+  vocabulary.tokenize_to(priming_tokens, opt.priming_prompt);
+  if (!priming_tokens.empty()) {
+    auto begin = priming_tokens.begin();
+    if (0 != llama_vocab_get_add_bos(llama_model_get_vocab(model))) {
+      if (*begin == vocabulary.bos_token_id()) {
+        priming_tokens.erase(begin, begin+1);
+      }
+    }
+    else {
+      first_priming_token_id = *begin;
+      priming_tokens.erase(begin, begin+1);
+    }
+  }
+  return first_priming_token_id;
+}
+
+/** Start a chat with the priming and rolling prompts.**/
+  void
+rendezllama::prime_chat_trajectory(
+    ChatTrajectory& chat_traj,
+    ChatGuide& chat_guide,
+    const std::vector<Vocabulary::Token_id>& priming_tokens,
+    const ChatOptions& opt,
+    const Vocabulary& vocabulary)
+{
+  chat_traj.insert_all_at(1, priming_tokens);
+  // No need for --keep, we just directly compute the priming prompt number of tokens.
+  chat_traj.priming_token_count_ = chat_traj.token_count();
+  chat_traj.tokenize_append(opt.rolling_prompt, vocabulary);
+  chat_traj.message_prefix_id_ = 0;
+  chat_guide.yield_turn(1);
+}
+
+/** Generate and take commands until the input ends.
+ *
+ * Takes ownership of `in`, which is read on a separate thread.
+ * Returns a nonzero exit status on failure.
+ **/
+  int
+rendezllama::chat_loop(
+    FildeshX* in,
+    std::ostream& eout,
+    struct llama_context*& ctx,
+    ChatOptions& opt,
+    const Vocabulary& vocabulary,
+    ChatDisplay& chat_disp,
+    ChatTrajectory& chat_traj,
+    ChatGuide& chat_guide,
+    Inference& inference)
+{
+  int exstatus = 0;
+  const llama_model* model = llama_get_model(ctx);
+  const std::vector<Vocabulary::Token_id>& chat_tokens = chat_traj.tokens();
+  // Computed on first /save or /load because it walks the whole vocabulary.
+  bool vocabulary_fingerprint_on = false;
+  uint64_t vocabulary_fingerprint = 0;
+  unsigned line_byte_limit = 0;
+  unsigned line_byte_count = 0;
+  unsigned sentence_count = 0;
+  unsigned sentence_token_count = 0;
+  bool preventing_newline = false;
+  // Skip straight to user input when in coprocess mode.
+  bool token_generation_on = !opt.coprocess_mode_on;
+  fildesh::ostringstream oss;
+  // Lives across iterations so that copying into it never allocates.
+  std::string matched_antiprompt;
+  ChatInput input(in, opt.command_prefix_char);
+  inference.watch_stop_flag(input.stop_flag());
+  // Times each reply from the end of input to its first and later tokens.
+  std::chrono::steady_clock::time_point reply_time =
+    std::chrono::steady_clock::now();
+  bool awaiting_first_token = true;
+  MemoryMonitor memory_monitor;
+  MemoryUsage memory_usage;
+  MetricsLog metrics_log;
+  if (!opt.metrics_filename.empty() &&
+      !metrics_log.open(opt.metrics_filename))
+  {
+    fildesh_log_warning("Cannot open o_metrics file.");
+  }
+
+  while (exstatus == 0) {
+    if (opt.coprocess_mode_on) {
+      // Print nothing except for prompted.
+      chat_traj.display_token_count_ = chat_traj.token_count();
+    }
+    chat_disp.maybe_insert_answer_prompt(chat_traj, vocabulary);
+    if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+      exstatus = 1;
+      break;
+    }
+
+    bool inputting = false;
+    bool replying = true;
+    bool stopping = false;
+    matched_antiprompt.clear();
+    if (!token_generation_on) {
+      // Just skip the first token.
+      token_generation_on = true;
+      inputting = true;
+      replying = false;
+    }
+    else if (input.stop_requested()) {
+      // Keep whatever was generated or evaluated before the /stop.
+      stopping = true;
+      inputting = true;
+    }
+    else {
+      if (!inference.sample_to_trajectory(chat_traj, preventing_newline)) {
+        exstatus = 1;
+        break;
+      }
+      preventing_newline = false;
+
+      chat_disp.show_new(chat_traj, vocabulary);
+      const std::chrono::steady_clock::time_point token_time =
+        std::chrono::steady_clock::now();
+      latency_stats().record(
+          awaiting_first_token
+          ? LatencyPhase::first_token
+          : LatencyPhase::inter_token,
+          token_time - reply_time);
+      reply_time = token_time;
+      awaiting_first_token = false;
+
+      oss.truncate();
+      chat_disp.displaystring_to(oss.c_struct(), chat_traj.token(), vocabulary);
+      const std::string_view s = oss.view();
+      line_byte_count += s.size();
+      // Check if each of the reverse prompts appears at the end of the output.
+      // We use single-character antiprompts, so they aren't split across tokens.
+      // (If we used longer antiprompts, they could be split across iterations.)
+      matched_antiprompt = antiprompt_suffix(s, opt.antiprompts);
+    }
+
+    if (stopping) {
+      chat_disp.show_new(chat_traj, vocabulary);
+    }
+    else if (line_byte_limit > 0 && line_byte_count >= line_byte_limit) {
+      inputting = true;
+      chat_guide.end_turn();
+      if (matched_antiprompt != "\n") {
+        chat_disp.show_new(chat_traj, vocabulary);
+      }
+    }
+    else if (chat_guide.maybe_yield_turn()) {
+      if (matched_antiprompt != "\n") {
+        matched_antiprompt = "\n";
+      }
+      if (chat_traj.message_prefix_id_ == 0) {
+        inputting = true;
+      }
+      chat_disp.show_new(chat_traj, vocabulary);
+      sentence_count = 0;
+      sentence_token_count = 0;
+    }
+    else if (!matched_antiprompt.empty()) {
+      if (sentence_count + 1 == opt.sentence_limit) {
+        // Reached the limit on number of sentences.
+        inputting = true;
+      }
+      else {
+        sentence_count += 1;
+        sentence_token_count = 0;
+      }
+    }
+    else {
+      if (sentence_token_count + 1 == opt.sentence_token_limit) {
+        // Reached the limit on number of tokens in a sentence.
+        inputting = true;
+      }
+      else {
+        sentence_token_count += 1;
+      }
+    }
+
+    chat_disp.maybe_remove_answer_prompt(chat_traj, inputting);
+
+    if (inputting) {
+      if (replying) {
+        chat_disp.show_end_of_turn();
+        if (metrics_log.is_open()) {
+          memory_monitor.sample(memory_usage, opt, ctx, chat_traj, vocabulary);
+          metrics_log.put_turn(
+              inference, chat_traj, opt.context_token_limit, memory_usage);
+        }
+      }
+      line_byte_count = 0;
+      sentence_token_count = 0;
+      sentence_count = 0;
+
+      std::string buffer;
+
+      FildeshX slice;
+      for (slice = input.sliceline(); slice.at;
+           slice = input.sliceline())
+      {
+        if (slice.size == 0) {break;}
+
+        if (!peek_char_FildeshX(&slice, opt.command_prefix_char)) {
+          if (slice.at[slice.size-1] == '\\') {
+            // Overwrite the continue character.
+            slice.at[slice.size-1] = '\n';
+            buffer += fildesh::make_string_view(slice);
+            continue;
+          }
+          if (slice.at[0] == ' ' && buffer.empty() && matched_antiprompt == "\n") {
+            // Prepare to append to the previous message.
+            chat_guide.maybe_erase_trailing_message_prefix();
+            chat_guide.maybe_erase_trailing_message_suffix();
+            matched_antiprompt.clear();
+          }
+          buffer += fildesh::make_string_view(slice);
+          break;
+        }
+
+        if (!buffer.empty()) {
+          fildesh_log_warning("Pending input cleared. Cannot mix with commands.");
+        }
+        buffer.clear();
+
+        slice.off += 1;
+        if (peek_char_FildeshX(&slice, '(')) {
+          slurp_sxpb_dynamic_options_close_FildeshX(&slice, opt);
+          inference.reconfigure_sampling();
+        }
+        else if (skipstr_FildeshX(&slice, "opt")) {
+          print_options(eout, opt);
+        }
+        else if (skipstr_FildeshX(&slice, "stats")) {
+          latency_stats().print_to(eout);
+          eout.flush();
+        }
+        else if (skipstr_FildeshX(&slice, "mem")) {
+          memory_monitor.sample(memory_usage, opt, ctx, chat_traj, vocabulary);
+          print_memory_usage(eout, memory_usage);
+          if (opt.memory_plan.context_token_limit > 0) {
+            print_memory_plan(eout, opt.memory_plan);
+          }
+          eout.flush();
+        }
+        else if (skipstr_FildeshX(&slice, "trace ") ||
+                 (slice.off + 5 == slice.size &&
+                  skipstr_FildeshX(&slice, "trace")))
+        {
+          std::string filename = fildesh::make_string(slice);
+          if (filename.empty()) {
+            filename = opt.trace_filename;
+          }
+          if (!trace_buffer().enabled()) {
+            eout << "Tracing is off. Enable it with o_trace.\n";
+            eout.flush();
+          }
+          else if (!filename.empty()) {
+            fildesh::ofstream trace_out(filename);
+            trace_buffer().write_chrome_trace_to(trace_out);
+          }
+        }
+        else if (
+            skipstr_FildeshX(&slice, "forget") ||
+            skipstr_FildeshX(&slice, "rollforget"))
+        {
+          unsigned n = 10;
+          {
+            int tmp_n = 0;
+            if (skipchrs_FildeshX(&slice, opt.command_delim_chars) &&
+                parse_int_FildeshX(&slice, &tmp_n) &&
+                tmp_n > 0)
+            {
+              n = tmp_n;
+            }
+            else {
+              eout << "Ignoring /forget command without line count.\n"; eout.flush();
+              continue;
+            }
+          }
+          for (unsigned i = chat_traj.priming_token_count_;
+               i < chat_traj.token_count();
+               ++i)
+          {
+            if (vocabulary.last_char_of(chat_tokens[i]) == '\n') {
+              n -= 1;
+              if (n == 0) {
+                chat_traj.rollforget(i+1, vocabulary);
+                break;
+              }
+            }
+          }
+          if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+            exstatus = 1;
+            break;
+          }
+        }
+        else if (maybe_do_head_command(&slice, eout, vocabulary, chat_traj, opt)) {
+          // Nothing else.
+        }
+        else if (maybe_do_tail_command(&slice, eout, vocabulary, chat_traj, opt)) {
+          // Nothing else.
+        }
+        else if (maybe_do_back_command(
+                chat_traj, &slice, eout, vocabulary, opt) ||
+                 maybe_do_undo_command(
+                     chat_traj, &slice, eout, vocabulary, opt))
+        {
+          oss.truncate();
+          vocabulary.detokenize_to(oss, chat_tokens.back());
+          matched_antiprompt = antiprompt_suffix(
+              oss.view(),
+              opt.antiprompts);
+        }
+        else if (skipstr_FildeshX(&slice, "save ")) {
+          const std::string filename = fildesh::make_string(slice);
+          if (!vocabulary_fingerprint_on) {
+            vocabulary_fingerprint = vocabulary.fingerprint();
+            vocabulary_fingerprint_on = true;
+          }
+          bool saved;
+          {
+            std::unique_lock<std::mutex> context_lock = inference.lock_sequence(ctx, chat_traj);
+            saved = save_chat_state(
+                filename, chat_traj, chat_disp, inference,
+                model, ctx, vocabulary_fingerprint);
+          }
+          if (!saved) {
+            eout << "Cannot save state to: " << filename << '\n';
+            eout.flush();
+            chat_disp.show_error("Cannot save state.");
+          }
+        }
+        else if (skipstr_FildeshX(&slice, "load ")) {
+          const std::string filename = fildesh::make_string(slice);
+          if (!vocabulary_fingerprint_on) {
+            vocabulary_fingerprint = vocabulary.fingerprint();
+            vocabulary_fingerprint_on = true;
+          }
+          MappedFile loading_in;
+          bool loaded = loading_in.open(filename);
+          if (loaded) {
+            std::unique_lock<std::mutex> context_lock = inference.lock_sequence(ctx, chat_traj);
+            loaded = load_chat_state(
+                loading_in.view(), chat_traj, chat_disp, inference,
+                model, ctx, opt, vocabulary_fingerprint);
+          }
+          if (!loaded) {
+            eout << "Cannot load state from: " << filename << '\n';
+            eout.flush();
+            chat_disp.show_error("Cannot load state.");
+            continue;
+          }
+          matched_antiprompt = '\n';
+          if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+            exstatus = 1;
+            break;
+          }
+        }
+        else if (skipstr_FildeshX(&slice, "puts ") ||
+                 (slice.off + 4 == slice.size &&
+                  skipstr_FildeshX(&slice, "puts")))
+        {
+          chat_traj.tokenize_append(
+              fildesh::make_string(slice) + '\n',
+              vocabulary);
+          matched_antiprompt = '\n';
+          // Not printing any inserted text.
+          // Evaluation waits for generation or /commit so that
+          // consecutive lines are evaluated together in full batches.
+          chat_traj.display_token_count_ = chat_traj.token_count();
+        }
+        else if (skipstr_FildeshX(&slice, "commit")) {
+          if (!inference.commit_to_context(ctx, chat_disp, chat_traj, opt, model)) {
+            exstatus = 1;
+            break;
+          }
+        }
+        else if (skipstr_FildeshX(&slice, "gets ") ||
+                 (slice.off + 4 == slice.size &&
+                  skipstr_FildeshX(&slice, "gets")))
+        {
+          preventing_newline = true;
+          matched_antiprompt.clear();  // For clarity.
+          line_byte_limit = 0;
+          int tmp_n = 0;
+          if (parse_int_FildeshX(&slice, &tmp_n) && tmp_n > 0) {
+            line_byte_limit = (unsigned)tmp_n;
+          }
+          skipchrs_FildeshX(&slice, " ");
+          // Prefix with user text.
+          chat_traj.tokenize_append(
+              fildesh::make_string_view(slice),
+              vocabulary);
+          // Set this index so token generation stops after 1 line.
+          chat_traj.message_prefix_id_ = opt.message_opts.size();
+          // Not printing any inserted text.
+          chat_traj.display_token_count_ = chat_traj.token_count();
+          break;
+        }
+        else if (maybe_do_delete_command(&slice, chat_traj, opt)) {
+          matched_antiprompt = '\n';
+        }
+        else if (maybe_do_delete_inline_command(
+                &slice, chat_traj, vocabulary, opt)) {
+          matched_antiprompt = '\n';
+        }
+        else if (maybe_do_regen_command(&slice, chat_traj, opt)) {
+          preventing_newline = true;
+          matched_antiprompt.clear();  // For clarity.
+          break;
+        }
+        else if (maybe_do_regen_inline_command(
+                &slice, chat_traj, opt)) {
+          preventing_newline = true;
+          matched_antiprompt.clear();  // For clarity.
+          break;
+        }
+        else if (maybe_parse_yield_command(buffer, &slice, opt)) {
+          break;
+        }
+        else if (skipstr_FildeshX(&slice, "stop") ||
+                 skipstr_FildeshX(&slice, "cancel"))
+        {
+          // Nothing was running to stop.
+        }
+        else {
+          eout << "Unknown command: "
+            << fildesh::make_string_view(slice) << '\n';
+          eout.flush();
+          chat_disp.show_error("Unknown command.");
+        }
+      }
+      // Break out of main loop when no more input.
+      if (exstatus != 0 || !slice.at) {break;}
+
+      if (buffer.length() > 0) {
+        augment_tokenize_chat_input(
+            chat_guide,
+            chat_traj,
+            preventing_newline,
+            buffer,
+            vocabulary,
+            opt);
+      }
+      reply_time = std::chrono::steady_clock::now();
+      awaiting_first_token = true;
+    }
+  }
+  inference.watch_stop_flag(nullptr);
+  if (exstatus != 0) {
+    chat_disp.show_error("Failed to eval.");
+  }
+  return exstatus;
+}
@@ -0,0 +1,73 @@
+#ifndef RENDEZLLAMA_CHAT_LOOP_HH_
+#define RENDEZLLAMA_CHAT_LOOP_HH_
+#include <ostream>
+#include <vector>
+
+#include <fildesh/fildesh.h>
+
+#include "llama.h"
+
+#include "src/language/vocabulary.hh"
+
+struct llama_context;
+struct llama_model;
+
+namespace rendezllama {
+
+struct ChatOptions;
+class ChatDisplay;
+class ChatGuide;
+class ChatTrajectory;
+class Inference;
+
+/** A flag that a tool takes besides the chat options.
+ *
+ * Its argument is either kept as `text` or parsed as a `count`
+ * that is at least `count_min`.
+ **/
+struct ToolFlag {
+  const char* name;
+  const char** text;
+  unsigned* count;
+  unsigned count_min;
+};
+
+void
+noop_log_callback(enum ggml_log_level level, const char* text, void* user_data);
+int
+take_tool_flags(
+    std::vector<char*>& chat_argv,
+    int argc,
+    char** argv,
+    const std::vector<ToolFlag>& flags);
+bool
+assign_vocabulary_substitution(
+    Vocabulary& vocabulary,
+    const ChatOptions& opt);
+Vocabulary::Token_id
+tokenize_priming_prompt(
+    std::vector<Vocabulary::Token_id>& priming_tokens,
+    const ChatOptions& opt,
+    const Vocabulary& vocabulary,
+    const struct llama_model* model);
+void
+prime_chat_trajectory(
+    ChatTrajectory& chat_traj,
+    ChatGuide& chat_guide,
+    const std::vector<Vocabulary::Token_id>& priming_tokens,
+    const ChatOptions& opt,
+    const Vocabulary& vocabulary);
+int
+chat_loop(
+    FildeshX* in,
+    std::ostream& eout,
+    struct llama_context*& ctx,
+    ChatOptions& opt,
+    const Vocabulary& vocabulary,
+    ChatDisplay& chat_disp,
+    ChatTrajectory& chat_traj,
+    ChatGuide& chat_guide,
+    Inference& inference);
+
+}  // namespace rendezllama
+#endif
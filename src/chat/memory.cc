@@ -0,0 +1,278 @@
+#include "src/chat/memory.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "src/chat/opt.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/vocabulary.hh"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using rendezllama::MemoryMonitor;
+using rendezllama::MemoryUsage;
+
+/** Sizes of buffers that llama.cpp logged, keyed by their names.
+ *
+ * A buffer logged again (like when the context grows) replaces the old size.
+ **/
+struct LlamaBufferSizes {
+  std::mutex mutex;
+  std::map<std::string, uint64_t> model;
+  std::map<std::string, uint64_t> kv;
+  std::map<std::string, uint64_t> compute;
+};
+
+static
+  LlamaBufferSizes&
+llama_buffer_sizes()
+{
+  static LlamaBufferSizes sizes;
+  return sizes;
+}
+
+static
+  uint64_t
+sum_buffer_sizes(const std::map<std::string, uint64_t>& buffers)
+{
+  uint64_t n = 0;
+  for (const auto& entry : buffers) {
+    n += entry.second;
+  }
+  return n;
+}
+
+/** Record buffer sizes from lines like
+ *   llama_kv_cache_init:        CPU KV buffer size =   512.00 MiB
+ * and discard everything else.
+ **/
+  void
+rendezllama::memory_log_callback(
+    enum ggml_log_level level, const char* text, void* user_data)
+{
+  (void) level;
+  (void) user_data;
+  static const char size_marker[] = " buffer size = ";
+  const char* size_text = strstr(text, size_marker);
+  if (!size_text) {return;}
+  const char* name_begin = strchr(text, ':');
+  if (!name_begin || name_begin > size_text) {return;}
+  name_begin += 1;
+  while (*name_begin == ' ') {name_begin += 1;}
+  const std::string name(name_begin, size_text - name_begin);
+
+  char* unit_text = nullptr;
+  const double mib = strtod(size_text + strlen(size_marker), &unit_text);
+  if (!unit_text || 0 != strncmp(unit_text, " MiB", 4)) {return;}
+  const uint64_t byte_count = (uint64_t)(mib * (1 << 20));
+
+  LlamaBufferSizes& sizes = llama_buffer_sizes();
+  std::lock_guard<std::mutex> lock(sizes.mutex);
+  const size_t kind_offset = name.rfind(' ');
+  const std::string kind = (
+      kind_offset == std::string::npos ? name : name.substr(kind_offset+1));
+  if (kind == "model") {
+    sizes.model[name] = byte_count;
+  }
+  else if (kind == "KV") {
+    sizes.kv[name] = byte_count;
+  }
+  else if (kind == "compute") {
+    sizes.compute[name] = byte_count;
+  }
+}
+
+#ifndef _WIN32
+/** Find where the model file is mapped by reading /proc/self/maps.**/
+static
+  bool
+find_mapped_file_range(
+    uintptr_t& begin, uintptr_t& end,
+    const std::string& filename)
+{
+  char* path = realpath(filename.c_str(), NULL);
+  if (!path) {return false;}
+  FILE* in = fopen("/proc/self/maps", "r");
+  if (!in) {
+    free(path);
+    return false;
+  }
+  bool found = false;
+  char line[4096];
+  while (fgets(line, sizeof(line), in)) {
+    unsigned long line_begin = 0, line_end = 0;
+    int path_offset = 0;
+    if (2 > sscanf(line, "%lx-%lx %*s %*s %*s %*s %n",
+                   &line_begin, &line_end, &path_offset) ||
+        path_offset == 0)
+    {
+      continue;
+    }
+    char* line_path = &line[path_offset];
+    line_path[strcspn(line_path, "\n")] = '\0';
+    if (0 != strcmp(line_path, path)) {continue;}
+    if (!found || line_begin < begin) {begin = line_begin;}
+    if (!found || line_end > end) {end = line_end;}
+    found = true;
+  }
+  fclose(in);
+  free(path);
+  return found;
+}
+
+/** Count resident bytes of a mapping without touching its pages.**/
+static
+  uint64_t
+resident_byte_count(uintptr_t begin, uintptr_t end)
+{
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  const uintptr_t chunk_page_count = 1 << 16;
+  std::vector<unsigned char> pages(chunk_page_count);
+  uint64_t n = 0;
+  for (uintptr_t p = begin; p < end; p += chunk_page_count * page_size) {
+    const uintptr_t chunk_size = std::min(end - p, chunk_page_count * page_size);
+#if defined(__APPLE__)
+    char* vec = (char*)pages.data();
+#else
+    unsigned char* vec = pages.data();
+#endif
+    if (0 != mincore((void*)p, chunk_size, vec)) {
+      return MemoryUsage::unknown_byte_count;
+    }
+    const uintptr_t page_count = (chunk_size + page_size - 1) / page_size;
+    for (uintptr_t i = 0; i < page_count; ++i) {
+      n += (pages[i] & 1);
+    }
+  }
+  return n * page_size;
+}
+
+static
+  uint64_t
+process_resident_byte_count()
+{
+  FILE* in = fopen("/proc/self/statm", "r");
+  if (!in) {return MemoryUsage::unknown_byte_count;}
+  unsigned long size = 0, resident = 0;
+  const bool good = (2 == fscanf(in, "%lu %lu", &size, &resident));
+  fclose(in);
+  if (!good) {return MemoryUsage::unknown_byte_count;}
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+  void
+MemoryMonitor::sample(
+    MemoryUsage& usage,
+    const ChatOptions& opt,
+    const struct llama_context* ctx,
+    const ChatTrajectory& chat_traj,
+    const Vocabulary& vocabulary)
+{
+  usage = MemoryUsage();
+  {
+    LlamaBufferSizes& sizes = llama_buffer_sizes();
+    std::lock_guard<std::mutex> lock(sizes.mutex);
+    if (!sizes.model.empty()) {
+      usage.model_mapped = 0;
+      usage.model_loaded = 0;
+    }
+    for (const auto& entry : sizes.model) {
+      if (entry.first.find("_Mapped") != std::string::npos) {
+        usage.model_mapped += entry.second;
+      }
+      else {
+        usage.model_loaded += entry.second;
+      }
+    }
+    if (!sizes.kv.empty()) {
+      usage.kv_capacity = sum_buffer_sizes(sizes.kv);
+    }
+    if (!sizes.compute.empty()) {
+      usage.compute = sum_buffer_sizes(sizes.compute);
+    }
+  }
+
+  usage.model = llama_model_size(llama_get_model(ctx));
+  // Cast because this version of llama.cpp takes a non-const context.
+  usage.context_state = llama_state_get_size(const_cast<llama_context*>(ctx));
+  usage.kv_token_capacity = llama_n_ctx(ctx);
+  usage.kv_token_count = chat_traj.context_token_count_;
+  if (usage.kv_capacity != MemoryUsage::unknown_byte_count &&
+      usage.kv_token_capacity > 0)
+  {
+    usage.kv_used = (
+        usage.kv_capacity * usage.kv_token_count / usage.kv_token_capacity);
+  }
+  usage.trajectory = chat_traj.allocated_byte_count();
+  if (vocabulary_byte_count_ == 0) {
+    vocabulary_byte_count_ = vocabulary.allocated_byte_count();
+  }
+  usage.vocabulary_estimate = vocabulary_byte_count_;
+
+#ifndef _WIN32
+  if (!model_range_found_ && opt.mmap_on) {
+    model_range_found_ = find_mapped_file_range(
+        model_begin_, model_end_, opt.model_filename);
+  }
+  if (model_range_found_) {
+    usage.model_resident = resident_byte_count(model_begin_, model_end_);
+  }
+  else if (!opt.mmap_on) {
+    usage.model_resident = 0;
+  }
+  usage.process_resident = process_resident_byte_count();
+#endif
+}
+
+static
+  void
+put_mib(std::ostream& out, uint64_t byte_count)
+{
+  if (byte_count == MemoryUsage::unknown_byte_count) {
+    out << "unknown";
+    return;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.1f MiB", byte_count / (double)(1 << 20));
+  out << buf;
+}
+
+  void
+rendezllama::print_memory_usage(std::ostream& out, const MemoryUsage& usage)
+{
+  out << "model: ";
+  put_mib(out, usage.model);
+  out << " of weights, ";
+  put_mib(out, usage.model_mapped);
+  out << " mapped (";
+  put_mib(out, usage.model_resident);
+  out << " resident), ";
+  put_mib(out, usage.model_loaded);
+  out << " loaded\n";
+  out << "kv_cache: ";
+  put_mib(out, usage.kv_capacity);
+  out << " for " << usage.kv_token_capacity << " tokens, ";
+  put_mib(out, usage.kv_used);
+  out << " used by " << usage.kv_token_count << " tokens\n";
+  out << "context_state: ";
+  put_mib(out, usage.context_state);
+  out << "\ncompute: ";
+  put_mib(out, usage.compute);
+  out << "\ntrajectory: ";
+  put_mib(out, usage.trajectory);
+  out << "\nvocabulary: ";
+  put_mib(out, usage.vocabulary_estimate);
+  out << " (estimate)";
+  out << "\nprocess_resident: ";
+  put_mib(out, usage.process_resident);
+  out << '\n';
+}
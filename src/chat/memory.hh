@@ -0,0 +1,71 @@
+#ifndef RENDEZLLAMA_CHAT_MEMORY_HH_
+#define RENDEZLLAMA_CHAT_MEMORY_HH_
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "llama.h"
+
+namespace rendezllama {
+
+struct ChatOptions;
+class ChatTrajectory;
+class Vocabulary;
+
+/** Bytes of memory that a chat uses, by what they hold.
+ *
+ * Sizes that could not be found are `unknown_byte_count`.
+ **/
+struct MemoryUsage {
+  static const uint64_t unknown_byte_count = ~(uint64_t)0;
+  // Model weights, and how many of them are mapped from the file
+  // or loaded into buffers.
+  uint64_t model = unknown_byte_count;
+  uint64_t model_mapped = unknown_byte_count;
+  uint64_t model_resident = unknown_byte_count;
+  uint64_t model_loaded = unknown_byte_count;
+  // KV cache of the whole context and of this session's evaluated tokens.
+  uint64_t kv_capacity = unknown_byte_count;
+  uint64_t kv_used = unknown_byte_count;
+  unsigned kv_token_capacity = 0;
+  unsigned kv_token_count = 0;
+  // Evaluated KV cache entries and logits of every sequence.
+  uint64_t context_state = unknown_byte_count;
+  uint64_t compute = unknown_byte_count;
+  uint64_t trajectory = unknown_byte_count;
+  // Guessed from the vocabulary size, not measured.
+  uint64_t vocabulary_estimate = unknown_byte_count;
+  uint64_t process_resident = unknown_byte_count;
+};
+
+/** Samples memory usage cheaply enough to do every turn.
+ *
+ * Model and state sizes come from llama.cpp's API.
+ * Buffer sizes come from llama.cpp's log messages,
+ * so memory_log_callback() should be the log callback before loading.
+ * If their format changes, those sizes are unknown.
+ **/
+class MemoryMonitor {
+ public:
+  void sample(
+      MemoryUsage& usage,
+      const ChatOptions& opt,
+      const struct llama_context* ctx,
+      const ChatTrajectory& chat_traj,
+      const Vocabulary& vocabulary);
+
+ private:
+  // Address range where the model file is mapped, found on first use.
+  bool model_range_found_ = false;
+  uintptr_t model_begin_ = 0;
+  uintptr_t model_end_ = 0;
+  uint64_t vocabulary_byte_count_ = 0;
+};
+
+void
+print_memory_usage(std::ostream& out, const MemoryUsage& usage);
+void
+memory_log_callback(enum ggml_log_level level, const char* text, void* user_data);
+
+}  // namespace rendezllama
+#endif
@@ -0,0 +1,130 @@
+#include "src/chat/metrics.hh"
+
+#include <cstring>
+#include <ctime>
+
+#include <fildesh/fildesh.h>
+
+#include "src/chat/memory.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/latency.hh"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+using rendezllama::LatencyPhase;
+using rendezllama::MetricsLog;
+
+/** Open a file for appending so many sessions can share it.**/
+  bool
+MetricsLog::open(const std::string& filename)
+{
+  this->close();
+#ifndef _WIN32
+  const int fd = ::open(
+      filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    out_ = open_fd_FildeshO(fd);
+  }
+#else
+  out_ = open_FildeshOF(filename.c_str());
+#endif
+  return (out_ != nullptr);
+}
+
+  void
+MetricsLog::close()
+{
+  if (out_) {
+    close_FildeshO(out_);
+    out_ = nullptr;
+  }
+}
+
+/** Write a byte count, or null when it is unknown.**/
+static
+  void
+put_byte_count(std::ostream& out, uint64_t byte_count)
+{
+  if (byte_count == rendezllama::MemoryUsage::unknown_byte_count) {
+    out << "null";
+  }
+  else {
+    out << byte_count;
+  }
+}
+
+static
+  void
+put_phase_milliseconds(
+    std::ostream& out,
+    const std::array<rendezllama::LatencyHistogram::Duration,
+                     (unsigned)LatencyPhase::count>& times)
+{
+  static const LatencyPhase phases[] = {
+    LatencyPhase::tokenize,
+    LatencyPhase::prefill,
+    LatencyPhase::decode,
+    LatencyPhase::sample,
+    LatencyPhase::display,
+  };
+  out << '{';
+  for (unsigned i = 0; i < sizeof(phases)/sizeof(*phases); ++i) {
+    if (i > 0) {out << ',';}
+    out << '"' << latency_phase_name(phases[i]) << "\":"
+      << std::chrono::duration<double, std::milli>(
+          times[(unsigned)phases[i]]).count();
+  }
+  out << '}';
+}
+
+/** Write what happened since the last turn and reset the counts.
+ *
+ * Times are for phases that ran on the calling thread.
+ **/
+  void
+MetricsLog::put_turn(
+    Inference& inference,
+    const ChatTrajectory& chat_traj,
+    unsigned context_token_limit,
+    const MemoryUsage& memory_usage)
+{
+  if (!out_) {return;}
+  const Inference::Counts& counts = inference.counts();
+  PhaseTimes& times = thread_phase_times();
+  oss_.truncate();
+  oss_
+    << "{\"turn\":" << turn_count_
+    << ",\"time\":" << (long long)time(NULL)
+    << ",\"prefill_tokens\":" << counts.prefill_token_count
+    << ",\"generated_tokens\":" << counts.generated_token_count
+    << ",\"redecoded_tokens\":" << counts.redecode_token_count
+    << ",\"rollforgets\":" << (chat_traj.rollforget_count_ - rollforget_count_)
+    << ",\"sampler_rebuilds\":" << counts.sampler_rebuild_count
+    << ",\"kv_tokens\":" << chat_traj.context_token_count_
+    << ",\"kv_token_limit\":" << context_token_limit
+    << ",\"kv_bytes\":";
+  put_byte_count(oss_, memory_usage.kv_used);
+  oss_ << ",\"model_resident_bytes\":";
+  put_byte_count(oss_, memory_usage.model_resident);
+  oss_ << ",\"trajectory_bytes\":";
+  put_byte_count(oss_, memory_usage.trajectory);
+  oss_ << ",\"process_resident_bytes\":";
+  put_byte_count(oss_, memory_usage.process_resident);
+  oss_ << ",\"wall_ms\":";
+  put_phase_milliseconds(oss_, times.wall);
+  oss_ << ",\"cpu_ms\":";
+  put_phase_milliseconds(oss_, times.cpu);
+  oss_ << "}\n";
+  // One write per line keeps lines whole when sessions share the file.
+  const std::string_view line = oss_.view();
+  memcpy(grow_FildeshO(out_, line.size()), line.data(), line.size());
+  flush_FildeshO(out_);
+
+  turn_count_ += 1;
+  rollforget_count_ = chat_traj.rollforget_count_;
+  inference.reset_counts();
+  times = PhaseTimes();
+}
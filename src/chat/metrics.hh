@@ -0,0 +1,42 @@
+#ifndef RENDEZLLAMA_CHAT_METRICS_HH_
+#define RENDEZLLAMA_CHAT_METRICS_HH_
+#include <string>
+
+#include <fildesh/string.hh>
+
+namespace rendezllama {
+
+class ChatTrajectory;
+class Inference;
+struct MemoryUsage;
+
+/** Appends one JSON line of metrics per turn.
+ *
+ * Lines are formatted and written once a turn ends,
+ * never while tokens are being evaluated or generated.
+ **/
+class MetricsLog {
+ public:
+  MetricsLog() {}
+  MetricsLog(const MetricsLog&) = delete;
+  ~MetricsLog() {this->close();}
+  MetricsLog& operator=(const MetricsLog&) = delete;
+
+  bool open(const std::string& filename);
+  void close();
+  bool is_open() const {return out_ != nullptr;}
+  void put_turn(
+      Inference& inference,
+      const ChatTrajectory& chat_traj,
+      unsigned context_token_limit,
+      const MemoryUsage& memory_usage);
+
+ private:
+  FildeshO* out_ = nullptr;
+  fildesh::ostringstream oss_;
+  unsigned turn_count_ = 0;
+  unsigned rollforget_count_ = 0;
+};
+
+}  // namespace rendezllama
+#endif
@@ -12,6 +12,8 @@
 #include "src/language/language_schema.hh"
 
 using rendezllama::ChatOptions;
+using rendezllama::MemoryPlan;
+using rendezllama::MemoryPlanRequest;
 
 ChatOptions::ChatOptions()
 {
@@ -131,6 +133,33 @@ ensure_linespace(std::string& s, bool startspace_on, bool linespace_on)
   }
 }
 
+/** Plan memory for the context settings that were given.**/
+  rendezllama::MemoryPlanRequest
+rendezllama::memory_plan_request(const ChatOptions& opt)
+{
+  MemoryPlanRequest request;
+  request.memory_budget_mib = opt.memory_budget_mib;
+  request.context_token_limit = opt.context_token_limit;
+  request.batch_count = opt.batch_count;
+  request.ubatch_count = opt.ubatch_count;
+  request.kv_cache_key_type = opt.kv_cache_key_type;
+  request.kv_cache_value_type = opt.kv_cache_value_type;
+  request.flash_attention_on = opt.flash_attention_on;
+  return request;
+}
+
+/** Use the context settings of a memory plan.**/
+  void
+rendezllama::apply_memory_plan(ChatOptions& opt, const MemoryPlan& plan)
+{
+  opt.context_token_limit = plan.context_token_limit;
+  opt.kv_cache_key_type = plan.kv_cache_key_type;
+  opt.kv_cache_value_type = plan.kv_cache_value_type;
+  opt.ubatch_count = plan.ubatch_count;
+  opt.flash_attention_on = (plan.flash_attention_on ? 1 : 0);
+  opt.memory_plan = plan;
+}
+
   void
 rendezllama::print_options(std::ostream& out, const rendezllama::ChatOptions& opt)
 {
@@ -189,6 +218,38 @@ static void reinitialize_chat_prefixes(ChatOptions& opt) {
 
 static int initialize_options(ChatOptions& opt) {
   int exstatus = 0;
+  if (!opt.server_socket_filename.empty() &&
+      !opt.fork_server_socket_filename.empty())
+  {
+    fildesh_log_error("Please choose either server_socket or fork_server.");
+    exstatus = 64;
+  }
+  if (!opt.server_socket_filename.empty() ||
+      !opt.fork_server_socket_filename.empty())
+  {
+    // Sessions are driven by commands like /puts and /gets.
+    opt.coprocess_mode_on = true;
+  }
+  if (!opt.fork_server_socket_filename.empty() &&
+      (!opt.session_out_filename.empty() || !opt.state_out_filename.empty()))
+  {
+    // Every forked session would write the same files.
+    fildesh_log_warning("Ignoring o_session and o_state with fork_server.");
+    opt.session_out_filename.clear();
+    opt.state_out_filename.clear();
+  }
+  if (!opt.kv_cache_key_type.empty() &&
+      0 == rendezllama::kv_cache_block_byte_count(opt.kv_cache_key_type))
+  {
+    fildesh_log_error("Unsupported kv_cache_key_type.");
+    exstatus = 64;
+  }
+  if (!opt.kv_cache_value_type.empty() &&
+      0 == rendezllama::kv_cache_block_byte_count(opt.kv_cache_value_type))
+  {
+    fildesh_log_error("Unsupported kv_cache_value_type.");
+    exstatus = 64;
+  }
   if (exstatus == 0 && opt.context_token_limit == 0) {
     opt.context_token_limit = opt.model_token_limit;
   }
@@ -289,6 +350,42 @@ rendezllama::parse_options(rendezllama::ChatOptions& opt, int argc, char** argv)
       opt.transcript_sibling_filename.clear();
       opt.transcript_filename = argv[argi];
     }
+    else if (0 == strcmp("--x_session", argv[argi])) {
+      argi += 1;
+      opt.session_in_filename = argv[argi];
+    }
+    else if (0 == strcmp("--o_metrics", argv[argi])) {
+      argi += 1;
+      opt.metrics_filename = argv[argi];
+    }
+    else if (0 == strcmp("--o_trace", argv[argi])) {
+      argi += 1;
+      opt.trace_filename = argv[argi];
+    }
+    else if (0 == strcmp("--o_session", argv[argi])) {
+      argi += 1;
+      opt.session_out_filename = argv[argi];
+    }
+    else if (0 == strcmp("--x_state", argv[argi])) {
+      argi += 1;
+      opt.state_in_filename = argv[argi];
+    }
+    else if (0 == strcmp("--o_state", argv[argi])) {
+      argi += 1;
+      opt.state_out_filename = argv[argi];
+    }
+    else if (0 == strcmp("--server_socket", argv[argi])) {
+      argi += 1;
+      opt.server_socket_filename = argv[argi];
+    }
+    else if (0 == strcmp("--server_spill_directory", argv[argi])) {
+      argi += 1;
+      opt.server_spill_dirname = argv[argi];
+    }
+    else if (0 == strcmp("--fork_server", argv[argi])) {
+      argi += 1;
+      opt.fork_server_socket_filename = argv[argi];
+    }
     else if (0 == strcmp("--x_answer", argv[argi])) {
       argi += 1;
       std::string content;
@@ -337,6 +434,69 @@ rendezllama::parse_options(rendezllama::ChatOptions& opt, int argc, char** argv)
         exstatus = 64;
       }
     }
+    else if (0 == strcmp("--framed_output_on", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi])) {
+        opt.framed_output_on = (n != 0);
+      }
+      else {
+        fildesh_log_error("--framed_output_on needs 1 or 0");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--context_growth_on", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi])) {
+        opt.context_growth_on = (n != 0);
+      }
+      else {
+        fildesh_log_error("--context_growth_on needs 1 or 0");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--ubatch_count", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi]) && n > 0) {
+        opt.ubatch_count = n;
+      }
+      else {
+        fildesh_log_error("--ubatch_count needs positive arg");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--memory_budget_mib", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi]) && n > 0) {
+        opt.memory_budget_mib = n;
+      }
+      else {
+        fildesh_log_error("--memory_budget_mib needs positive arg");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--kv_cache_key_type", argv[argi])) {
+      argi += 1;
+      opt.kv_cache_key_type = argv[argi];
+    }
+    else if (0 == strcmp("--kv_cache_value_type", argv[argi])) {
+      argi += 1;
+      opt.kv_cache_value_type = argv[argi];
+    }
+    else if (0 == strcmp("--flash_attention_on", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi])) {
+        opt.flash_attention_on = (n != 0 ? 1 : 0);
+      }
+      else {
+        fildesh_log_error("--flash_attention_on needs 1 or 0");
+        exstatus = 64;
+      }
+    }
     else if (0 == strcmp("--mlock_on", argv[argi])) {
       int n = 0;
       argi += 1;
@@ -370,6 +530,39 @@ rendezllama::parse_options(rendezllama::ChatOptions& opt, int argc, char** argv)
         exstatus = 64;
       }
     }
+    else if (0 == strcmp("--server_session_limit", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi]) && n > 0) {
+        opt.server_session_limit = n;
+      }
+      else {
+        fildesh_log_error("--server_session_limit needs positive arg");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--server_resident_session_limit", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi]) && n > 0) {
+        opt.server_resident_session_limit = n;
+      }
+      else {
+        fildesh_log_error("--server_resident_session_limit needs positive arg");
+        exstatus = 64;
+      }
+    }
+    else if (0 == strcmp("--server_batch_token_limit", argv[argi])) {
+      int n = 0;
+      argi += 1;
+      if (fildesh_parse_int(&n, argv[argi]) && n > 0) {
+        opt.server_batch_token_limit = n;
+      }
+      else {
+        fildesh_log_error("--server_batch_token_limit needs positive arg");
+        exstatus = 64;
+      }
+    }
     else {
       exstatus = 64;
     }
@@ -434,6 +627,8 @@ rendezllama::slurp_sxpb_options_close_FildeshX(
 
   lone_subfield_at_FildeshSxpb_to_unsigned(
       &opt.context_token_limit, sxpb, top_it, "context_token_limit");
+  lone_subfield_at_FildeshSxpb_to_bool(
+      &opt.context_growth_on, sxpb, top_it, "context_growth_on");
 
   lone_subfield_at_FildeshSxpb_to_unsigned(
       &opt.model_token_limit, sxpb, top_it, "model_token_limit");
@@ -494,6 +689,41 @@ rendezllama::slurp_sxpb_options_close_FildeshX(
     opt.transcript_filename = s;
   }
 
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "x_session")) {
+    opt.session_in_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "o_metrics")) {
+    opt.metrics_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "o_trace")) {
+    opt.trace_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "o_session")) {
+    opt.session_out_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "server_socket")) {
+    opt.server_socket_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "server_spill_directory")) {
+    opt.server_spill_dirname = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "fork_server")) {
+    opt.fork_server_socket_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  lone_subfield_at_FildeshSxpb_to_unsigned(
+      &opt.server_session_limit, sxpb, top_it, "server_session_limit");
+  lone_subfield_at_FildeshSxpb_to_unsigned(
+      &opt.server_batch_token_limit, sxpb, top_it, "server_batch_token_limit");
+  lone_subfield_at_FildeshSxpb_to_unsigned(
+      &opt.server_resident_session_limit, sxpb, top_it,
+      "server_resident_session_limit");
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "x_state")) {
+    opt.state_in_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "o_state")) {
+    opt.state_out_filename = fildesh::sibling_filepath(sxpb_filename.c_str(), s);
+  }
+
   if (lone_subfield_at_FildeshSxpb_to_cc_string(&opt.protagonist, sxpb, top_it, "protagonist")) {
     if (sxpb_filename.empty()) {
       reinitialize_chat_prefixes(opt);
@@ -529,15 +759,33 @@ rendezllama::slurp_sxpb_options_close_FildeshX(
   }
 
   lone_subfield_at_FildeshSxpb_to_bool(&opt.coprocess_mode_on, sxpb, top_it, "coprocess_mode_on");
+  lone_subfield_at_FildeshSxpb_to_bool(&opt.framed_output_on, sxpb, top_it, "framed_output_on");
   lone_subfield_at_FildeshSxpb_to_bool(&opt.startspace_on, sxpb, top_it, "startspace_on");
   lone_subfield_at_FildeshSxpb_to_bool(&opt.linespace_on, sxpb, top_it, "linespace_on");
   lone_subfield_at_FildeshSxpb_to_bool(&opt.mlock_on, sxpb, top_it, "mlock_on");
   lone_subfield_at_FildeshSxpb_to_bool(&opt.mmap_on, sxpb, top_it, "mmap_on");
+  {
+    bool flash_attention_on = false;
+    if (lone_subfield_at_FildeshSxpb_to_bool(
+            &flash_attention_on, sxpb, top_it, "flash_attention_on"))
+    {
+      opt.flash_attention_on = (flash_attention_on ? 1 : 0);
+    }
+  }
+  lone_subfield_at_FildeshSxpb_to_unsigned(
+      &opt.memory_budget_mib, sxpb, top_it, "memory_budget_mib");
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "kv_cache_key_type")) {
+    opt.kv_cache_key_type = s;
+  }
+  if (lone_subfield_at_FildeshSxpb_to_str(&s, sxpb, top_it, "kv_cache_value_type")) {
+    opt.kv_cache_value_type = s;
+  }
 
   /** Command option??*/
   lone_subfield_at_FildeshSxpb_to_unsigned(&opt.thread_count, sxpb, top_it, "thread_count");
   lone_subfield_at_FildeshSxpb_to_unsigned(&opt.batch_thread_count, sxpb, top_it, "batch_thread_count");
   lone_subfield_at_FildeshSxpb_to_unsigned(&opt.batch_count, sxpb, top_it, "batch_count");
+  lone_subfield_at_FildeshSxpb_to_unsigned(&opt.ubatch_count, sxpb, top_it, "ubatch_count");
   lone_subfield_at_FildeshSxpb_to_unsigned(&opt.sentence_limit, sxpb, top_it, "sentence_limit");
   lone_subfield_at_FildeshSxpb_to_unsigned(&opt.sentence_token_limit, sxpb, top_it, "sentence_token_limit");
 
@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "src/language/language_schema.hh"
+#include "src/language/memory_plan.hh"
 
 struct FildeshX;
 struct FildeshSxprotoField;
@@ -31,6 +32,15 @@ struct ChatOptions {
   std::string lora_filename;
   std::string transcript_sibling_filename;
   std::string transcript_filename;
+  std::string session_in_filename;
+  std::string session_out_filename;
+  std::string state_in_filename;
+  std::string state_out_filename;
+  std::string metrics_filename;
+  std::string trace_filename;
+  std::string server_socket_filename;
+  std::string server_spill_dirname;
+  std::string fork_server_socket_filename;
 
   std::string priming_prompt;
   std::string rolling_prompt;
@@ -52,17 +62,33 @@ struct ChatOptions {
   unsigned model_token_limit = 0;  // Default derived from model.
   unsigned context_token_limit = 0;  // Defaults to model_token_limit.
   unsigned batch_count = 512;
+  unsigned ubatch_count = 0;  // Defaults to llama.cpp's choice.
+  std::string kv_cache_key_type;  // Defaults to f16.
+  std::string kv_cache_value_type;  // Defaults to f16.
+  int flash_attention_on = -1;  // Defaults to on for a quantized value cache.
+  unsigned memory_budget_mib = 0;  // No budget by default.
+  bool context_growth_on = false;
+  unsigned server_session_limit = 4;
+  unsigned server_batch_token_limit = 128;
+  unsigned server_resident_session_limit = 0;  // Defaults to server_session_limit.
   bool mlock_on = false;
   bool mmap_on = true;
   bool coprocess_mode_on = false;
+  bool framed_output_on = false;
   std::set<std::string> sentence_terminals = {"!", ".", "?", "…"};
   std::set<std::string> antiprompts;
   // Can't set these yet.
   bool verbose_prompt = false;
+  // Chosen for memory_budget_mib by adapt_options_to_model().
+  MemoryPlan memory_plan;
 
   inference::InferVia infer_via;
 };
 
+MemoryPlanRequest
+memory_plan_request(const ChatOptions& opt);
+void
+apply_memory_plan(ChatOptions& opt, const MemoryPlan& plan);
 void
 print_options(std::ostream& out, const ChatOptions& opt);
 int
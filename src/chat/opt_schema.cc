@@ -23,25 +23,44 @@ rendezllama::options_sxproto_schema()
     {"batch_count", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
     {"chat_prefixes", FILL_FildeshSxprotoField_MANYOF(chat_prefixes_manyof)},
     {"confidant", FILL_FildeshSxprotoField_STRING(1, INT_MAX)},
+    {"context_growth_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
     {"context_token_limit", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
     {"coprocess_mode_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
+    {"flash_attention_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
+    {"fork_server", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"framed_output_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
+    {"kv_cache_key_type", FILL_FildeshSxprotoField_STRING(1, 16)},
+    {"kv_cache_value_type", FILL_FildeshSxprotoField_STRING(1, 16)},
     {"linespace_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
     {"lora", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"memory_budget_mib", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
     {"mlock_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
     {"mmap_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
     {"model", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"model_token_limit", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
+    {"o_metrics", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"o_rolling", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"o_session", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"o_state", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"o_trace", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"protagonist", FILL_FildeshSxprotoField_STRING(1, INT_MAX)},
     {"sentence_limit", FILL_FildeshSxprotoField_INT(0, INT_MAX)},
     {"sentence_terminals", FILL_DEFAULT_FildeshSxprotoField_STRINGS},
     {"sentence_token_limit", FILL_FildeshSxprotoField_INT(0, INT_MAX)},
+    {"server_batch_token_limit", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
+    {"server_resident_session_limit", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
+    {"server_socket", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"server_session_limit", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
+    {"server_spill_directory", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"startspace_on", FILL_DEFAULT_FildeshSxprotoField_BOOL},
     {"thread_count", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
     {"batch_thread_count", FILL_FildeshSxprotoField_INT(0, INT_MAX)},
+    {"ubatch_count", FILL_FildeshSxprotoField_INT(1, INT_MAX)},
     {"x_answer", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"x_priming", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
     {"x_rolling", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"x_session", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
+    {"x_state", FILL_FildeshSxprotoField_STRING(1, FILENAME_MAX)},
   };
   DECLARE_TOPLEVEL_FildeshSxprotoField(schema, toplevel_fields);
   if (!schema->name) {
@@ -0,0 +1,233 @@
+#include "src/chat/pool.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fildesh/fildesh.h>
+
+#include "src/chat/session.hh"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+using rendezllama::MappedFile;
+using rendezllama::SequencePool;
+
+static const char spill_magic[8] = {'r','z','l','l','k','v','s','q'};
+
+SequencePool::SequencePool(
+    unsigned session_count,
+    unsigned resident_count,
+    const std::string& spill_dirname)
+  : sessions_(session_count)
+  , slot_sessions_(resident_count, session_count)
+{
+  if (spill_dirname.empty()) {return;}
+#ifdef _WIN32
+  fildesh_log_warning("Cannot spill KV cache on this platform.");
+#else
+  // Other processes can't guess or collide with a private directory.
+  std::string dirname = spill_dirname + "/rendezllama_spill_XXXXXX";
+  if (mkdtemp(&dirname[0])) {
+    spill_dirname_ = dirname;
+  }
+  else {
+    fildesh_log_warning("Cannot create a spill directory. Evicted sessions will be recomputed.");
+  }
+#endif
+}
+
+/** Delete spill files and their directory.**/
+SequencePool::~SequencePool()
+{
+  if (spill_dirname_.empty()) {return;}
+  for (unsigned i = 0; i < sessions_.size(); ++i) {
+    if (sessions_[i].residence == Residence::spilled) {
+      std::remove(this->spill_filename(i).c_str());
+    }
+  }
+#ifndef _WIN32
+  rmdir(spill_dirname_.c_str());
+#endif
+}
+
+  std::string
+SequencePool::spill_filename(unsigned session_index) const
+{
+  return (spill_dirname_ + "/session" + std::to_string(session_index) + ".kv");
+}
+
+  void
+SequencePool::add(unsigned session_index)
+{
+  Session& session = sessions_[session_index];
+  session = Session();
+}
+
+/** Forget a session that ended, freeing its slot or spill file.**/
+  void
+SequencePool::remove(unsigned session_index, struct llama_context* ctx)
+{
+  Session& session = sessions_[session_index];
+  if (session.residence == Residence::resident) {
+    llama_kv_cache_seq_rm(ctx, 2*session.slot, -1, -1);
+    llama_kv_cache_seq_rm(ctx, 2*session.slot+1, -1, -1);
+    slot_sessions_[session.slot] = sessions_.size();
+  }
+  else if (session.residence == Residence::spilled) {
+    std::remove(this->spill_filename(session_index).c_str());
+  }
+  session = Session();
+  cond_.notify_all();
+}
+
+/** Make a session resident, evicting another one if needed.
+ *
+ * Sets `moved` when the session's sequences were evicted since its last
+ * use, which drops its undo backup.
+ * Returns false if its live KV cache entries were lost.
+ **/
+  bool
+SequencePool::acquire(
+    unsigned session_index,
+    struct llama_context* ctx,
+    std::unique_lock<std::mutex>& context_lock,
+    llama_seq_id* seq_id,
+    bool* moved)
+{
+  Session& session = sessions_[session_index];
+  session.last_use = ++use_count_;
+  while (session.residence != Residence::resident) {
+    unsigned slot = slot_sessions_.size();
+    unsigned victim_index = sessions_.size();
+    for (unsigned i = 0; i < slot_sessions_.size(); ++i) {
+      const unsigned j = slot_sessions_[i];
+      if (j == sessions_.size()) {
+        slot = i;
+        victim_index = sessions_.size();
+        break;
+      }
+      if (sessions_[j].pin_count > 0) {continue;}
+      if (victim_index == sessions_.size() ||
+          sessions_[j].last_use < sessions_[victim_index].last_use)
+      {
+        slot = i;
+        victim_index = j;
+      }
+    }
+    if (slot == slot_sessions_.size()) {
+      // Every slot is in the middle of a decode.
+      cond_.wait(context_lock);
+      continue;
+    }
+    if (victim_index < sessions_.size()) {
+      this->evict(victim_index, ctx);
+    }
+    slot_sessions_[slot] = session_index;
+    session.slot = slot;
+    if (session.residence == Residence::spilled) {
+      if (!this->restore(session_index, ctx)) {
+        session.residence = Residence::lost;
+      }
+    }
+    if (session.residence == Residence::empty) {
+      session.residence = Residence::resident;
+    }
+    else if (session.residence == Residence::lost) {
+      llama_kv_cache_seq_rm(ctx, 2*slot, -1, -1);
+      session.residence = Residence::resident;
+      *seq_id = 2*slot;
+      *moved = true;
+      session.moved = false;
+      return false;
+    }
+  }
+  *seq_id = 2*session.slot;
+  *moved = session.moved;
+  session.moved = false;
+  return true;
+}
+
+/** Keep a session resident while it decodes without the context lock.**/
+  void
+SequencePool::pin(unsigned session_index)
+{
+  sessions_[session_index].pin_count += 1;
+}
+
+  void
+SequencePool::unpin(unsigned session_index)
+{
+  Session& session = sessions_[session_index];
+  session.pin_count -= 1;
+  session.last_use = ++use_count_;
+  cond_.notify_all();
+}
+
+/** Write a session's live sequence to its spill file and free its slot.
+ *
+ * The undo backup is just dropped.
+ **/
+  void
+SequencePool::evict(unsigned session_index, struct llama_context* ctx)
+{
+  Session& session = sessions_[session_index];
+  const llama_seq_id seq_id = 2*session.slot;
+  session.residence = Residence::lost;
+  session.moved = true;
+  if (!spill_dirname_.empty()) {
+    const std::string filename = this->spill_filename(session_index);
+    FildeshO* out = open_FildeshOF(filename.c_str());
+    if (out) {
+      const uint64_t kv_size = llama_state_seq_get_size(ctx, seq_id);
+      char* s = grow_FildeshO(out, sizeof(spill_magic) + sizeof(kv_size));
+      memcpy(s, spill_magic, sizeof(spill_magic));
+      memcpy(&s[sizeof(spill_magic)], &kv_size, sizeof(kv_size));
+      uint8_t* kv_data = (uint8_t*) grow_FildeshO(out, kv_size);
+      if (kv_size == llama_state_seq_get_data(ctx, kv_data, kv_size, seq_id)) {
+        session.residence = Residence::spilled;
+      }
+      close_FildeshO(out);
+    }
+    if (session.residence != Residence::spilled) {
+      std::remove(filename.c_str());
+      fildesh_log_warning("Cannot spill session KV cache. It will be recomputed.");
+    }
+  }
+  llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+  llama_kv_cache_seq_rm(ctx, seq_id+1, -1, -1);
+  slot_sessions_[session.slot] = sessions_.size();
+}
+
+/** Read a spilled live sequence back into the session's new slot.**/
+  bool
+SequencePool::restore(unsigned session_index, struct llama_context* ctx)
+{
+  const Session& session = sessions_[session_index];
+  const std::string filename = this->spill_filename(session_index);
+  bool good = false;
+  {
+    MappedFile in;
+    if (in.open(filename)) {
+      std::string_view data = in.view();
+      uint64_t kv_size = 0;
+      if (data.size() >= sizeof(spill_magic) + sizeof(kv_size) &&
+          0 == memcmp(data.data(), spill_magic, sizeof(spill_magic)))
+      {
+        memcpy(&kv_size, &data[sizeof(spill_magic)], sizeof(kv_size));
+        data.remove_prefix(sizeof(spill_magic) + sizeof(kv_size));
+        good = (
+            data.size() == kv_size &&
+            kv_size == llama_state_seq_set_data(
+                ctx, (const uint8_t*)data.data(), kv_size, 2*session.slot));
+      }
+    }
+  }
+  std::remove(filename.c_str());
+  if (good) {
+    sessions_[session_index].residence = Residence::resident;
+  }
+  return good;
+}
@@ -0,0 +1,69 @@
+#ifndef RENDEZLLAMA_CHAT_POOL_HH_
+#define RENDEZLLAMA_CHAT_POOL_HH_
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+namespace rendezllama {
+
+/** Assigns KV cache sequences to more sessions than can be resident.
+ *
+ * Each resident session has a live sequence and an undo backup sequence.
+ * When all are taken, the least recently used session that is not in
+ * the middle of a decode gets its live sequence spilled to a file
+ * and restored on its next use.
+ * Spill files live in a private subdirectory that is removed with the pool.
+ * Every method expects the context mutex to be locked.
+ **/
+class SequencePool {
+ public:
+  SequencePool(
+      unsigned session_count,
+      unsigned resident_count,
+      const std::string& spill_dirname);
+  SequencePool(const SequencePool&) = delete;
+  ~SequencePool();
+  SequencePool& operator=(const SequencePool&) = delete;
+
+  const std::string& spill_dirname() const {return spill_dirname_;}
+  void add(unsigned session_index);
+  void remove(unsigned session_index, struct llama_context* ctx);
+  bool acquire(
+      unsigned session_index,
+      struct llama_context* ctx,
+      std::unique_lock<std::mutex>& context_lock,
+      llama_seq_id* seq_id,
+      bool* moved);
+  void pin(unsigned session_index);
+  void unpin(unsigned session_index);
+
+ private:
+  enum class Residence {empty, resident, spilled, lost};
+  struct Session {
+    Residence residence = Residence::empty;
+    unsigned slot = 0;
+    unsigned pin_count = 0;
+    uint64_t last_use = 0;
+    bool moved = false;
+  };
+
+  std::string spill_filename(unsigned session_index) const;
+  void evict(unsigned session_index, struct llama_context* ctx);
+  bool restore(unsigned session_index, struct llama_context* ctx);
+
+ private:
+  std::vector<Session> sessions_;
+  // Which session uses each slot, or `sessions_.size()` if none.
+  std::vector<unsigned> slot_sessions_;
+  // Private subdirectory of the given spill directory, or empty.
+  std::string spill_dirname_;
+  uint64_t use_count_ = 0;
+  std::condition_variable cond_;
+};
+
+}  // namespace rendezllama
+#endif
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cmath>
+
+#include <fildesh/ostream.hh>
+#include <fildesh/string.hh>
+
+#include "src/chat/loop.hh"
+#include "src/chat/opt.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatOptions;
+using rendezllama::Vocabulary;
+
+/** Progress of one sequence through its current chunk.**/
+struct ChunkCursor {
+  std::vector<Vocabulary::Token_id> tokens;
+  size_t text_begin = 0;
+  unsigned prefix_count = 0;
+  unsigned eval_count = 0;
+  bool active = false;
+};
+
+/** Fill a cursor with the tokens of a chunk.
+ *
+ * A chunk is the BOS token (when the model expects one) followed by
+ * the chunk's slice of text tokens.
+ * Every token but the first is scored.
+ **/
+static
+  void
+begin_chunk(
+    ChunkCursor& cursor,
+    const std::vector<Vocabulary::Token_id>& text_tokens,
+    size_t chunk_index,
+    unsigned chunk_token_count,
+    bool bos_on,
+    const Vocabulary& vocabulary)
+{
+  const size_t text_count = chunk_token_count - (bos_on ? 1 : 0);
+  const size_t begin = chunk_index * text_count;
+  const size_t end = std::min(text_tokens.size(), begin + text_count);
+  cursor.tokens.clear();
+  if (bos_on) {
+    cursor.tokens.push_back(vocabulary.bos_token_id());
+  }
+  cursor.tokens.insert(
+      cursor.tokens.end(), text_tokens.begin()+begin, text_tokens.begin()+end);
+  cursor.text_begin = begin;
+  cursor.prefix_count = (bos_on ? 1 : 0);
+  cursor.eval_count = 0;
+  cursor.active = (cursor.tokens.size() > 1);
+}
+
+/** Negative log-likelihood of a token given the logits that predict it.**/
+static
+  double
+token_nll(const float* logits, unsigned logit_count, Vocabulary::Token_id token_id)
+{
+  const float max_logit = *std::max_element(logits, logits+logit_count);
+  double sum = 0;
+  for (unsigned i = 0; i < logit_count; ++i) {
+    sum += std::exp((double)(logits[i] - max_logit));
+  }
+  return std::log(sum) + max_logit - logits[token_id];
+}
+
+/** Score chunks in [chunk_begin, chunk_end), one per sequence at a time.
+ *
+ * Every sequence contributes tokens to each batch,
+ * so short and long chunks are evaluated together.
+ * Returns false if evaluation fails.
+ **/
+static
+  bool
+score_chunks(
+    std::vector<float>& nlls,
+    struct llama_context* ctx,
+    const std::vector<Vocabulary::Token_id>& text_tokens,
+    size_t chunk_begin,
+    size_t chunk_end,
+    unsigned chunk_token_count,
+    unsigned sequence_count,
+    bool bos_on,
+    const Vocabulary& vocabulary)
+{
+  const unsigned batch_count = llama_n_batch(ctx);
+  const unsigned logit_count = vocabulary.cardinality();
+  std::vector<ChunkCursor> cursors(sequence_count);
+  size_t next_chunk_index = chunk_begin;
+  for (ChunkCursor& cursor : cursors) {
+    while (!cursor.active && next_chunk_index < chunk_end) {
+      begin_chunk(cursor, text_tokens, next_chunk_index++,
+                  chunk_token_count, bos_on, vocabulary);
+    }
+  }
+
+  llama_batch batch = llama_batch_init(batch_count, 0, 1);
+  bool good = true;
+  while (good) {
+    unsigned active_count = 0;
+    for (const ChunkCursor& cursor : cursors) {
+      if (cursor.active) {active_count += 1;}
+    }
+    if (active_count == 0) {break;}
+
+    // Split the batch evenly. The last token of a chunk needs no eval.
+    const unsigned share = std::max(1u, batch_count / active_count);
+    batch.n_tokens = 0;
+    for (unsigned seq = 0; seq < sequence_count; ++seq) {
+      const ChunkCursor& cursor = cursors[seq];
+      if (!cursor.active) {continue;}
+      const unsigned n = std::min<unsigned>(
+          {share, (unsigned)cursor.tokens.size()-1 - cursor.eval_count,
+           batch_count - (unsigned)batch.n_tokens});
+      for (unsigned i = 0; i < n; ++i) {
+        const unsigned b = batch.n_tokens++;
+        batch.token[b] = cursor.tokens[cursor.eval_count + i];
+        batch.pos[b] = cursor.eval_count + i;
+        batch.n_seq_id[b] = 1;
+        batch.seq_id[b][0] = seq;
+        batch.logits[b] = 1;
+      }
+    }
+    if (0 != llama_decode(ctx, batch)) {
+      good = false;
+      break;
+    }
+
+    for (int b = 0; b < batch.n_tokens; ++b) {
+      ChunkCursor& cursor = cursors[batch.seq_id[b][0]];
+      const unsigned target_index = batch.pos[b] + 1;
+      nlls[cursor.text_begin + target_index - cursor.prefix_count] = token_nll(
+          llama_get_logits_ith(ctx, b), logit_count,
+          cursor.tokens[target_index]);
+      cursor.eval_count += 1;
+    }
+
+    for (unsigned seq = 0; seq < sequence_count; ++seq) {
+      ChunkCursor& cursor = cursors[seq];
+      if (!cursor.active || cursor.eval_count + 1 < cursor.tokens.size()) {
+        continue;
+      }
+      llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+      cursor.active = false;
+      while (!cursor.active && next_chunk_index < chunk_end) {
+        begin_chunk(cursor, text_tokens, next_chunk_index++,
+                    chunk_token_count, bos_on, vocabulary);
+      }
+    }
+  }
+  llama_batch_free(batch);
+  return good;
+}
+
+int main(int argc, char** argv)
+{
+  rendezllama::GlobalScope rendezllama_global_scope;
+  const char* text_filename = NULL;
+  const char* scores_filename = NULL;
+  unsigned sequence_limit = 4;
+  unsigned chunk_offset = 0;
+  unsigned chunk_limit = 0;
+  int exstatus = 0;
+
+  // Take our own flags. Leave the rest for parse_options().
+  std::vector<char*> chat_argv;
+  exstatus = rendezllama::take_tool_flags(chat_argv, argc, argv, {
+    {"--x_text", &text_filename, nullptr, 0},
+    {"--o_scores", &scores_filename, nullptr, 0},
+    {"--sequence_limit", nullptr, &sequence_limit, 1},
+    {"--chunk_offset", nullptr, &chunk_offset, 0},
+    // Zero means no limit.
+    {"--chunk_limit", nullptr, &chunk_limit, 0},
+  });
+
+  ChatOptions opt;
+  if (exstatus == 0) {
+    exstatus = parse_options(opt, (int)chat_argv.size(), chat_argv.data());
+  }
+  if (exstatus == 0 && !text_filename) {
+    fildesh_log_error("Please provide an --x_text file.");
+    exstatus = 64;
+  }
+  std::string text;
+  if (exstatus == 0 && !fildesh::slurp_file_to_string(text, text_filename)) {
+    fildesh_log_error("Cannot read --x_text file.");
+    exstatus = 1;
+  }
+  if (exstatus != 0) {
+    return exstatus;
+  }
+
+  llama_log_set(rendezllama::noop_log_callback, NULL);
+  llama_context* ctx = NULL;
+  llama_model* model = NULL;
+  std::tie(model, ctx) = rendezllama::make_llama_context(opt, sequence_limit);
+  if (!ctx) {return 1;}
+
+  Vocabulary vocabulary(model);
+  if (!rendezllama::assign_vocabulary_substitution(vocabulary, opt)) {
+    exstatus = 65;
+  }
+
+  // Tokenize like the chat's prompts, without a leading BOS.
+  std::vector<Vocabulary::Token_id> text_tokens;
+  const bool bos_on =
+    (0 != llama_vocab_get_add_bos(llama_model_get_vocab(model)));
+  if (exstatus == 0) {
+    vocabulary.tokenize_to(text_tokens, text);
+    if (!text_tokens.empty() && text_tokens[0] == vocabulary.bos_token_id()) {
+      text_tokens.erase(text_tokens.begin());
+    }
+  }
+
+  const unsigned chunk_token_count = llama_n_ctx(ctx) / sequence_limit;
+  size_t chunk_count = 0;
+  if (exstatus == 0 && chunk_token_count < 2) {
+    fildesh_log_error("Context is too small to score.");
+    exstatus = 1;
+  }
+  if (exstatus == 0) {
+    const size_t text_count = chunk_token_count - (bos_on ? 1 : 0);
+    chunk_count = (text_tokens.size() + text_count - 1) / text_count;
+  }
+  const size_t chunk_begin = std::min<size_t>(chunk_offset, chunk_count);
+  const size_t chunk_end = (chunk_limit == 0 ? chunk_count :
+                            std::min<size_t>(chunk_begin + chunk_limit, chunk_count));
+
+  // Unscored tokens keep a NaN.
+  std::vector<float> nlls(text_tokens.size(), NAN);
+  if (exstatus == 0) {
+    if (!score_chunks(nlls, ctx, text_tokens, chunk_begin, chunk_end,
+                      chunk_token_count, sequence_limit, bos_on, vocabulary))
+    {
+      fildesh_log_error("Failed to eval.");
+      exstatus = 1;
+    }
+  }
+
+  if (exstatus == 0) {
+    size_t token_count = 0;
+    double nll_sum = 0;
+    for (float nll : nlls) {
+      if (!std::isnan(nll)) {
+        token_count += 1;
+        nll_sum += nll;
+      }
+    }
+    if (scores_filename) {
+      fildesh::ofstream out(scores_filename);
+      out << "((tokens)\n";
+      for (size_t i = 0; i < nlls.size(); ++i) {
+        if (std::isnan(nlls[i])) {continue;}
+        out << " (() (index " << i << ") (id " << text_tokens[i]
+          << ") (nll " << nlls[i] << "))\n";
+      }
+      out << ")\n";
+    }
+    fildesh::ofstream out("/dev/stdout");
+    out
+      << "(chunk_count " << chunk_count << ")\n"
+      << "(token_count " << token_count << ")\n"
+      << "(nll_sum " << nll_sum << ")\n";
+    if (token_count > 0) {
+      const double nll_mean = nll_sum / token_count;
+      out
+        << "(nll_mean " << nll_mean << ")\n"
+        << "(perplexity " << std::exp(nll_mean) << ")\n";
+    }
+  }
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return exstatus;
+}
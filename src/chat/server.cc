@@ -0,0 +1,441 @@
+#include "src/chat/server.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <fildesh/ostream.hh>
+
+#include "llama.h"
+
+#include "src/chat/display.hh"
+#include "src/chat/guide.hh"
+#include "src/chat/loop.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/pool.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/scheduler.hh"
+
+using rendezllama::ChatOptions;
+using rendezllama::Vocabulary;
+
+/** State shared by all sessions of a server.**/
+struct ChatServer {
+  struct llama_context** ctx = nullptr;
+  const ChatOptions* opt = nullptr;
+  Vocabulary* vocabulary = nullptr;
+  const std::vector<Vocabulary::Token_id>* answer_prompt_tokens = nullptr;
+  Vocabulary::Token_id first_priming_token_id = 0;
+  const std::vector<Vocabulary::Token_id>* priming_tokens = nullptr;
+  // Sequence with the evaluated priming prompt that new sessions copy.
+  llama_seq_id priming_seq_id = 0;
+  unsigned priming_token_count = 0;
+  // Batches decodes of all sessions and guards the context.
+  rendezllama::DecodeScheduler* scheduler = nullptr;
+  // Assigns KV cache sequences to sessions. Guarded by the context mutex.
+  rendezllama::SequencePool* pool = nullptr;
+  // Guards which session slots are in use.
+  std::mutex slot_mutex;
+  std::vector<unsigned char> slot_used;
+  // Connection of each slot while its session reads from it, or -1.
+  std::vector<int> slot_fds;
+  std::vector<std::thread> slot_threads;
+};
+
+/** Number of sessions that can have KV cache entries at once.**/
+  unsigned
+rendezllama::server_resident_session_count(const ChatOptions& opt)
+{
+  if (opt.server_resident_session_limit > 0) {
+    return std::min(opt.server_resident_session_limit, opt.server_session_limit);
+  }
+  return opt.server_session_limit;
+}
+
+#ifndef _WIN32
+// Self-pipe that wakes the accept loop when the server is told to stop.
+static int server_stop_fds[2] = {-1, -1};
+
+static
+  void
+stop_server_on_signal(int signum)
+{
+  (void) signum;
+  const char c = 0;
+  const ssize_t n = write(server_stop_fds[1], &c, 1);
+  (void) n;
+}
+
+/** Make SIGINT and SIGTERM wake the accept loop instead of killing us.
+ *
+ * Only the first signal is caught, so a second one kills a stuck server.
+ * Returns false if the self-pipe can't be made.
+ **/
+static
+  bool
+catch_server_stop_signals()
+{
+  if (0 != pipe(server_stop_fds)) {
+    return false;
+  }
+  fcntl(server_stop_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(server_stop_fds[1], F_SETFD, FD_CLOEXEC);
+  // Never block in the signal handler, even when signals pile up.
+  fcntl(server_stop_fds[1], F_SETFL, O_NONBLOCK);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_server_on_signal;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  return true;
+}
+
+/** Let signals kill us again.**/
+static
+  void
+release_server_stop_signals()
+{
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  close(server_stop_fds[0]);
+  close(server_stop_fds[1]);
+  server_stop_fds[0] = -1;
+  server_stop_fds[1] = -1;
+}
+
+/** Bind and listen on a Unix domain socket.
+ *
+ * Returns the listening fd, or -1 after setting `exstatus`.
+ **/
+static
+  int
+listen_unix_socket(
+    const std::string& filename,
+    unsigned backlog,
+    int& exstatus)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (filename.size() >= sizeof(addr.sun_path)) {
+    fildesh_log_error("Server socket path is too long.");
+    exstatus = 64;
+    return -1;
+  }
+  memcpy(addr.sun_path, filename.data(), filename.size());
+
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    fildesh_log_error("Cannot create server socket.");
+    exstatus = 1;
+    return -1;
+  }
+  unlink(filename.c_str());
+  if (0 != bind(listen_fd, (const struct sockaddr*)&addr, sizeof(addr)) ||
+      0 != listen(listen_fd, (int)backlog))
+  {
+    fildesh_log_error("Cannot listen on server socket.");
+    close(listen_fd);
+    exstatus = 1;
+    return -1;
+  }
+  return listen_fd;
+}
+
+/** Run one session over a connection.**/
+static
+  void
+serve_chat_session(ChatServer* server, unsigned slot, int fd)
+{
+  {
+    std::lock_guard<std::mutex> context_lock(
+        server->scheduler->context_mutex());
+    server->pool->add(slot);
+  }
+  // The input reader closes its own descriptor whenever its read ends,
+  // so `fd` stays ours until the session is done with it.
+  FildeshX* in = open_fd_FildeshX(dup(fd));
+  ChatOptions opt = *server->opt;
+  const Vocabulary& vocabulary = *server->vocabulary;
+  {
+    rendezllama::ChatDisplay chat_disp;
+    chat_disp.out_ = open_fd_FildeshO(dup(fd));
+    chat_disp.framing_on_ = opt.framed_output_on;
+    chat_disp.answer_prompt_tokens_ = *server->answer_prompt_tokens;
+    rendezllama::ChatTrajectory chat_traj(server->first_priming_token_id);
+    rendezllama::ChatGuide chat_guide(*server->vocabulary, chat_traj, opt);
+    rendezllama::Inference inference(vocabulary);
+    inference.share_context(server->scheduler, server->pool, slot);
+    rendezllama::prime_chat_trajectory(
+        chat_traj, chat_guide, *server->priming_tokens, opt, vocabulary);
+    if (server->priming_token_count > 0) {
+      // Start from the shared priming prompt instead of evaluating it again.
+      inference.copy_prefix_kv(
+          *server->ctx, chat_traj,
+          server->priming_seq_id, server->priming_token_count);
+    }
+    // Command output goes to the client too.
+    rendezllama::ChatDisplayStreambuf eout_buf(chat_disp);
+    std::ostream eout(&eout_buf);
+    rendezllama::chat_loop(
+        in, eout, *server->ctx, opt, vocabulary,
+        chat_disp, chat_traj, chat_guide, inference);
+  }
+  // Wake the reader in case the session ended before its input did.
+  shutdown(fd, SHUT_RD);
+  {
+    std::lock_guard<std::mutex> slot_lock(server->slot_mutex);
+    server->slot_fds[slot] = -1;
+  }
+  close(fd);
+  {
+    std::lock_guard<std::mutex> context_lock(
+        server->scheduler->context_mutex());
+    server->pool->remove(slot, *server->ctx);
+  }
+  std::lock_guard<std::mutex> slot_lock(server->slot_mutex);
+  server->slot_used[slot] = 0;
+}
+#endif
+
+/** Serve independent chat sessions over a Unix domain socket.
+ *
+ * All sessions share one model and context.
+ * Each connection is a session that takes commands like in coprocess mode.
+ **/
+  int
+rendezllama::serve_chat_sessions(
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    Vocabulary& vocabulary,
+    const std::vector<Vocabulary::Token_id>& answer_prompt_tokens,
+    Vocabulary::Token_id first_priming_token_id,
+    const std::vector<Vocabulary::Token_id>& priming_tokens)
+{
+#ifdef _WIN32
+  (void) ctx;
+  (void) opt;
+  (void) vocabulary;
+  (void) answer_prompt_tokens;
+  (void) first_priming_token_id;
+  (void) priming_tokens;
+  fildesh_log_error("Server mode is not supported on this platform.");
+  return 1;
+#else
+  int exstatus = 0;
+  const int listen_fd = listen_unix_socket(
+      opt.server_socket_filename, opt.server_session_limit, exstatus);
+  if (listen_fd < 0) {
+    return exstatus;
+  }
+
+  // Clients can hang up at any time.
+  signal(SIGPIPE, SIG_IGN);
+  if (!catch_server_stop_signals()) {
+    fildesh_log_error("Cannot create server stop pipe.");
+    close(listen_fd);
+    unlink(opt.server_socket_filename.c_str());
+    return 1;
+  }
+
+  const unsigned resident_count = server_resident_session_count(opt);
+  rendezllama::SequencePool pool(
+      opt.server_session_limit, resident_count, opt.server_spill_dirname);
+  rendezllama::DecodeScheduler scheduler(
+      &ctx, opt.batch_count, opt.server_batch_token_limit,
+      vocabulary.cardinality());
+  ChatServer server;
+  server.scheduler = &scheduler;
+  server.pool = &pool;
+  server.ctx = &ctx;
+  server.opt = &opt;
+  server.vocabulary = &vocabulary;
+  server.answer_prompt_tokens = &answer_prompt_tokens;
+  server.first_priming_token_id = first_priming_token_id;
+  server.priming_tokens = &priming_tokens;
+  server.slot_used.resize(opt.server_session_limit, 0);
+  server.slot_fds.resize(opt.server_session_limit, -1);
+
+  // Evaluate the priming prompt once for all sessions.
+  server.priming_seq_id = 2*resident_count;
+  {
+    std::vector<Vocabulary::Token_id> tokens;
+    tokens.push_back(first_priming_token_id);
+    tokens.insert(tokens.end(), priming_tokens.begin(), priming_tokens.end());
+    std::vector<float> logits;
+    if (tokens.size() == scheduler.decode(
+            server.priming_seq_id, tokens.data(), tokens.size(), 0, logits,
+            nullptr))
+    {
+      server.priming_token_count = tokens.size();
+    }
+    else {
+      fildesh_log_warning("Failed to eval shared priming prompt.");
+    }
+  }
+  server.slot_threads.resize(opt.server_session_limit);
+
+  while (exstatus == 0) {
+    struct pollfd polls[2];
+    polls[0].fd = listen_fd;
+    polls[0].events = POLLIN;
+    polls[0].revents = 0;
+    polls[1].fd = server_stop_fds[0];
+    polls[1].events = POLLIN;
+    polls[1].revents = 0;
+    const int poll_count = poll(polls, 2, -1);
+    if (poll_count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (poll_count > 0 && polls[1].revents != 0) {
+      // Told to stop by SIGINT or SIGTERM.
+      break;
+    }
+    const int fd = (poll_count > 0 ? accept(listen_fd, NULL, NULL) : -1);
+    if (fd < 0) {
+      fildesh_log_error("Failed to accept connection.");
+      exstatus = 1;
+      break;
+    }
+    unsigned slot = opt.server_session_limit;
+    {
+      std::lock_guard<std::mutex> slot_lock(server.slot_mutex);
+      for (unsigned i = 0; i < server.slot_used.size(); ++i) {
+        if (!server.slot_used[i]) {
+          server.slot_used[i] = 1;
+          server.slot_fds[i] = fd;
+          slot = i;
+          break;
+        }
+      }
+    }
+    if (slot == opt.server_session_limit) {
+      fildesh_log_warning("Rejecting connection. Too many sessions.");
+      close(fd);
+      continue;
+    }
+    // The slot's previous session is done, so this won't block.
+    if (server.slot_threads[slot].joinable()) {
+      server.slot_threads[slot].join();
+    }
+    server.slot_threads[slot] = std::thread(serve_chat_session, &server, slot, fd);
+  }
+
+  close(listen_fd);
+  unlink(opt.server_socket_filename.c_str());
+  {
+    // End every session's input so it finishes and can be joined.
+    std::lock_guard<std::mutex> slot_lock(server.slot_mutex);
+    for (int fd : server.slot_fds) {
+      if (fd >= 0) {
+        shutdown(fd, SHUT_RD);
+      }
+    }
+  }
+  for (std::thread& thread : server.slot_threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  release_server_stop_signals();
+  return exstatus;
+#endif
+}
+
+/** Fork a process per connection to a Unix domain socket.
+ *
+ * Each child returns 0 with `session_in` and `session_out` open on its
+ * connection, and the caller runs the usual chat loop over them.
+ * Children start from a copy-on-write snapshot of the caller,
+ * so a prompt evaluated beforehand is not evaluated again,
+ * and the mmapped model stays shared in the page cache.
+ * The parent only returns on failure, leaving both as NULL.
+ **/
+  int
+rendezllama::fork_chat_sessions(
+    const ChatOptions& opt,
+    FildeshX*& session_in,
+    FildeshO*& session_out)
+{
+  session_in = NULL;
+  session_out = NULL;
+#ifdef _WIN32
+  (void) opt;
+  fildesh_log_error("Fork server mode is not supported on this platform.");
+  return 1;
+#else
+  int exstatus = 0;
+  const int listen_fd = listen_unix_socket(
+      opt.fork_server_socket_filename, opt.server_session_limit, exstatus);
+  if (listen_fd < 0) {
+    return exstatus;
+  }
+
+  // Clients can hang up at any time.
+  signal(SIGPIPE, SIG_IGN);
+
+  unsigned child_count = 0;
+  while (exstatus == 0) {
+    // Wake up every second to reap sessions that ended,
+    // so they don't linger as zombies while no one connects.
+    struct pollfd listen_poll;
+    listen_poll.fd = listen_fd;
+    listen_poll.events = POLLIN;
+    listen_poll.revents = 0;
+    const int poll_count = poll(&listen_poll, 1, 1000);
+    while (child_count > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+      child_count -= 1;
+    }
+    if (poll_count == 0 || (poll_count < 0 && errno == EINTR)) {
+      continue;
+    }
+    const int fd = (poll_count > 0 ? accept(listen_fd, NULL, NULL) : -1);
+    if (fd < 0) {
+      fildesh_log_error("Failed to accept connection.");
+      exstatus = 1;
+      break;
+    }
+    if (child_count >= opt.server_session_limit) {
+      fildesh_log_warning("Rejecting connection. Too many sessions.");
+      close(fd);
+      continue;
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+      close(listen_fd);
+      session_in = open_fd_FildeshX(fd);
+      session_out = open_fd_FildeshO(dup(fd));
+      return 0;
+    }
+    close(fd);
+    if (pid < 0) {
+      fildesh_log_error("Failed to fork session.");
+      exstatus = 1;
+      break;
+    }
+    child_count += 1;
+  }
+
+  close(listen_fd);
+  unlink(opt.fork_server_socket_filename.c_str());
+  while (child_count > 0 && waitpid(-1, NULL, 0) > 0) {
+    child_count -= 1;
+  }
+  return exstatus;
+#endif
+}
@@ -0,0 +1,33 @@
+#ifndef RENDEZLLAMA_CHAT_SERVER_HH_
+#define RENDEZLLAMA_CHAT_SERVER_HH_
+#include <string>
+#include <vector>
+
+#include <fildesh/fildesh.h>
+
+#include "src/language/vocabulary.hh"
+
+struct llama_context;
+
+namespace rendezllama {
+
+struct ChatOptions;
+
+unsigned
+server_resident_session_count(const ChatOptions& opt);
+int
+serve_chat_sessions(
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    Vocabulary& vocabulary,
+    const std::vector<Vocabulary::Token_id>& answer_prompt_tokens,
+    Vocabulary::Token_id first_priming_token_id,
+    const std::vector<Vocabulary::Token_id>& priming_tokens);
+int
+fork_chat_sessions(
+    const ChatOptions& opt,
+    FildeshX*& session_in,
+    FildeshO*& session_out);
+
+}  // namespace rendezllama
+#endif
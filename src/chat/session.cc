@@ -0,0 +1,300 @@
+#include "src/chat/session.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fildesh/fildesh.h>
+#include <fildesh/string.hh>
+
+#include "llama.h"
+
+#include "src/chat/display.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using rendezllama::ChatDisplay;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::MappedFile;
+
+  bool
+MappedFile::open(const std::string& filename)
+{
+  this->close();
+#ifndef _WIN32
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (0 == fstat(fd, &st) && st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      data_ = static_cast<const char*>(p);
+      size_ = st.st_size;
+      mapped_ = true;
+    }
+  }
+  ::close(fd);
+  if (mapped_) {
+    is_open_ = true;
+    return true;
+  }
+#endif
+  // Fall back to reading the whole file.
+  if (!fildesh::slurp_file_to_string(content_, filename.c_str())) {
+    return false;
+  }
+  data_ = content_.data();
+  size_ = content_.size();
+  is_open_ = true;
+  return true;
+}
+
+  void
+MappedFile::close()
+{
+#ifndef _WIN32
+  if (mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+#endif
+  data_ = nullptr;
+  size_ = 0;
+  is_open_ = false;
+  mapped_ = false;
+  content_.clear();
+}
+
+/** State file format.
+ *
+ * - 8-byte magic string, 32-bit version, and 32-bit reserved word.
+ * - 64-bit model size and parameter count.
+ * - 64-bit size of a trajectory snapshot, then the snapshot in session log format.
+ * - 32-bit display token count, context token count, answer prompt offset,
+ *   sampling seed, number of tokens sampled since seeding, and logit count.
+ * - Logits of the last evaluated token when the context is fully evaluated.
+ * - 64-bit size of the KV cache sequence state, then that state.
+ **/
+static const char state_magic[8] = {'r','z','l','l','s','t','a','t'};
+static const unsigned state_version = 2;
+
+static
+  void
+put_state_bytes(FildeshO* out, const void* p, size_t n)
+{
+  memcpy(grow_FildeshO(out, n), p, n);
+}
+
+/** Write a whole file or leave the old one alone.
+ *
+ * Writes a temporary file first and renames it over the old one
+ * so a full disk can't leave a truncated file behind.
+ **/
+static
+  bool
+write_state_file(const std::string& filename, const char* data, size_t size)
+{
+  const std::string tmp_filename = filename + ".tmp";
+  FILE* out = fopen(tmp_filename.c_str(), "wb");
+  if (!out) {return false;}
+  bool good = (size == fwrite(data, 1, size, out));
+  good = (0 == fflush(out)) && good;
+  good = (0 == fclose(out)) && good;
+  if (good) {
+    good = (0 == rename(tmp_filename.c_str(), filename.c_str()));
+  }
+  if (!good) {
+    remove(tmp_filename.c_str());
+  }
+  return good;
+}
+
+static
+  bool
+get_state_bytes(std::string_view& data, void* p, size_t n)
+{
+  if (data.size() < n) {return false;}
+  memcpy(p, data.data(), n);
+  data.remove_prefix(n);
+  return true;
+}
+
+/** Save the chat to a file that load_chat_state() can resume from.
+ *
+ * Without a context, no KV cache state is saved.
+ **/
+  bool
+rendezllama::save_chat_state(
+    const std::string& filename,
+    ChatTrajectory& chat_traj,
+    const ChatDisplay& chat_disp,
+    const Inference& inference,
+    const struct llama_model* model,
+    struct llama_context* ctx,
+    uint64_t vocabulary_fingerprint)
+{
+  const llama_seq_id seq_id = inference.seq_id();
+  FildeshO out[1] = {DEFAULT_FildeshO};
+
+  put_state_bytes(out, state_magic, sizeof(state_magic));
+  const unsigned version_words[2] = {state_version, 0};
+  put_state_bytes(out, version_words, sizeof(version_words));
+  const uint64_t model_words[2] = {
+    llama_model_size(model), llama_model_n_params(model),
+  };
+  put_state_bytes(out, model_words, sizeof(model_words));
+
+  FildeshO traj_out[1] = {DEFAULT_FildeshO};
+  chat_traj.session_snapshot_to(traj_out, vocabulary_fingerprint);
+  const uint64_t traj_size = traj_out->size;
+  put_state_bytes(out, &traj_size, sizeof(traj_size));
+  put_state_bytes(out, traj_out->at, traj_out->size);
+  close_FildeshO(traj_out);
+
+  const float* logits = nullptr;
+  if (chat_traj.context_token_count_ == chat_traj.token_count()) {
+    logits = inference.pending_logits();
+  }
+  const unsigned logit_count = (
+      logits ? llama_vocab_n_tokens(llama_model_get_vocab(model)) : 0);
+  const unsigned words[6] = {
+    chat_traj.display_token_count_,
+    chat_traj.context_token_count_,
+    chat_disp.answer_prompt_offset_,
+    inference.sampling_seed(),
+    inference.sampling_draw_count(),
+    logit_count,
+  };
+  put_state_bytes(out, words, sizeof(words));
+  if (logit_count > 0) {
+    put_state_bytes(out, logits, sizeof(float) * logit_count);
+  }
+
+  const uint64_t kv_size = (ctx ? llama_state_seq_get_size(ctx, seq_id) : 0);
+  put_state_bytes(out, &kv_size, sizeof(kv_size));
+  bool good = true;
+  if (kv_size > 0) {
+    uint8_t* kv_data = (uint8_t*) grow_FildeshO(out, kv_size);
+    good = (kv_size == llama_state_seq_get_data(ctx, kv_data, kv_size, seq_id));
+  }
+  if (good) {
+    good = write_state_file(filename, out->at, out->size);
+  }
+  close_FildeshO(out);
+  return good;
+}
+
+/** Resume a chat saved by save_chat_state().
+ *
+ * Without a context, the KV cache is not restored
+ * and the saved counts of evaluated tokens are kept as they are.
+ **/
+  bool
+rendezllama::load_chat_state(
+    std::string_view data,
+    ChatTrajectory& chat_traj,
+    ChatDisplay& chat_disp,
+    Inference& inference,
+    const struct llama_model* model,
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    uint64_t vocabulary_fingerprint)
+{
+  const llama_seq_id seq_id = inference.seq_id();
+  char magic[sizeof(state_magic)];
+  unsigned version_words[2];
+  uint64_t model_words[2];
+  if (!get_state_bytes(data, magic, sizeof(magic)) ||
+      0 != memcmp(magic, state_magic, sizeof(magic)) ||
+      !get_state_bytes(data, version_words, sizeof(version_words)) ||
+      version_words[0] != state_version ||
+      !get_state_bytes(data, model_words, sizeof(model_words)) ||
+      model_words[0] != llama_model_size(model) ||
+      model_words[1] != llama_model_n_params(model))
+  {
+    return false;
+  }
+
+  uint64_t traj_size = 0;
+  if (!get_state_bytes(data, &traj_size, sizeof(traj_size)) ||
+      data.size() < traj_size)
+  {
+    return false;
+  }
+  const std::string_view traj_data = data.substr(0, traj_size);
+  data.remove_prefix(traj_size);
+
+  unsigned words[6];
+  if (!get_state_bytes(data, words, sizeof(words))) {return false;}
+  std::vector<float> logits(words[5]);
+  if (!logits.empty() &&
+      logits.size() != (size_t)llama_vocab_n_tokens(llama_model_get_vocab(model)))
+  {
+    return false;
+  }
+  if (!get_state_bytes(data, logits.data(), sizeof(float) * logits.size())) {
+    return false;
+  }
+  uint64_t kv_size = 0;
+  if (!get_state_bytes(data, &kv_size, sizeof(kv_size)) ||
+      data.size() < kv_size)
+  {
+    return false;
+  }
+
+  // Grow before changing anything so a failed load leaves the chat as it was.
+  if (ctx && opt.context_growth_on &&
+      !grow_llama_context(ctx, opt, words[1]))
+  {
+    fildesh_log_error("Failed to grow context for the loaded state.");
+    return false;
+  }
+  if (!chat_traj.assign_session(traj_data, vocabulary_fingerprint)) {
+    return false;
+  }
+  chat_traj.display_token_count_ = std::min(words[0], chat_traj.token_count());
+  chat_traj.context_token_count_ = std::min(words[1], chat_traj.token_count());
+  chat_disp.answer_prompt_offset_ = 0;
+  if (words[2] > 0 &&
+      words[2] + chat_disp.answer_prompt_tokens_.size() <= chat_traj.token_count())
+  {
+    chat_disp.answer_prompt_offset_ = words[2];
+  }
+
+  if (ctx) {
+    llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+    if (kv_size == 0 ||
+        0 == llama_state_seq_set_data(
+            ctx, (const uint8_t*)data.data(), kv_size, seq_id))
+    {
+      if (chat_traj.context_token_count_ > 0) {
+        fildesh_log_warning("KV cache state not restored. Will recompute.");
+      }
+      llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+      chat_traj.context_token_count_ = 0;
+      logits.clear();
+    }
+    if (logits.empty() && chat_traj.context_token_count_ > 0 &&
+        chat_traj.context_token_count_ == chat_traj.token_count())
+    {
+      // Recompute the last token to get logits for sampling.
+      chat_traj.context_token_count_ -= 1;
+      llama_kv_cache_seq_rm(ctx, seq_id, chat_traj.context_token_count_, -1);
+    }
+  }
+  inference.restore_sampling(
+      opt, model, chat_traj, words[3], words[4],
+      (logits.empty() ? nullptr : logits.data()));
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef RENDEZLLAMA_CHAT_SESSION_HH_
+#define RENDEZLLAMA_CHAT_SESSION_HH_
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+struct llama_context;
+struct llama_model;
+
+namespace rendezllama {
+
+struct ChatOptions;
+class ChatDisplay;
+class ChatTrajectory;
+class Inference;
+
+/** Read-only contents of a file, memory-mapped when possible.**/
+class MappedFile {
+ public:
+  MappedFile() {}
+  MappedFile(const MappedFile&) = delete;
+  ~MappedFile() {this->close();}
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool open(const std::string& filename);
+  void close();
+  bool is_open() const {return is_open_;}
+  std::string_view view() const {return std::string_view(data_, size_);}
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool is_open_ = false;
+  bool mapped_ = false;
+  std::string content_;
+};
+
+bool
+save_chat_state(
+    const std::string& filename,
+    ChatTrajectory& chat_traj,
+    const ChatDisplay& chat_disp,
+    const Inference& inference,
+    const struct llama_model* model,
+    struct llama_context* ctx,
+    uint64_t vocabulary_fingerprint);
+bool
+load_chat_state(
+    std::string_view data,
+    ChatTrajectory& chat_traj,
+    ChatDisplay& chat_disp,
+    Inference& inference,
+    const struct llama_model* model,
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    uint64_t vocabulary_fingerprint);
+
+}  // namespace rendezllama
+#endif
@@ -3,10 +3,14 @@
 #include <algorithm>
 #include <cassert>
 #include <climits>
+#include <cstring>
 
 #include <fildesh/string.hh>
 
+#include "src/language/latency.hh"
+
 using rendezllama::ChatTrajectory;
+using rendezllama::TraceSpan;
 using rendezllama::Vocabulary;
 
 ChatTrajectory::ChatTrajectory(Token_id token_id) {
@@ -17,6 +21,7 @@ ChatTrajectory::ChatTrajectory(Token_id token_id) {
 ChatTrajectory::~ChatTrajectory()
 {
   close_FildeshO(this->transcript_out_);
+  close_FildeshO(session_out_);
 }
 
   void
@@ -31,6 +36,8 @@ ChatTrajectory::insert_all_at(
     size_type i, const std::vector<Token_id>& a)
 {
   assert(i > 0);
+  this->detach_checkpoints_at(i);
+  this->truncate_tail_text_at(i);
   token_ids_.insert(token_ids_.begin() + i, a.begin(), a.end());
   message_prefix_ids_.insert(
       message_prefix_ids_.begin() + i,
@@ -38,6 +45,11 @@ ChatTrajectory::insert_all_at(
   if (i < display_token_count_) {
     display_token_count_ += a.size();
   }
+  if (session_out_ && i < session_token_count_) {
+    const unsigned words[1] = {i};
+    this->put_session_record(session_out_, 1, words, a.size());
+    session_token_count_ += a.size();
+  }
 }
 
 static
@@ -60,13 +72,13 @@ ChatTrajectory::tokenize_append(
     std::string_view s,
     const Vocabulary& vocabulary)
 {
-  fildesh::ostringstream oss;
+  fildesh::ostringstream& oss = scratch_oss_;
+  oss.truncate();
   maybe_pop_for_rewrite(*this, oss, vocabulary);
   oss << s;
 
-  std::vector<Token_id> tmp;
-  vocabulary.tokenize_to(tmp, oss.view());
-  this->insert_all_at(this->token_count(), tmp);
+  vocabulary.tokenize_to(scratch_tokens_, oss.view());
+  this->insert_all_at(this->token_count(), scratch_tokens_);
 }
 
   void
@@ -74,13 +86,33 @@ ChatTrajectory::erase_range(size_type beg, size_type end)
 {
   erased_since_eval_ = true;
   assert(beg <= end);
+  this->detach_checkpoints_at(beg);
+  this->truncate_tail_text_at(beg);
+  if (session_out_ && beg < session_token_count_) {
+    const size_type session_end = std::min(end, session_token_count_);
+    const unsigned words[2] = {beg, session_end};
+    this->put_session_record(session_out_, 2, words, 0);
+    session_token_count_ -= (session_end - beg);
+  }
   token_ids_.erase(
       token_ids_.begin() + beg,
       token_ids_.begin() + end);
+  if (redecode_token_count_ > end) {
+    redecode_token_count_ -= (end - beg);
+  }
+  else if (redecode_token_count_ > beg) {
+    redecode_token_count_ = beg;
+  }
+  if (context_token_count_ > end) {
+    // Evaluated tokens after the erased range have to be evaluated again.
+    redecode_token_count_ = std::max(
+        redecode_token_count_, context_token_count_ - (end - beg));
+  }
   if (context_token_count_ > beg) {
     context_token_count_ = beg;
   }
   if (context_token_count_ >= token_count()) {
+    redecode_token_count_ = std::max(redecode_token_count_, token_count());
     // The -1 is added to force an eval.
     context_token_count_ = token_count()-1;
   }
@@ -102,6 +134,7 @@ ChatTrajectory::erase_range(size_type beg, size_type end)
 ChatTrajectory::rollforget(size_type end, const Vocabulary& vocabulary)
 {
   assert(end <= this->token_count());
+  TraceSpan span("rollforget");
   const size_type beg = priming_token_count_;
   if (transcript_out_) {
     for (size_type i = beg; i < end; ++i) {
@@ -109,7 +142,29 @@ ChatTrajectory::rollforget(size_type end, const Vocabulary& vocabulary)
     }
     flush_FildeshO(transcript_out_);
   }
+  // Forgotten text is already in the transcript, so don't let undo revive it.
+  checkpoints_.clear();
   this->erase_range(beg, end);
+  rollforget_count_ += 1;
+}
+
+/** Heap bytes held by the trajectory, its checkpoints, and caches.**/
+  size_t
+ChatTrajectory::allocated_byte_count() const
+{
+  size_t n = (
+      token_ids_.capacity() * sizeof(Token_id) +
+      message_prefix_ids_.capacity() * sizeof(message_prefix_id) +
+      checkpoints_.capacity() * sizeof(Checkpoint) +
+      tail_text_.capacity() +
+      tail_text_offsets_.capacity() * sizeof(size_t) +
+      scratch_tokens_.capacity() * sizeof(Token_id) +
+      scratch_text_.capacity());
+  for (const Checkpoint& checkpoint : checkpoints_) {
+    n += checkpoint.token_ids.capacity() * sizeof(Token_id);
+    n += checkpoint.message_prefix_ids.capacity() * sizeof(message_prefix_id);
+  }
+  return n;
 }
 
 /** Drop oldest lines in the rolling prompt while keeping the priming prompt.
@@ -186,23 +241,139 @@ ChatTrajectory::tokenize_append_message_prefix(
   message_prefix_id_ = id;
 }
 
+/** Detokenized text of the last tokens after the priming prompt.
+ *
+ * Holds at least `byte_count` bytes unless the rolling prompt is shorter.
+ * Text is kept between calls, so only new tokens are detokenized.
+ **/
+  std::string_view
+ChatTrajectory::tail_text(size_t byte_count, const Vocabulary& vocabulary)
+{
+  const size_type end = tail_text_token_begin_ + tail_text_offsets_.size();
+  if (tail_text_vocabulary_ != &vocabulary ||
+      tail_text_substitution_version_ != vocabulary.substitution_version() ||
+      tail_text_token_begin_ < priming_token_count_ ||
+      end > this->token_count())
+  {
+    tail_text_vocabulary_ = &vocabulary;
+    tail_text_substitution_version_ = vocabulary.substitution_version();
+    tail_text_.clear();
+    tail_text_offsets_.clear();
+    tail_text_token_begin_ = std::max(priming_token_count_, this->token_count());
+  }
+
+  fildesh::ostringstream& oss = scratch_oss_;
+  oss.truncate();
+  for (size_type i = tail_text_token_begin_ + tail_text_offsets_.size();
+       i < this->token_count();
+       ++i)
+  {
+    tail_text_offsets_.push_back(tail_text_.size());
+    vocabulary.detokenize_to(oss.c_struct(), this->token_at(i));
+    tail_text_ += oss.view();
+    oss.truncate();
+  }
+
+  if (tail_text_.size() < byte_count &&
+      tail_text_token_begin_ > priming_token_count_)
+  {
+    // Detokenize older tokens and prepend them all at once.
+    std::vector<std::string> pieces;
+    size_t head_size = 0;
+    size_type i = tail_text_token_begin_;
+    while (i > priming_token_count_ && head_size + tail_text_.size() < byte_count) {
+      i -= 1;
+      vocabulary.detokenize_to(oss.c_struct(), this->token_at(i));
+      pieces.emplace_back(oss.view());
+      head_size += oss.view().size();
+      oss.truncate();
+    }
+    std::string head;
+    head.reserve(head_size + tail_text_.size());
+    std::vector<size_t> offsets;
+    offsets.reserve(pieces.size() + tail_text_offsets_.size());
+    for (auto it = pieces.rbegin(); it != pieces.rend(); ++it) {
+      offsets.push_back(head.size());
+      head += *it;
+    }
+    for (size_t offset : tail_text_offsets_) {
+      offsets.push_back(head_size + offset);
+    }
+    head += tail_text_;
+    tail_text_.swap(head);
+    tail_text_offsets_.swap(offsets);
+    tail_text_token_begin_ = i;
+  }
+  else if (tail_text_.size() > 4*byte_count + 256) {
+    // Drop older text that is no longer needed, but not too eagerly.
+    size_t n = 0;
+    while (n + 1 < tail_text_offsets_.size() &&
+           tail_text_.size() - tail_text_offsets_[n+1] >= 2*byte_count + 128)
+    {
+      n += 1;
+    }
+    if (n > 0) {
+      const size_t drop_size = tail_text_offsets_[n];
+      tail_text_.erase(0, drop_size);
+      tail_text_offsets_.erase(tail_text_offsets_.begin(), tail_text_offsets_.begin() + n);
+      for (size_t& offset : tail_text_offsets_) {
+        offset -= drop_size;
+      }
+      tail_text_token_begin_ += n;
+    }
+  }
+  return tail_text_;
+}
+
+/** Byte offset of the `i`th token in the tail text.**/
+  size_t
+ChatTrajectory::tail_text_offset_at(size_type i) const
+{
+  assert(i >= tail_text_token_begin_);
+  i -= tail_text_token_begin_;
+  if (i < tail_text_offsets_.size()) {
+    return tail_text_offsets_[i];
+  }
+  assert(i == tail_text_offsets_.size());
+  return tail_text_.size();
+}
+
+/** First token that begins at or after a byte offset of the tail text.**/
+  ChatTrajectory::size_type
+ChatTrajectory::tail_text_token_at(size_t offset) const
+{
+  auto it = std::lower_bound(
+      tail_text_offsets_.begin(), tail_text_offsets_.end(), offset);
+  return tail_text_token_begin_ + (it - tail_text_offsets_.begin());
+}
+
+/** Forget tail text of tokens that are about to change.**/
+  void
+ChatTrajectory::truncate_tail_text_at(size_type i)
+{
+  if (i >= tail_text_token_begin_ + tail_text_offsets_.size()) {
+    return;
+  }
+  if (i <= tail_text_token_begin_) {
+    tail_text_.clear();
+    tail_text_offsets_.clear();
+    tail_text_token_begin_ = i;
+    return;
+  }
+  i -= tail_text_token_begin_;
+  tail_text_.resize(tail_text_offsets_[i]);
+  tail_text_offsets_.resize(i);
+}
+
   bool
 ChatTrajectory::endswith_nonempty(
     std::string_view suffix,
     const Vocabulary& vocabulary)
 {
   assert(!suffix.empty());
-  fildesh::ostringstream oss;
-  std::string carry;
-  size_type token_index = this->token_count();
-  while (token_index > priming_token_count_ && carry.size() < suffix.size()) {
-    token_index -= 1;
-    vocabulary.detokenize_to(oss.c_struct(), this->token_at(token_index));
-    carry.insert(0, oss.view());
-    oss.truncate();
-  }
-  if (carry.size() >= suffix.size()) {
-    if (carry.substr(carry.size()-suffix.size()) == suffix) {
+  const std::string_view text = this->tail_text(suffix.size(), vocabulary);
+  if (text.size() >= suffix.size()) {
+    if (text.substr(text.size()-suffix.size()) == suffix) {
       return true;
     }
   }
@@ -218,75 +389,76 @@ ChatTrajectory::trim_message_suffix(
   if (pos != std::string_view::npos) {
     suffix = suffix.substr(0, pos+1);
   }
-
-  fildesh::ostringstream oss;
-  while (this->token_count() > priming_token_count_) {
-    size_type token_index = this->token_count()-1;
-    if (oss.view().empty()) {
-      Token_id token_id = this->token_at(token_index);
+  const std::string_view eos_token_alias = vocabulary.eos_token_alias();
+
+  // Repeatedly trim whitespace, EOS, and the suffix from the end of the text.
+  // Tokens are only erased once we know where the text should end.
+  size_t cut_size = 0;
+  size_t byte_count = 1 + std::max(suffix.size(), eos_token_alias.size());
+  size_type token_end = this->token_count();
+  std::string_view text;
+  while (true) {
+    text = this->tail_text(cut_size + byte_count, vocabulary);
+    const size_t e = text.size() - cut_size;
+    if (token_end > tail_text_token_begin_ &&
+        e == this->tail_text_offset_at(token_end))
+    {
+      const Token_id token_id = this->token_at(token_end-1);
       if (token_id == vocabulary.newline_token_id() ||
           token_id == vocabulary.eos_token_id()) {
-        this->erase_all_at(token_index);
+        token_end -= 1;
+        cut_size = text.size() - this->tail_text_offset_at(token_end);
         continue;
       }
-      vocabulary.detokenize_to(oss.c_struct(), token_id);
-    }
-    else {
-      token_index = this->token_count();
     }
 
-    auto pos = oss.view().find_last_not_of(" \n");
-    if (pos == std::string_view::npos) {
-      oss.truncate();
-      this->erase_all_at(token_index);
-      continue;
+    size_t n = e;
+    while (n > 0 && (text[n-1] == ' ' || text[n-1] == '\n')) {
+      n -= 1;
     }
-
-    std::string carry;
-    if (pos+1 == oss.view().size() && token_index < this->token_count()) {
-      token_index += 1;
+    if (n == 0 && tail_text_token_begin_ > priming_token_count_) {
+      // Only whitespace so far. Look further back.
+      byte_count += text.size();
+      continue;
     }
-    else {
-      carry = oss.view().substr(0, pos+1);
-      this->erase_all_at(token_index);
+    if (n < e) {
+      cut_size = text.size() - n;
+      token_end = this->tail_text_token_at(n);
+      continue;
     }
-    oss.truncate();
-    const size_t carry_rindex = carry.size();
 
-    assert(token_index <= this->token_count());
-    size_t sufficient_size = suffix.size();
-    const std::string_view eos_token_alias = vocabulary.eos_token_alias();
-    if (sufficient_size < eos_token_alias.size()) {
-      sufficient_size = eos_token_alias.size();
-    }
-    while (token_index > priming_token_count_ && carry.size() < sufficient_size) {
-      token_index -= 1;
-      vocabulary.detokenize_to(oss.c_struct(), this->token_at(token_index));
-      carry.insert(0, oss.view());
-      oss.truncate();
-    }
-    if (!eos_token_alias.empty() && carry.size() >= eos_token_alias.size()) {
-      size_t lhs_size = carry.size()-eos_token_alias.size();
-      if (carry.substr(lhs_size) == eos_token_alias) {
-        this->erase_all_at(token_index);
-        oss << carry.substr(0, lhs_size);
-        continue;
-      }
+    if (!eos_token_alias.empty() &&
+        e >= eos_token_alias.size() &&
+        text.substr(e-eos_token_alias.size(), eos_token_alias.size()) == eos_token_alias)
+    {
+      cut_size += eos_token_alias.size();
+      token_end = this->tail_text_token_at(text.size() - cut_size);
+      continue;
     }
     if (!suffix.empty() &&
-        carry.size() >= suffix.size())
+        e >= suffix.size() &&
+        text.substr(e-suffix.size(), suffix.size()) == suffix)
     {
-      size_t lhs_size = carry.size()-suffix.size();
-      if (carry.substr(lhs_size) == suffix) {
-        this->erase_all_at(token_index);
-        oss << carry.substr(0, lhs_size);
-        continue;
-      }
+      cut_size += suffix.size();
+      token_end = this->tail_text_token_at(text.size() - cut_size);
+      continue;
     }
-    oss << carry.substr(carry.size()-carry_rindex);
     break;
   }
-  this->tokenize_append(oss.view(), vocabulary);
+
+  // Erase from the token that holds the end, keeping its leading text.
+  const size_t e = text.size() - cut_size;
+  std::string& carry = scratch_text_;
+  carry.clear();
+  if (token_end > tail_text_token_begin_ &&
+      e < this->tail_text_offset_at(token_end))
+  {
+    token_end -= 1;
+    const size_t offset = this->tail_text_offset_at(token_end);
+    carry = text.substr(offset, e - offset);
+  }
+  this->erase_all_at(token_end);
+  this->tokenize_append(carry, vocabulary);
 }
 
   void
@@ -380,9 +552,305 @@ ChatTrajectory::assign_range_message_prefix_id(
     message_prefix_id id,
     size_type beg, size_type end)
 {
+  this->detach_checkpoints_at(beg);
   for (size_type i = beg; i < end; ++i) {
     message_prefix_ids_[i] = id;
   }
   message_prefix_id_ = last_message_prefix_id_at(this->token_count());
+  if (session_out_ && beg < session_token_count_) {
+    const unsigned words[3] = {id, beg, std::min(end, session_token_count_)};
+    this->put_session_record(session_out_, 3, words, 0);
+  }
+}
+
+/** Remember the current state so a later edit can be undone.**/
+  void
+ChatTrajectory::push_checkpoint()
+{
+  static const size_type checkpoint_limit = 16;
+  if (!checkpoints_.empty() &&
+      checkpoints_.back().shared_token_count == this->token_count() &&
+      checkpoints_.back().token_ids.empty())
+  {
+    // Nothing changed since the last checkpoint.
+    return;
+  }
+  if (checkpoints_.size() >= checkpoint_limit) {
+    checkpoints_.erase(checkpoints_.begin());
+  }
+  checkpoints_.emplace_back();
+  Checkpoint& checkpoint = checkpoints_.back();
+  checkpoint.shared_token_count = this->token_count();
+  checkpoint.context_token_count = context_token_count_;
+}
+
+/** Restore the state of the last checkpoint.**/
+  bool
+ChatTrajectory::undo_checkpoint()
+{
+  if (checkpoints_.empty()) {return false;}
+  Checkpoint checkpoint = std::move(checkpoints_.back());
+  checkpoints_.pop_back();
+  const size_type beg = checkpoint.shared_token_count;
+  this->erase_all_at(beg);
+  this->insert_all_at(beg, checkpoint.token_ids);
+  std::copy(
+      checkpoint.message_prefix_ids.begin(),
+      checkpoint.message_prefix_ids.end(),
+      message_prefix_ids_.begin() + beg);
+  message_prefix_id_ = last_message_prefix_id_at(this->token_count());
+  if (checkpoint.kv_backup_on) {
+    // Leave the last token for reevaluation to get its logits.
+    kv_restore_token_count_ = std::min(
+        checkpoint.context_token_count,
+        this->token_count()-1);
+  }
+  return true;
+}
+
+  ChatTrajectory::Checkpoint*
+ChatTrajectory::kv_backup_checkpoint()
+{
+  for (Checkpoint& checkpoint : checkpoints_) {
+    if (checkpoint.kv_backup_on) {
+      return &checkpoint;
+    }
+  }
+  return nullptr;
+}
+
+/** Copy tokens that are about to change into checkpoints that share them.**/
+  void
+ChatTrajectory::detach_checkpoints_at(size_type i)
+{
+  for (Checkpoint& checkpoint : checkpoints_) {
+    if (checkpoint.shared_token_count <= i) {continue;}
+    const size_type end = checkpoint.shared_token_count;
+    checkpoint.token_ids.insert(
+        checkpoint.token_ids.begin(),
+        token_ids_.begin() + i,
+        token_ids_.begin() + end);
+    checkpoint.message_prefix_ids.insert(
+        checkpoint.message_prefix_ids.begin(),
+        message_prefix_ids_.begin() + i,
+        message_prefix_ids_.begin() + end);
+    checkpoint.shared_token_count = i;
+  }
+  if (kv_restore_token_count_ > i) {
+    kv_restore_token_count_ = i;
+  }
+}
+
+/** Session log format.
+ *
+ * Header:
+ * - 8-byte magic string.
+ * - 32-bit version and 32-bit reserved word.
+ * - 64-bit vocabulary fingerprint.
+ *
+ * Then a sequence of records that replay edits to the trajectory:
+ * - 32-bit tag and 32-bit word count, followed by that many 32-bit words.
+ * - Tag 1 inserts tokens. Words are the index, then the token ids,
+ *   then their message prefix ids.
+ * - Tag 2 erases the [beg,end) token range.
+ * - Tag 3 assigns a message prefix id to the [beg,end) token range.
+ * - Tag 4 sets the priming token count.
+ **/
+static const char session_magic[8] = {'r','z','l','l','s','e','s','s'};
+static const unsigned session_version = 1;
+
+  void
+ChatTrajectory::put_session_record(
+    FildeshO* out, unsigned tag, const unsigned* words, size_type n) const
+{
+  // Insertion records are followed by `n` tokens and their prefix ids.
+  const size_type word_count = (
+      tag == 1 ? 1 + 2*n :
+      tag == 2 ? 2 :
+      tag == 3 ? 3 :
+      1);
+  const unsigned head[2] = {tag, word_count};
+  char* s = grow_FildeshO(out, sizeof(unsigned) * (2 + word_count));
+  memcpy(s, head, sizeof(head));
+  s += sizeof(head);
+  if (tag != 1) {
+    memcpy(s, words, sizeof(unsigned) * word_count);
+    return;
+  }
+  const size_type beg = words[0];
+  memcpy(s, words, sizeof(unsigned));
+  s += sizeof(unsigned);
+  memcpy(s, &token_ids_[beg], sizeof(Token_id) * n);
+  s += sizeof(Token_id) * n;
+  memcpy(s, &message_prefix_ids_[beg], sizeof(unsigned) * n);
+}
+
+/** Replace the whole trajectory with the contents of a session log.
+ *
+ * A truncated trailing record (e.g., from a crash mid-write) is ignored.
+ **/
+  bool
+ChatTrajectory::assign_session(
+    std::string_view data,
+    uint64_t vocabulary_fingerprint)
+{
+  const size_t header_size = sizeof(session_magic) + 2*sizeof(unsigned) + sizeof(uint64_t);
+  if (data.size() < header_size) {return false;}
+  if (0 != memcmp(data.data(), session_magic, sizeof(session_magic))) {
+    return false;
+  }
+  unsigned version = 0;
+  memcpy(&version, &data[sizeof(session_magic)], sizeof(version));
+  if (version != session_version) {return false;}
+  uint64_t fingerprint = 0;
+  memcpy(&fingerprint, &data[header_size - sizeof(fingerprint)], sizeof(fingerprint));
+  if (fingerprint != vocabulary_fingerprint) {return false;}
+
+  std::vector<Token_id> token_ids;
+  std::vector<unsigned> message_prefix_ids;
+  size_type priming_token_count = 1;
+  std::vector<unsigned> words;
+  size_t off = header_size;
+  while (data.size() - off >= 2*sizeof(unsigned)) {
+    unsigned head[2];
+    memcpy(head, &data[off], sizeof(head));
+    const size_t record_size = sizeof(unsigned) * (2 + (size_t)head[1]);
+    if (data.size() - off < record_size) {break;}
+    words.resize(head[1]);
+    if (!words.empty()) {
+      memcpy(words.data(), &data[off + sizeof(head)], sizeof(unsigned) * words.size());
+    }
+    off += record_size;
+
+    if (head[0] == 1) {
+      if (words.size() < 1 || words.size() % 2 != 1) {return false;}
+      const size_type at = words[0];
+      const size_type n = (words.size() - 1) / 2;
+      if (at > token_ids.size()) {return false;}
+      if (n == 0) {continue;}
+      token_ids.insert(token_ids.begin() + at, n, 0);
+      memcpy(&token_ids[at], &words[1], sizeof(Token_id) * n);
+      message_prefix_ids.insert(
+          message_prefix_ids.begin() + at,
+          words.begin() + 1 + n, words.end());
+    }
+    else if (head[0] == 2) {
+      if (words.size() != 2) {return false;}
+      if (words[0] > words[1] || words[1] > token_ids.size()) {return false;}
+      token_ids.erase(
+          token_ids.begin() + words[0],
+          token_ids.begin() + words[1]);
+      message_prefix_ids.erase(
+          message_prefix_ids.begin() + words[0],
+          message_prefix_ids.begin() + words[1]);
+    }
+    else if (head[0] == 3) {
+      if (words.size() != 3) {return false;}
+      if (words[1] > words[2] || words[2] > token_ids.size()) {return false;}
+      std::fill(
+          message_prefix_ids.begin() + words[1],
+          message_prefix_ids.begin() + words[2],
+          words[0]);
+    }
+    else if (head[0] == 4) {
+      if (words.size() != 1) {return false;}
+      priming_token_count = words[0];
+    }
+    // Unknown tags are skipped.
+  }
+  if (token_ids.empty() ||
+      priming_token_count == 0 ||
+      priming_token_count > token_ids.size())
+  {
+    return false;
+  }
+
+  if (session_out_ && session_token_count_ > 0) {
+    // Start over in the log too.
+    const unsigned words[2] = {0, session_token_count_};
+    this->put_session_record(session_out_, 2, words, 0);
+  }
+  token_ids_.swap(token_ids);
+  message_prefix_ids_.swap(message_prefix_ids);
+  checkpoints_.clear();
+  kv_restore_token_count_ = 0;
+  this->truncate_tail_text_at(0);
+  priming_token_count_ = priming_token_count;
+  display_token_count_ = this->token_count();
+  context_token_count_ = 0;
+  erased_since_eval_ = false;
+  message_prefix_id_ = last_message_prefix_id_at(this->token_count());
+  session_token_count_ = 0;
+  session_priming_token_count_ = 0;
+  return true;
+}
+
+/** Write the whole trajectory as a session log.**/
+  void
+ChatTrajectory::session_snapshot_to(
+    FildeshO* out,
+    uint64_t vocabulary_fingerprint) const
+{
+  const unsigned version_words[2] = {session_version, 0};
+  char* s = grow_FildeshO(
+      out,
+      sizeof(session_magic) + sizeof(version_words) + sizeof(vocabulary_fingerprint));
+  memcpy(s, session_magic, sizeof(session_magic));
+  s += sizeof(session_magic);
+  memcpy(s, version_words, sizeof(version_words));
+  s += sizeof(version_words);
+  memcpy(s, &vocabulary_fingerprint, sizeof(vocabulary_fingerprint));
+
+  const unsigned priming_words[1] = {priming_token_count_};
+  this->put_session_record(out, 4, priming_words, 0);
+  const unsigned insert_words[1] = {0};
+  this->put_session_record(out, 1, insert_words, this->token_count());
+}
+
+/** Start logging to a session file, beginning with a snapshot.
+ *
+ * Takes ownership of `out`.
+ **/
+  void
+ChatTrajectory::begin_session_out(
+    FildeshO* out,
+    uint64_t vocabulary_fingerprint)
+{
+  close_FildeshO(session_out_);
+  session_out_ = out;
+  session_token_count_ = 0;
+  session_priming_token_count_ = 0;
+  if (!session_out_) {return;}
+  this->session_snapshot_to(session_out_, vocabulary_fingerprint);
+  session_token_count_ = this->token_count();
+  session_priming_token_count_ = priming_token_count_;
+  flush_FildeshO(session_out_);
+}
+
+/** Append tokens that the session log doesn't have yet.**/
+  void
+ChatTrajectory::sync_session_out()
+{
+  if (!session_out_) {return;}
+  if (session_priming_token_count_ != priming_token_count_) {
+    const unsigned words[1] = {priming_token_count_};
+    this->put_session_record(session_out_, 4, words, 0);
+    session_priming_token_count_ = priming_token_count_;
+  }
+  if (session_token_count_ < this->token_count()) {
+    const unsigned words[1] = {session_token_count_};
+    this->put_session_record(
+        session_out_, 1, words, this->token_count() - session_token_count_);
+    session_token_count_ = this->token_count();
+  }
+  flush_FildeshO(session_out_);
+}
+
+  void
+ChatTrajectory::end_session_out()
+{
+  this->sync_session_out();
+  close_FildeshO(session_out_);
+  session_out_ = nullptr;
 }
 
@@ -1,7 +1,13 @@
 #ifndef RENDEZLLAMA_CHAT_TRAJECTORY_HH_
 #define RENDEZLLAMA_CHAT_TRAJECTORY_HH_
 
+#include <cstdint>
 #include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fildesh/string.hh>
 
 #include "src/language/vocabulary.hh"
 
@@ -13,6 +19,20 @@ class ChatTrajectory {
   typedef unsigned message_prefix_id;
   typedef unsigned size_type;
 
+  /** Earlier state of the trajectory for undoing edits.
+   *
+   * Shares the first `shared_token_count` tokens with the live trajectory
+   * and only keeps its own copy of the tokens after that.
+   **/
+  struct Checkpoint {
+    size_type shared_token_count = 0;
+    size_type context_token_count = 0;
+    std::vector<Token_id> token_ids;
+    std::vector<message_prefix_id> message_prefix_ids;
+    // Whether the KV cache of this state is kept in a backup sequence.
+    bool kv_backup_on = false;
+  };
+
  public:
   explicit ChatTrajectory(Token_id);
   ~ChatTrajectory();
@@ -61,11 +81,49 @@ class ChatTrajectory {
       size_type beg, size_type end);
 
   size_type priming_token_count() const {return priming_token_count_;}
+  size_t allocated_byte_count() const;
   const std::vector<Token_id>& tokens() const {return token_ids_;}
 
+  void push_checkpoint();
+  bool undo_checkpoint();
+  size_type checkpoint_count() const {return checkpoints_.size();}
+  Checkpoint* last_checkpoint() {
+    return (checkpoints_.empty() ? nullptr : &checkpoints_.back());
+  }
+  Checkpoint* kv_backup_checkpoint();
+
+  bool assign_session(std::string_view data, uint64_t vocabulary_fingerprint);
+  void session_snapshot_to(FildeshO* out, uint64_t vocabulary_fingerprint) const;
+  void begin_session_out(FildeshO* out, uint64_t vocabulary_fingerprint);
+  void sync_session_out();
+  void end_session_out();
+
+ private:
+  void detach_checkpoints_at(size_type i);
+  std::string_view tail_text(size_t byte_count, const Vocabulary& vocabulary);
+  size_t tail_text_offset_at(size_type i) const;
+  size_type tail_text_token_at(size_t offset) const;
+  void truncate_tail_text_at(size_type i);
+  void put_session_record(
+      FildeshO* out, unsigned tag, const unsigned* words, size_type n) const;
+
  private:
   std::vector<Token_id> token_ids_;
   std::vector<unsigned> message_prefix_ids_;
+  std::vector<Checkpoint> checkpoints_;
+  // Detokenized text of tokens starting at `tail_text_token_begin_`.
+  std::string tail_text_;
+  std::vector<size_t> tail_text_offsets_;
+  size_type tail_text_token_begin_ = 0;
+  const Vocabulary* tail_text_vocabulary_ = nullptr;
+  unsigned tail_text_substitution_version_ = 0;
+  FildeshO* session_out_ = nullptr;
+  size_type session_token_count_ = 0;
+  size_type session_priming_token_count_ = 0;
+  // Scratch space that is reused so that generating a token does not allocate.
+  fildesh::ostringstream scratch_oss_;
+  std::vector<Token_id> scratch_tokens_;
+  std::string scratch_text_;
  public:
   FildeshO* transcript_out_ = nullptr;
   size_type display_token_count_ = 0;
@@ -73,6 +131,11 @@ class ChatTrajectory {
   size_type priming_token_count_ = 1;
   message_prefix_id message_prefix_id_ = ChatTrajectory::unknown_message_prefix_id();
   bool erased_since_eval_ = false;
+  // Tokens up to this index can be restored from the backup KV sequence.
+  size_type kv_restore_token_count_ = 0;
+  // Tokens up to this index were evaluated before an erase shifted them.
+  size_type redecode_token_count_ = 0;
+  unsigned rollforget_count_ = 0;
 };
 
 }  // namespace rendezllama
@@ -0,0 +1,121 @@
+#include "src/language/alloc_count.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> allocated_byte_count{0};
+static std::atomic<uint64_t> allocation_count{0};
+
+static inline
+  void
+count_allocation(size_t size)
+{
+  allocated_byte_count.fetch_add(size, std::memory_order_relaxed);
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+// Also count what C code like fildesh allocates.
+// glibc lets a program replace malloc by defining it.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+  count_allocation(size);
+  return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+  count_allocation(n * size);
+  return __libc_calloc(n, size);
+}
+void* realloc(void* p, size_t size) {
+  count_allocation(size);
+  return __libc_realloc(p, size);
+}
+void* memalign(size_t alignment, size_t size) {
+  count_allocation(size);
+  return __libc_memalign(alignment, size);
+}
+void* aligned_alloc(size_t alignment, size_t size) {
+  count_allocation(size);
+  return __libc_memalign(alignment, size);
+}
+int posix_memalign(void** p, size_t alignment, size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0)
+  {
+    return EINVAL;
+  }
+  count_allocation(size);
+  *p = __libc_memalign(alignment, size);
+  return (*p ? 0 : ENOMEM);
+}
+}
+#endif
+
+// Count every allocation in the program.
+void* operator new(size_t size) {
+#if !defined(__GLIBC__)
+  count_allocation(size);
+#endif
+  void* p = malloc(size > 0 ? size : 1);
+  if (!p) {throw std::bad_alloc();}
+  return p;
+}
+void* operator new[](size_t size) {
+  return ::operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+#if !defined(__GLIBC__)
+  count_allocation(size);
+#endif
+  return malloc(size > 0 ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+  return ::operator new(size, tag);
+}
+void operator delete(void* p) noexcept {free(p);}
+void operator delete[](void* p) noexcept {free(p);}
+void operator delete(void* p, size_t) noexcept {free(p);}
+void operator delete[](void* p, size_t) noexcept {free(p);}
+void operator delete(void* p, const std::nothrow_t&) noexcept {free(p);}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {free(p);}
+
+#if !defined(_WIN32)
+// Over-aligned types like those of SIMD code use these.
+void* operator new(size_t size, std::align_val_t alignment) {
+#if !defined(__GLIBC__)
+  count_allocation(size);
+#endif
+  void* p = nullptr;
+  if (0 != posix_memalign(
+          &p, std::max(sizeof(void*), (size_t)alignment),
+          size > 0 ? size : 1))
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return ::operator new(size, alignment);
+}
+void operator delete(void* p, std::align_val_t) noexcept {free(p);}
+void operator delete[](void* p, std::align_val_t) noexcept {free(p);}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {free(p);}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {free(p);}
+#endif
+
+  rendezllama::AllocCount
+rendezllama::alloc_count()
+{
+  AllocCount count;
+  count.allocation_count = allocation_count.load(std::memory_order_relaxed);
+  count.allocated_byte_count = allocated_byte_count.load(std::memory_order_relaxed);
+  return count;
+}
@@ -0,0 +1,20 @@
+#ifndef RENDEZLLAMA_LANGUAGE_ALLOC_COUNT_HH_
+#define RENDEZLLAMA_LANGUAGE_ALLOC_COUNT_HH_
+#include <cstdint>
+
+namespace rendezllama {
+
+/** Heap allocations that the process has made so far.
+ *
+ * Only programs that link alloc_count.cc keep these counts,
+ * which is done by tests and benchmarks but not the chat itself.
+ **/
+struct AllocCount {
+  uint64_t allocation_count = 0;
+  uint64_t allocated_byte_count = 0;
+};
+
+AllocCount alloc_count();
+
+}  // namespace rendezllama
+#endif
@@ -2,7 +2,10 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <sstream>
 #include <thread>
 
 #include <fildesh/fildesh.h>
@@ -11,14 +14,29 @@
 #include "src/chat/display.hh"
 #include "src/chat/guide.hh"
 #include "src/chat/opt.hh"
+#include "src/chat/pool.hh"
 #include "src/chat/trajectory.hh"
+#include "src/language/latency.hh"
+#include "src/language/scheduler.hh"
 #include "src/language/vocabulary.hh"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using rendezllama::ChatDisplay;
 using rendezllama::ChatGuide;
 using rendezllama::ChatOptions;
 using rendezllama::ChatTrajectory;
+using rendezllama::DecodeScheduler;
 using rendezllama::Inference;
+using rendezllama::LatencyPhase;
+using rendezllama::LatencyTimer;
+using rendezllama::MemoryPlan;
+using rendezllama::ModelShape;
+using rendezllama::SequencePool;
+using rendezllama::TraceSpan;
 using rendezllama::Vocabulary;
 using rendezllama::inference::AdjustViaKind;
 
@@ -27,6 +45,73 @@ Inference::Inference(const Vocabulary& vocabulary)
 {}
 Inference::~Inference() {
   if (smpl_) {llama_sampler_free(smpl_);}
+  if (batch_capacity_ > 0) {llama_batch_free(batch_);}
+}
+
+/** Use a context that other sessions use too.
+ *
+ * The pool decides which sequences this session uses.
+ **/
+  void
+Inference::share_context(
+    DecodeScheduler* scheduler,
+    SequencePool* pool,
+    unsigned session_index)
+{
+  scheduler_ = scheduler;
+  pool_ = pool;
+  pool_index_ = session_index;
+}
+
+/** Lock a shared context and make sure our sequence is in it.**/
+  std::unique_lock<std::mutex>
+Inference::lock_sequence(
+    struct llama_context* ctx,
+    ChatTrajectory& chat_traj)
+{
+  if (!scheduler_) {
+    return std::unique_lock<std::mutex>();
+  }
+  std::unique_lock<std::mutex> context_lock(scheduler_->context_mutex());
+  this->acquire_sequence(ctx, chat_traj, context_lock);
+  return context_lock;
+}
+
+/** Start from tokens that another sequence already evaluated.
+ *
+ * The KV cells are shared, not duplicated.
+ **/
+  void
+Inference::copy_prefix_kv(
+    struct llama_context* ctx,
+    ChatTrajectory& chat_traj,
+    llama_seq_id src_seq_id,
+    unsigned token_count)
+{
+  std::unique_lock<std::mutex> context_lock = this->lock_sequence(ctx, chat_traj);
+  llama_kv_cache_seq_cp(ctx, src_seq_id, seq_id_, 0, token_count);
+  chat_traj.context_token_count_ = token_count;
+}
+
+  void
+Inference::acquire_sequence(
+    struct llama_context* ctx,
+    ChatTrajectory& chat_traj,
+    std::unique_lock<std::mutex>& context_lock)
+{
+  bool moved = false;
+  const bool kept = pool_->acquire(
+      pool_index_, ctx, context_lock, &seq_id_, &moved);
+  if (moved) {
+    // Our undo backup was dropped.
+    ChatTrajectory::Checkpoint* backup = chat_traj.kv_backup_checkpoint();
+    if (backup) {backup->kv_backup_on = false;}
+    chat_traj.kv_restore_token_count_ = 0;
+    kv_backup_on_ = false;
+  }
+  if (!kept) {
+    chat_traj.context_token_count_ = 0;
+  }
 }
 
   const std::string&
@@ -101,35 +186,104 @@ rendezllama::augment_tokenize_chat_input(
   }
 }
 
-  std::tuple<struct llama_model*, struct llama_context*>
-rendezllama::make_llama_context(rendezllama::ChatOptions& opt)
+static
+  enum ggml_type
+kv_cache_ggml_type(const std::string& type_name)
 {
-  llama_model_params model_params = llama_model_default_params();
-  model_params.use_mlock = opt.mlock_on;
-  model_params.use_mmap = opt.mmap_on;
+  if (type_name == "f32") {return GGML_TYPE_F32;}
+  if (type_name == "q8_0") {return GGML_TYPE_Q8_0;}
+  if (type_name == "q5_1") {return GGML_TYPE_Q5_1;}
+  if (type_name == "q5_0") {return GGML_TYPE_Q5_0;}
+  if (type_name == "q4_1") {return GGML_TYPE_Q4_1;}
+  if (type_name == "q4_0") {return GGML_TYPE_Q4_0;}
+  return GGML_TYPE_F16;
+}
 
-  struct llama_model* model = llama_model_load_from_file(
-      opt.model_filename.c_str(), model_params);
-  if (!model) {
-    fildesh_log_error("Failed to open model.");
-    return std::make_tuple(nullptr, nullptr);
+/** Read an unsigned hyperparameter of the model's architecture.**/
+static
+  unsigned
+llama_model_meta_unsigned(
+    const llama_model* model,
+    const char* key_suffix,
+    unsigned fallback)
+{
+  char buf[128];
+  if (0 > llama_model_meta_val_str(
+          model, "general.architecture", buf, sizeof(buf)))
+  {
+    return fallback;
   }
-
-  if (opt.model_token_limit == 0) {
-    opt.model_token_limit = llama_model_n_ctx_train(model);
+  const std::string key = std::string(buf) + key_suffix;
+  if (0 > llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf))) {
+    return fallback;
   }
-  if (opt.context_token_limit == 0) {
-    opt.context_token_limit = opt.model_token_limit;
+  char* end = nullptr;
+  const unsigned long n = strtoul(buf, &end, 10);
+  if (end == buf || *end != '\0' || n == 0) {
+    return fallback;
   }
+  return (unsigned)n;
+}
 
-  model_params = llama_model_default_params();
-  model_params.use_mlock = opt.mlock_on;
-  model_params.use_mmap = opt.mmap_on;
+/** Get sizes of a model, which can be vocabulary-only.
+ *
+ * Weights are sized by the file because they aren't loaded yet.
+ **/
+static
+  ModelShape
+llama_model_shape(const llama_model* model, const std::string& filename)
+{
+  ModelShape shape;
+  std::ifstream in(filename, std::ios::binary | std::ios::ate);
+  if (in) {
+    shape.weight_byte_count = (uint64_t)in.tellg();
+  }
+  shape.layer_count = llama_model_n_layer(model);
+  shape.head_count = llama_model_n_head(model);
+  shape.embedding_length = llama_model_n_embd(model);
+  shape.vocabulary_size = llama_vocab_n_tokens(llama_model_get_vocab(model));
+  shape.feed_forward_length = llama_model_meta_unsigned(
+      model, ".feed_forward_length", 4 * shape.embedding_length);
+  const unsigned kv_head_count = llama_model_meta_unsigned(
+      model, ".attention.head_count_kv", shape.head_count);
+  const unsigned head_length = llama_model_meta_unsigned(
+      model, ".attention.key_length",
+      shape.embedding_length / std::max(shape.head_count, 1u));
+  shape.kv_embedding_length = kv_head_count * head_length;
+  return shape;
+}
 
+static
+  llama_context_params
+make_llama_context_params(
+    const ChatOptions& opt,
+    const llama_model* model,
+    unsigned token_count,
+    unsigned session_count,
+    bool priming_sequence_on)
+{
+  // Each session has its own share of the KV cache.
   llama_context_params ctx_params = llama_context_default_params();
-  ctx_params.n_ctx = opt.context_token_limit;
+  ctx_params.n_ctx = token_count * session_count;
   ctx_params.n_threads = opt.thread_count;
   ctx_params.n_batch = opt.batch_count;
+  if (opt.ubatch_count > 0) {
+    ctx_params.n_ubatch = std::min(opt.ubatch_count, opt.batch_count);
+  }
+  if (!opt.kv_cache_key_type.empty()) {
+    ctx_params.type_k = kv_cache_ggml_type(opt.kv_cache_key_type);
+  }
+  if (!opt.kv_cache_value_type.empty()) {
+    ctx_params.type_v = kv_cache_ggml_type(opt.kv_cache_value_type);
+  }
+  ctx_params.flash_attn = (opt.flash_attention_on > 0);
+  // A second sequence per session backs up the KV cache of an undo checkpoint.
+  ctx_params.n_seq_max = 2 * session_count;
+  if (priming_sequence_on) {
+    // One more holds the priming prompt that sessions start from.
+    ctx_params.n_seq_max += 1;
+  }
+  // Scale for the full context limit so positions stay valid as it grows.
   ctx_params.rope_freq_scale = llama_model_rope_freq_scale_train(model);
   assert(ctx_params.rope_freq_scale > 0.0);
   while (
@@ -139,6 +293,122 @@ rendezllama::make_llama_context(rendezllama::ChatOptions& opt)
   {
     ctx_params.rope_freq_scale /= 2;
   }
+  return ctx_params;
+}
+
+/** Ask the OS to start reading the model file into the page cache.
+ *
+ * Returns right away. Loading then finds more of the file already in memory.
+ **/
+  void
+rendezllama::prefetch_model_file(const std::string& filename)
+{
+#ifndef _WIN32
+  const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {return;}
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  ::close(fd);
+#else
+  (void) filename;
+#endif
+}
+
+/** Load just the vocabulary and hyperparameters, which is quick.**/
+  struct llama_model*
+rendezllama::load_vocabulary_model(const std::string& filename)
+{
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  return llama_model_load_from_file(filename.c_str(), model_params);
+}
+
+/** Fill in options that default to model hyperparameters.
+ *
+ * Any model works, including a vocabulary-only one.
+ * With `priming_sequence_on`, sessions share the context with a sequence
+ * that holds their priming prompt, as in a server.
+ * Given a memory_budget_mib, this plans the context to fit it once.
+ * Afterwards, make_llama_context() will not modify `opt`.
+ * Returns false if the budget is too small.
+ **/
+  bool
+rendezllama::adapt_options_to_model(
+    ChatOptions& opt,
+    const struct llama_model* model,
+    unsigned session_count,
+    bool priming_sequence_on)
+{
+  if (opt.model_token_limit == 0) {
+    opt.model_token_limit = llama_model_n_ctx_train(model);
+  }
+  if (opt.context_token_limit == 0) {
+    opt.context_token_limit = opt.model_token_limit;
+  }
+  if (opt.context_growth_on && !opt.lora_filename.empty()) {
+    // A new context would need the adapter applied again.
+    fildesh_log_warning("Ignoring context_growth_on because of LoRA.");
+    opt.context_growth_on = false;
+  }
+  if (opt.context_growth_on && (session_count > 1 || priming_sequence_on)) {
+    // Growth is sized for one session without a shared priming sequence.
+    fildesh_log_warning("Ignoring context_growth_on with shared sessions.");
+    opt.context_growth_on = false;
+  }
+  if (opt.flash_attention_on < 0 && opt.memory_budget_mib == 0) {
+    // llama.cpp only supports quantized values with flash attention.
+    const bool quantized_values_on = (
+        !opt.kv_cache_value_type.empty() &&
+        kv_cache_block_byte_count(opt.kv_cache_value_type) < 64);
+    opt.flash_attention_on = (quantized_values_on ? 1 : 0);
+  }
+  if (opt.memory_budget_mib > 0 && opt.memory_plan.context_token_limit == 0) {
+    MemoryPlan plan;
+    const ModelShape shape = llama_model_shape(model, opt.model_filename);
+    if (!plan_memory(plan, shape, memory_plan_request(opt), session_count)) {
+      fildesh_log_error("Model does not fit in memory_budget_mib.");
+      return false;
+    }
+    apply_memory_plan(opt, plan);
+    std::ostringstream oss;
+    print_memory_plan(oss, plan);
+    fildesh_log_info(oss.str().c_str());
+  }
+  return true;
+}
+
+  std::tuple<struct llama_model*, struct llama_context*>
+rendezllama::make_llama_context(
+    rendezllama::ChatOptions& opt,
+    unsigned session_count,
+    bool priming_sequence_on)
+{
+  LatencyTimer timer(LatencyPhase::model_load);
+  llama_model_params model_params = llama_model_default_params();
+  model_params.use_mlock = opt.mlock_on;
+  model_params.use_mmap = opt.mmap_on;
+
+  struct llama_model* model = llama_model_load_from_file(
+      opt.model_filename.c_str(), model_params);
+  if (!model) {
+    fildesh_log_error("Failed to open model.");
+    return std::make_tuple(nullptr, nullptr);
+  }
+
+  if (!adapt_options_to_model(
+          opt, model, session_count, priming_sequence_on))
+  {
+    llama_model_free(model);
+    return std::make_tuple(nullptr, nullptr);
+  }
+  unsigned token_count = opt.context_token_limit;
+  if (opt.context_growth_on) {
+    token_count = std::min(token_count, 1024u);
+  }
+  llama_context_params ctx_params = make_llama_context_params(
+      opt, model, token_count, session_count, priming_sequence_on);
 
   struct llama_context* ctx = llama_init_from_model(model, ctx_params);
   if (!ctx) {
@@ -149,6 +419,54 @@ rendezllama::make_llama_context(rendezllama::ChatOptions& opt)
   return std::make_tuple(model, ctx);
 }
 
+/** Replace the context with a larger one that has the same state.
+ *
+ * Grows geometrically up to `context_token_limit`.
+ **/
+  bool
+rendezllama::grow_llama_context(
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    unsigned token_count)
+{
+  unsigned new_token_count = llama_n_ctx(ctx);
+  if (token_count <= new_token_count) {return true;}
+  while (new_token_count < token_count) {
+    new_token_count *= 2;
+  }
+  new_token_count = std::min(new_token_count, opt.context_token_limit);
+  if (new_token_count < token_count) {return false;}
+
+  // The model is only borrowed for the new context.
+  llama_model* model = const_cast<llama_model*>(llama_get_model(ctx));
+  struct llama_context* new_ctx = llama_init_from_model(
+      model, make_llama_context_params(opt, model, new_token_count, 1, false));
+  if (!new_ctx) {return false;}
+
+  std::vector<uint8_t> state(llama_state_get_size(ctx));
+  const size_t n = llama_state_get_data(ctx, state.data(), state.size());
+  if (n == 0 || n != llama_state_set_data(new_ctx, state.data(), n)) {
+    llama_free(new_ctx);
+    return false;
+  }
+  llama_free(ctx);
+  ctx = new_ctx;
+  return true;
+}
+
+/** Drop input that a stop request kept from being evaluated.**/
+static
+  void
+drop_unevaluated_tokens(ChatTrajectory& chat_traj)
+{
+  const unsigned n = chat_traj.context_token_count_;
+  const unsigned redecode_n = chat_traj.redecode_token_count_;
+  chat_traj.erase_all_at(n);
+  // The last evaluated token's logits are still valid.
+  chat_traj.context_token_count_ = n;
+  chat_traj.redecode_token_count_ = std::min(redecode_n, n);
+}
+
 static
   int
 new_sampling_seed()
@@ -254,22 +572,31 @@ mirostat_sample(
 }
 
   void
-Inference::reinitialize(const ChatOptions& opt, const struct llama_model* model)
+Inference::reinitialize(
+    const ChatOptions& opt,
+    const struct llama_model* model,
+    int seed)
 {
   fildesh::ofstream eout("/dev/stderr");
 
   const auto* sampling = std::get_if<rendezllama::inference::Sampling>(&opt.infer_via);
   assert(sampling);
-  auto seed = sampling->seed;
-  if (smpl_ || seed < 0) {
-    // We're retrying or just don't have a fixed seed, so we should reseed.
-    seed = new_sampling_seed();
+  if (seed < 0) {
+    seed = sampling->seed;
+    if (smpl_ || seed < 0) {
+      // We're retrying or just don't have a fixed seed, so we should reseed.
+      seed = new_sampling_seed();
+    }
   }
+  seed_ = seed;
   if (smpl_) {
     llama_sampler_free(smpl_);
     eout.open("/dev/null");
+    counts_.sampler_rebuild_count += 1;
   }
   token_count_ = 0;
+  draw_count_ = 0;
+  sampling_stale_ = false;
   auto smpl_param = llama_sampler_chain_default_params();
   smpl_ = llama_sampler_chain_init(smpl_param);
 
@@ -290,7 +617,7 @@ Inference::reinitialize(const ChatOptions& opt, const struct llama_model* model)
 
   bool
 Inference::commit_to_context(
-    struct llama_context* ctx,
+    struct llama_context*& ctx,
     ChatDisplay& chat_disp,
     ChatTrajectory& chat_traj,
     const ChatOptions& opt,
@@ -298,14 +625,23 @@ Inference::commit_to_context(
 {
   assert(!chat_traj.erased_since_eval_ ||
          chat_traj.context_token_count_ < chat_traj.token_count());
-  if (chat_traj.context_token_count_ < chat_traj.token_count()) {
-    this->reinitialize(opt, model);
-  }
   if (chat_traj.context_token_count_ == chat_traj.token_count()) {
     return true;
   }
+  logits_.clear();
 
+  std::unique_lock<std::mutex> context_lock = this->lock_sequence(ctx, chat_traj);
   chat_traj.maybe_rollforget_within_limit(opt.context_token_limit, vocabulary_);
+  // Appended tokens are just accepted by the current sampler below.
+  if (!smpl_ || sampling_stale_ || chat_traj.erased_since_eval_) {
+    this->reinitialize(opt, model);
+  }
+  if (opt.context_growth_on &&
+      !grow_llama_context(ctx, opt, chat_traj.token_count()))
+  {
+    fildesh_log_error("Failed to grow context.");
+    return false;
+  }
 
   // Reset thread count just in case the user reconfigured it.
   const unsigned thread_count = opt.thread_count;
@@ -318,10 +654,61 @@ Inference::commit_to_context(
   }
   llama_set_n_threads(ctx, thread_count, batch_thread_count);
 
+  this->sync_checkpoint_kv(ctx, chat_traj, opt);
   // Clear KV cache past current position just in case the user deleted tokens.
-  llama_kv_cache_seq_rm(ctx, -1, chat_traj.context_token_count_, -1);
+  llama_kv_cache_seq_rm(ctx, seq_id_, chat_traj.context_token_count_, -1);
+  const unsigned decode_begin = chat_traj.context_token_count_;
+
+  if (scheduler_) {
+    // Decode alongside other sessions.
+    pool_->pin(pool_index_);
+    context_lock.unlock();
+    const unsigned pos = chat_traj.context_token_count_;
+    chat_disp.show_new(chat_traj.token_count(), chat_traj, vocabulary_);
+    unsigned n;
+    {
+      const unsigned token_count = chat_traj.token_count() - pos;
+      LatencyTimer timer(
+          token_count > 1 ? LatencyPhase::prefill : LatencyPhase::decode,
+          token_count);
+      n = scheduler_->decode(
+          seq_id_, &chat_traj.tokens()[pos],
+          token_count, pos, logits_, stop_flag_);
+      timer.set_token_count(n);
+    }
+    if (n > 1) {
+      counts_.prefill_token_count += n;
+    }
+    context_lock.lock();
+    pool_->unpin(pool_index_);
+    context_lock.unlock();
+    if (n == 0) {
+      fildesh_log_error("Failed to eval.");
+      chat_traj.context_token_count_ = 0;
+      logits_.clear();
+      return false;
+    }
+    chat_traj.context_token_count_ = pos + n;
+    if (chat_traj.context_token_count_ < chat_traj.token_count()) {
+      drop_unevaluated_tokens(chat_traj);
+    }
+  }
+  if (!scheduler_ && batch_capacity_ < opt.batch_count) {
+    if (batch_capacity_ > 0) {llama_batch_free(batch_);}
+    batch_ = llama_batch_init(opt.batch_count, 0, 1);
+    batch_capacity_ = opt.batch_count;
+  }
 
+  // Without a scheduler, no other session shares the context,
+  // so nothing is locked while tokens are shown.
+  assert(scheduler_ || !context_lock.owns_lock());
+  bool decoded = false;
   while (chat_traj.context_token_count_ < chat_traj.token_count()) {
+    assert(!scheduler_);
+    if (decoded && stop_flag_ && stop_flag_->load()) {
+      drop_unevaluated_tokens(chat_traj);
+      break;
+    }
     const unsigned n = std::min(
         opt.batch_count,
         chat_traj.token_count() - chat_traj.context_token_count_);
@@ -336,10 +723,20 @@ Inference::commit_to_context(
 #endif
     chat_disp.show_new(chat_traj.context_token_count_ + n, chat_traj, vocabulary_);
 
-    llama_batch batch = llama_batch_get_one(
-        const_cast<int*>(&chat_traj.tokens()[chat_traj.context_token_count_]),
-        n);
-    const int istat = llama_decode(ctx, batch);
+    batch_.n_tokens = n;
+    for (unsigned i = 0; i < n; ++i) {
+      const unsigned pos = chat_traj.context_token_count_ + i;
+      batch_.token[i] = chat_traj.token_at(pos);
+      batch_.pos[i] = pos;
+      batch_.n_seq_id[i] = 1;
+      batch_.seq_id[i][0] = seq_id_;
+      batch_.logits[i] = (i + 1 == n);
+    }
+    int istat;
+    {
+      LatencyTimer timer(n > 1 ? LatencyPhase::prefill : LatencyPhase::decode, n);
+      istat = llama_decode(ctx, batch_);
+    }
     if (istat != 0) {
       fildesh_log_error("Failed to eval.");
       chat_traj.context_token_count_ = 0;
@@ -347,10 +744,28 @@ Inference::commit_to_context(
     }
     else {
       chat_traj.context_token_count_ += n;
+      decoded = true;
+      if (n > 1) {
+        counts_.prefill_token_count += n;
+      }
     }
   }
+  if (decode_begin < chat_traj.redecode_token_count_) {
+    counts_.redecode_token_count += std::min(
+        chat_traj.context_token_count_,
+        chat_traj.redecode_token_count_) - decode_begin;
+  }
+  if (chat_traj.context_token_count_ >= chat_traj.redecode_token_count_) {
+    chat_traj.redecode_token_count_ = 0;
+  }
   assert(chat_traj.context_token_count_ == chat_traj.token_count());
+  if (!scheduler_) {
+    const float* logits = llama_get_logits_ith(ctx, -1);
+    logits_.assign(logits, logits + vocabulary_.cardinality());
+  }
   chat_traj.erased_since_eval_ = false;
+  chat_traj.sync_session_out();
+  TraceSpan span("sampler_accept");
   while (token_count_ < chat_traj.token_count()) {
     Vocabulary::Token_id token_id = chat_traj.token_at(token_count_);
     llama_sampler_accept(smpl_, token_id);
@@ -359,36 +774,198 @@ Inference::commit_to_context(
   return true;
 }
 
+/** Keep the KV cache of the last checkpoint in a backup sequence
+ * and restore from it after an undo.
+ **/
   void
+Inference::sync_checkpoint_kv(
+    struct llama_context* ctx,
+    ChatTrajectory& chat_traj,
+    const ChatOptions& opt)
+{
+  const llama_seq_id live_seq_id = seq_id_;
+  const llama_seq_id backup_seq_id = seq_id_ + 1;
+  if (chat_traj.kv_restore_token_count_ > chat_traj.context_token_count_) {
+    llama_kv_cache_seq_rm(ctx, live_seq_id, chat_traj.context_token_count_, -1);
+    llama_kv_cache_seq_cp(
+        ctx, backup_seq_id, live_seq_id,
+        chat_traj.context_token_count_,
+        chat_traj.kv_restore_token_count_);
+    chat_traj.context_token_count_ = chat_traj.kv_restore_token_count_;
+  }
+  chat_traj.kv_restore_token_count_ = 0;
+
+  ChatTrajectory::Checkpoint* checkpoint = chat_traj.last_checkpoint();
+  if (checkpoint && !checkpoint->kv_backup_on &&
+      checkpoint->context_token_count > 0)
+  {
+    // The live sequence still has entries for all of the checkpoint's context.
+    ChatTrajectory::Checkpoint* old = chat_traj.kv_backup_checkpoint();
+    if (old) {old->kv_backup_on = false;}
+    llama_kv_cache_seq_rm(ctx, backup_seq_id, -1, -1);
+    llama_kv_cache_seq_cp(
+        ctx, live_seq_id, backup_seq_id,
+        0, checkpoint->context_token_count);
+    checkpoint->kv_backup_on = true;
+    kv_backup_on_ = true;
+  }
+
+  ChatTrajectory::Checkpoint* backup = chat_traj.kv_backup_checkpoint();
+  if (backup) {
+    // Drop the backup when its entries leave too little room for the live ones.
+    // A shared context only reserves `context_token_limit` per session.
+    const unsigned backup_only_count = backup->context_token_count - std::min(
+        backup->shared_token_count, chat_traj.context_token_count_);
+    const unsigned token_limit = (
+        scheduler_
+        ? opt.context_token_limit
+        : std::min(opt.context_token_limit, llama_n_ctx(ctx)));
+    if (chat_traj.token_count() + backup_only_count > token_limit) {
+      backup->kv_backup_on = false;
+      backup = nullptr;
+    }
+  }
+  if (!backup && kv_backup_on_) {
+    llama_kv_cache_seq_rm(ctx, backup_seq_id, -1, -1);
+    kv_backup_on_ = false;
+  }
+}
+
+/** Sample the next token from the last evaluated token's logits.
+ *
+ * Returns false if there is nothing to sample from,
+ * such as when the last evaluation was stopped early.
+ **/
+  bool
 Inference::sample_to_trajectory(
     ChatTrajectory& chat_traj,
-    struct llama_context* ctx,
     bool preventing_newline)
 {
-  float* logits = llama_get_logits(ctx);
+  LatencyTimer timer(LatencyPhase::sample);
+  if (logits_.empty()) {
+    fildesh_log_error("No logits to sample from.");
+    return false;
+  }
+  float* logits = logits_.data();
   if (preventing_newline) {
     // Zero probability for message-ending tokens when requested.
     logits[vocabulary_.eos_token_id()] = 0;
     logits[vocabulary_.newline_token_id()] = 0;
   }
 
-  std::vector<llama_token_data> candidates;
-  candidates.resize(vocabulary_.cardinality());
-  for (llama_token i = 0; i < (llama_token)candidates.size(); ++i) {
-    candidates[i] = llama_token_data{
+  // Reuse the buffer so that generating a token does not allocate.
+  candidates_.resize(vocabulary_.cardinality());
+  for (llama_token i = 0; i < (llama_token)candidates_.size(); ++i) {
+    candidates_[i] = llama_token_data{
       i, logits[i], 0.0f,
     };
   }
   logits = NULL;
   llama_token_data_array candidates_data[1] = {{
-    candidates.data(),
-    candidates.size(),
+    candidates_.data(),
+    candidates_.size(),
     /*selected=*/0,
     /*sorted=*/false,
   }};
-  llama_sampler_apply(smpl_, candidates_data);
-  chat_traj.push_back(candidates[candidates_data->selected].id);
-  llama_sampler_accept(smpl_, chat_traj.token());
+  {
+    TraceSpan span("sampler_apply");
+    llama_sampler_apply(smpl_, candidates_data);
+  }
+  draw_count_ += 1;
+  chat_traj.push_back(candidates_[candidates_data->selected].id);
+  {
+    TraceSpan span("sampler_accept");
+    llama_sampler_accept(smpl_, chat_traj.token());
+  }
   token_count_ += 1;
+  logits_.clear();
+  counts_.generated_token_count += 1;
+  return true;
+}
+
+/** Rebuild the sampler at the next commit in case its options changed.**/
+  void
+Inference::reconfigure_sampling()
+{
+  sampling_stale_ = true;
+}
+
+/** Logits of the last evaluated token, if not sampled yet.**/
+  const float*
+Inference::pending_logits() const
+{
+  return (logits_.empty() ? nullptr : logits_.data());
+}
+
+/** Set logits of the last evaluated token to sample from next.**/
+  void
+Inference::assign_pending_logits(const float* logits)
+{
+  if (logits) {
+    logits_.assign(logits, logits + vocabulary_.cardinality());
+  }
+  else {
+    logits_.clear();
+  }
+}
+
+/** Rebuild the sampler as it was when a state was saved.
+ *
+ * The random number generator of the final `dist` sampler is advanced past
+ * the `draw_count` tokens that were sampled since seeding,
+ * so sampling continues just as it would have without a save and load.
+ * Other seeded samplers (mirostat and xtc) draw a varying amount of
+ * randomness per token, so they sample differently instead.
+ * Returns false (with a warning) in that case.
+ **/
+  bool
+Inference::restore_sampling(
+    const ChatOptions& opt,
+    const llama_model* model,
+    const ChatTrajectory& chat_traj,
+    unsigned seed,
+    unsigned draw_count,
+    const float* logits)
+{
+  this->reinitialize(opt, model, static_cast<int>(INT_MAX & seed));
+  while (token_count_ < chat_traj.context_token_count_) {
+    llama_sampler_accept(smpl_, chat_traj.token_at(token_count_));
+    token_count_ += 1;
+  }
+  const int sampler_count = llama_sampler_chain_n(smpl_);
+  struct llama_sampler* dist = (
+      sampler_count > 0
+      ? llama_sampler_chain_get(smpl_, sampler_count - 1)
+      : nullptr);
+  if (dist && 0 != strcmp("dist", llama_sampler_name(dist))) {
+    dist = nullptr;
+  }
+  bool restorable = (dist != nullptr);
+  for (int i = 0; i < sampler_count - 1; ++i) {
+    const char* name = llama_sampler_name(llama_sampler_chain_get(smpl_, i));
+    if (0 == strcmp("xtc", name) || 0 == strncmp("mirostat", name, 8)) {
+      restorable = false;
+    }
+  }
+  if (restorable) {
+    // Each draw takes the same amount of randomness for any candidates.
+    llama_token_data placeholders[2] = {{0, 0.0f, 0.0f}, {1, 0.0f, 0.0f}};
+    for (unsigned i = 0; i < draw_count; ++i) {
+      llama_token_data_array candidates_data[1] = {{
+        placeholders, 2, /*selected=*/-1, /*sorted=*/false,
+      }};
+      llama_sampler_apply(dist, candidates_data);
+    }
+  }
+  else if (draw_count > 0) {
+    fildesh_log_warning("Restored sampling will differ from the saved run.");
+  }
+  else {
+    // Nothing was drawn since seeding.
+    restorable = true;
+  }
+  draw_count_ = draw_count;
+  this->assign_pending_logits(logits);
+  return restorable;
 }
 
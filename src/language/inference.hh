@@ -1,5 +1,7 @@
 #ifndef RENDEZLLAMA_LANGUAGE_INFERENCE_HH_
 #define RENDEZLLAMA_LANGUAGE_INFERENCE_HH_
+#include <atomic>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <tuple>
@@ -14,9 +16,20 @@ struct ChatOptions;
 class ChatDisplay;
 class ChatGuide;
 class ChatTrajectory;
+class DecodeScheduler;
+class SequencePool;
 class Vocabulary;
 
 class Inference {
+ public:
+  /** What this session has done since the counts were last reset.**/
+  struct Counts {
+    unsigned prefill_token_count = 0;
+    unsigned generated_token_count = 0;
+    unsigned redecode_token_count = 0;
+    unsigned sampler_rebuild_count = 0;
+  };
+
  public:
   explicit Inference(const Vocabulary& vocabulary);
   Inference(const Inference&) = delete;
@@ -28,23 +41,79 @@ class Inference {
  private:
   void reinitialize(
       const ChatOptions& opt,
-      const struct llama_model* model);
+      const struct llama_model* model,
+      int seed = -1);
+  void sync_checkpoint_kv(
+      struct llama_context* ctx,
+      ChatTrajectory& chat_traj,
+      const ChatOptions& opt);
+  void acquire_sequence(
+      struct llama_context* ctx,
+      ChatTrajectory& chat_traj,
+      std::unique_lock<std::mutex>& context_lock);
 
  public:
   bool commit_to_context(
-      struct llama_context* ctx,
+      struct llama_context*& ctx,
       ChatDisplay& chat_disp,
       ChatTrajectory& chat_traj,
       const ChatOptions& opt,
       const llama_model* model);
-  void sample_to_trajectory(
+  bool sample_to_trajectory(
       ChatTrajectory& chat_traj,
-      struct llama_context* ctx,
       bool preventing_newline);
 
+  void share_context(
+      DecodeScheduler* scheduler,
+      SequencePool* pool,
+      unsigned session_index);
+  std::unique_lock<std::mutex> lock_sequence(
+      struct llama_context* ctx,
+      ChatTrajectory& chat_traj);
+  void copy_prefix_kv(
+      struct llama_context* ctx,
+      ChatTrajectory& chat_traj,
+      llama_seq_id src_seq_id,
+      unsigned token_count);
+  void watch_stop_flag(const std::atomic<bool>* flag) {stop_flag_ = flag;}
+  llama_seq_id seq_id() const {return seq_id_;}
+  unsigned sampling_seed() const {return seed_;}
+  unsigned sampling_draw_count() const {return draw_count_;}
+  void reconfigure_sampling();
+  const Counts& counts() const {return counts_;}
+  void reset_counts() {counts_ = Counts();}
+  const float* pending_logits() const;
+  void assign_pending_logits(const float* logits);
+  bool restore_sampling(
+      const ChatOptions& opt,
+      const llama_model* model,
+      const ChatTrajectory& chat_traj,
+      unsigned seed,
+      unsigned draw_count,
+      const float* logits);
+
  private:
   llama_sampler* smpl_ = nullptr;
   size_t token_count_ = 0;
+  unsigned seed_ = 0;
+  // Tokens sampled since the sampler was seeded.
+  unsigned draw_count_ = 0;
+  bool kv_backup_on_ = false;
+  bool sampling_stale_ = false;
+  // Live sequence. The next one backs up the KV cache of a checkpoint.
+  llama_seq_id seq_id_ = 0;
+  DecodeScheduler* scheduler_ = nullptr;
+  // Assigns `seq_id_` when sessions outnumber resident sequences.
+  SequencePool* pool_ = nullptr;
+  unsigned pool_index_ = 0;
+  // Raised to stop evaluating a long input early.
+  const std::atomic<bool>* stop_flag_ = nullptr;
+  llama_batch batch_;
+  unsigned batch_capacity_ = 0;
+  // Logits of the last evaluated token until it is sampled.
+  std::vector<float> logits_;
+  std::vector<llama_token_data> candidates_;
+  Counts counts_;
   const Vocabulary& vocabulary_;
 };
 
@@ -62,8 +131,26 @@ augment_tokenize_chat_input(
     const ChatOptions& opt);
 
 
+void
+prefetch_model_file(const std::string& filename);
+struct llama_model*
+load_vocabulary_model(const std::string& filename);
+bool
+adapt_options_to_model(
+    ChatOptions& opt,
+    const struct llama_model* model,
+    unsigned session_count = 1,
+    bool priming_sequence_on = false);
 std::tuple<struct llama_model*, struct llama_context*>
-make_llama_context(ChatOptions& opt);
+make_llama_context(
+    ChatOptions& opt,
+    unsigned session_count = 1,
+    bool priming_sequence_on = false);
+bool
+grow_llama_context(
+    struct llama_context*& ctx,
+    const ChatOptions& opt,
+    unsigned token_count);
 
 }  // namespace rendezllama
 #endif
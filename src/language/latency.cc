@@ -0,0 +1,224 @@
+#include "src/language/latency.hh"
+
+#include <cmath>
+
+using rendezllama::LatencyHistogram;
+using rendezllama::LatencyPhase;
+using rendezllama::LatencyStats;
+using rendezllama::LatencyTimer;
+using rendezllama::PhaseTimes;
+using rendezllama::TraceBuffer;
+
+  void
+LatencyHistogram::add(Duration duration)
+{
+  const double us = std::chrono::duration<double, std::micro>(duration).count();
+  unsigned i = 0;
+  if (us >= 1) {
+    // Bucket i holds durations up to 2^(i/4) microseconds.
+    i = 1 + (unsigned)(4 * std::log2(us));
+  }
+  if (i >= bucket_count) {
+    i = bucket_count - 1;
+  }
+  buckets_[i] += 1;
+  count_ += 1;
+  total_ns_ += duration.count();
+}
+
+/** Upper bound of the bucket that holds the `q` quantile.**/
+  LatencyHistogram::Duration
+LatencyHistogram::quantile(double q) const
+{
+  if (count_ == 0) {return Duration(0);}
+  uint64_t n = (uint64_t)std::ceil(q * count_);
+  if (n == 0) {n = 1;}
+  unsigned i = 0;
+  for (uint64_t sum = buckets_[0]; sum < n; sum += buckets_[i]) {
+    i += 1;
+  }
+  const double us = std::exp2(i / 4.0);
+  return Duration((int64_t)(1000 * us));
+}
+
+  void
+LatencyStats::record(
+    LatencyPhase phase,
+    LatencyHistogram::Duration duration,
+    unsigned token_count)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Phase& p = phases_[(unsigned)phase];
+  p.histogram.add(duration);
+  p.token_count += token_count;
+}
+
+static
+  double
+milliseconds_of(LatencyHistogram::Duration duration)
+{
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+  const char*
+rendezllama::latency_phase_name(LatencyPhase phase)
+{
+  static const char* const phase_names[] = {
+    "model_load",
+    "tokenize",
+    "prefill",
+    "decode",
+    "sample",
+    "display",
+    "time_to_first_token",
+    "inter_token",
+  };
+  static_assert(
+      sizeof(phase_names)/sizeof(*phase_names) == (unsigned)LatencyPhase::count,
+      "Every phase needs a name.");
+  return phase_names[(unsigned)phase];
+}
+
+  void
+LatencyStats::print_to(std::ostream& out) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (unsigned i = 0; i < (unsigned)LatencyPhase::count; ++i) {
+    const Phase& p = phases_[i];
+    const LatencyHistogram& h = p.histogram;
+    if (h.count() == 0) {continue;}
+    out << latency_phase_name((LatencyPhase)i) << ":"
+      << " count " << h.count()
+      << ", mean " << milliseconds_of(h.total()) / h.count() << " ms"
+      << ", p50 " << milliseconds_of(h.quantile(0.5)) << " ms"
+      << ", p99 " << milliseconds_of(h.quantile(0.99)) << " ms";
+    if (i == (unsigned)LatencyPhase::prefill ||
+        i == (unsigned)LatencyPhase::decode)
+    {
+      const double seconds = milliseconds_of(h.total()) / 1000;
+      if (seconds > 0) {
+        out << ", " << p.token_count / seconds << " tok/s";
+      }
+    }
+    out << '\n';
+  }
+}
+
+  LatencyStats&
+rendezllama::latency_stats()
+{
+  static LatencyStats stats;
+  return stats;
+}
+
+  PhaseTimes&
+rendezllama::thread_phase_times()
+{
+  static thread_local PhaseTimes times;
+  return times;
+}
+
+LatencyTimer::~LatencyTimer()
+{
+  const LatencyHistogram::Duration wall =
+    std::chrono::steady_clock::now() - begin_;
+  // Process CPU time includes threads that this thread waits on.
+  const LatencyHistogram::Duration cpu(
+      (int64_t)((std::clock() - cpu_begin_) * (1e9 / CLOCKS_PER_SEC)));
+  latency_stats().record(phase_, wall, token_count_);
+  PhaseTimes& times = thread_phase_times();
+  times.wall[(unsigned)phase_] += wall;
+  times.cpu[(unsigned)phase_] += cpu;
+  if (trace_buffer().enabled()) {
+    trace_buffer().record(
+        latency_phase_name(phase_), begin_, begin_ + wall, token_count_);
+  }
+}
+
+/** Start recording spans, keeping at most `capacity` of them.**/
+  void
+TraceBuffer::enable(unsigned capacity)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.resize(capacity > 0 ? capacity : 1);
+  next_index_ = 0;
+  wrapped_ = false;
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+/** Forget recorded spans but keep recording.**/
+  void
+TraceBuffer::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  next_index_ = 0;
+  wrapped_ = false;
+}
+
+/** Small number that identifies the calling thread in traces.**/
+static
+  unsigned
+trace_thread_index()
+{
+  static std::atomic<unsigned> thread_count{0};
+  static thread_local unsigned thread_index = ++thread_count;
+  return thread_index;
+}
+
+  void
+TraceBuffer::record(
+    const char* name,
+    Time begin,
+    Time end,
+    unsigned token_count)
+{
+  if (!this->enabled()) {return;}
+  Event e;
+  e.name = name;
+  e.begin_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      begin.time_since_epoch()).count();
+  e.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      end - begin).count();
+  e.thread_index = trace_thread_index();
+  e.token_count = token_count;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (events_.empty()) {return;}
+  events_[next_index_] = e;
+  next_index_ += 1;
+  if (next_index_ == events_.size()) {
+    next_index_ = 0;
+    wrapped_ = true;
+  }
+}
+
+/** Write spans from oldest to newest in Chrome's trace event format.**/
+  void
+TraceBuffer::write_chrome_trace_to(std::ostream& out) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t begin = (wrapped_ ? next_index_ : 0);
+  const size_t count = (wrapped_ ? events_.size() : next_index_);
+  out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < count; ++i) {
+    const Event& e = events_[(begin + i) % events_.size()];
+    out << (i == 0 ? "\n" : ",\n")
+      << "{\"name\":\"" << e.name << "\""
+      << ",\"ph\":\"X\",\"pid\":1"
+      << ",\"tid\":" << e.thread_index
+      << ",\"ts\":" << e.begin_us
+      << ",\"dur\":" << e.duration_us;
+    if (e.token_count > 0) {
+      out << ",\"args\":{\"tokens\":" << e.token_count << "}";
+    }
+    out << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+  TraceBuffer&
+rendezllama::trace_buffer()
+{
+  static TraceBuffer buffer;
+  return buffer;
+}
@@ -0,0 +1,160 @@
+#ifndef RENDEZLLAMA_LANGUAGE_LATENCY_HH_
+#define RENDEZLLAMA_LANGUAGE_LATENCY_HH_
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace rendezllama {
+
+/** Log-scale histogram of durations.
+ *
+ * Each power of 2 microseconds is split into 4 buckets,
+ * so quantiles are accurate to within about 19%.
+ **/
+class LatencyHistogram {
+ public:
+  typedef std::chrono::nanoseconds Duration;
+  static const unsigned bucket_count = 4 * 40;
+
+  void add(Duration duration);
+  uint64_t count() const {return count_;}
+  Duration total() const {return Duration(total_ns_);}
+  Duration quantile(double q) const;
+
+ private:
+  std::array<uint64_t, bucket_count> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t total_ns_ = 0;
+};
+
+enum class LatencyPhase : unsigned {
+  model_load,
+  tokenize,
+  prefill,
+  decode,
+  sample,
+  display,
+  first_token,
+  inter_token,
+  count
+};
+
+const char* latency_phase_name(LatencyPhase phase);
+
+/** Timings of every phase, shared by all sessions of the process.**/
+class LatencyStats {
+ public:
+  void record(
+      LatencyPhase phase,
+      LatencyHistogram::Duration duration,
+      unsigned token_count = 1);
+  void print_to(std::ostream& out) const;
+
+ private:
+  struct Phase {
+    LatencyHistogram histogram;
+    uint64_t token_count = 0;
+  };
+  mutable std::mutex mutex_;
+  std::array<Phase, (unsigned)LatencyPhase::count> phases_;
+};
+
+LatencyStats& latency_stats();
+
+/** Wall and process CPU time of each phase timed on one thread.
+ *
+ * Lets a session attribute time to its own turns.
+ **/
+struct PhaseTimes {
+  std::array<LatencyHistogram::Duration, (unsigned)LatencyPhase::count> wall{};
+  std::array<LatencyHistogram::Duration, (unsigned)LatencyPhase::count> cpu{};
+};
+PhaseTimes& thread_phase_times();
+
+/** Ring buffer of recent spans for a Chrome trace.
+ *
+ * Spans are only recorded after enable() is called.
+ * Once full, each new span overwrites the oldest one.
+ **/
+class TraceBuffer {
+ public:
+  typedef std::chrono::steady_clock::time_point Time;
+
+  void enable(unsigned capacity);
+  void clear();
+  bool enabled() const {return enabled_.load(std::memory_order_relaxed);}
+  void record(const char* name, Time begin, Time end, unsigned token_count);
+  void write_chrome_trace_to(std::ostream& out) const;
+
+ private:
+  struct Event {
+    const char* name;
+    int64_t begin_us;
+    int64_t duration_us;
+    unsigned thread_index;
+    unsigned token_count;
+  };
+  std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+  size_t next_index_ = 0;
+  bool wrapped_ = false;
+};
+
+TraceBuffer& trace_buffer();
+
+/** Records a trace span (if tracing) until it goes out of scope.**/
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+    : name_(name)
+  {
+    if (trace_buffer().enabled()) {
+      begin_ = std::chrono::steady_clock::now();
+    }
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    if (begin_ != TraceBuffer::Time()) {
+      trace_buffer().record(name_, begin_, std::chrono::steady_clock::now(), 0);
+    }
+  }
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_;
+  TraceBuffer::Time begin_;
+};
+
+/** Records the time until it goes out of scope.
+ *
+ * Also records a trace span named after the phase.
+ **/
+class LatencyTimer {
+ public:
+  explicit LatencyTimer(LatencyPhase phase, unsigned token_count = 1)
+    : phase_(phase)
+    , token_count_(token_count)
+    , begin_(std::chrono::steady_clock::now())
+    , cpu_begin_(std::clock())
+  {}
+  LatencyTimer(const LatencyTimer&) = delete;
+  ~LatencyTimer();
+  LatencyTimer& operator=(const LatencyTimer&) = delete;
+
+  void set_token_count(unsigned n) {token_count_ = n;}
+
+ private:
+  LatencyPhase phase_;
+  unsigned token_count_;
+  std::chrono::steady_clock::time_point begin_;
+  std::clock_t cpu_begin_;
+};
+
+}  // namespace rendezllama
+#endif
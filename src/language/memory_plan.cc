@@ -0,0 +1,254 @@
+#include "src/language/memory_plan.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+using rendezllama::MemoryPlan;
+using rendezllama::MemoryPlanRequest;
+using rendezllama::ModelShape;
+
+// llama.cpp pads the KV cache to this many cells,
+// and to more of them with flash attention.
+static const unsigned plan_token_alignment = 32;
+static const unsigned plan_flash_attention_token_alignment = 256;
+static const unsigned plan_ubatch_count_max = 512;
+static const unsigned plan_ubatch_count_min = 32;
+
+/** Settings to try, from fastest to smallest.
+ *
+ * Within each, ubatches are halved down to `ubatch_count_min`.
+ **/
+struct PlanChoice {
+  const char* key_type;
+  const char* value_type;
+  bool flash_attention_on;
+  unsigned ubatch_count_min;
+};
+static const PlanChoice plan_choices[] = {
+  {"f16", "f16", false, 256},
+  // Attention scores are never fully materialized.
+  {"f16", "f16", true, plan_ubatch_count_min},
+  // Quantized values need flash attention.
+  {"q8_0", "q8_0", true, plan_ubatch_count_min},
+  {"q4_0", "q4_0", true, plan_ubatch_count_min},
+  // Less padding when not even one padded flash attention context fits.
+  {"f16", "f16", false, plan_ubatch_count_min},
+};
+
+/** Bytes per block of 32 cache elements of a type, or 0 if unsupported.**/
+  unsigned
+rendezllama::kv_cache_block_byte_count(const std::string& type_name)
+{
+  if (type_name == "f32") {return 128;}
+  if (type_name == "f16") {return 64;}
+  if (type_name == "q8_0") {return 34;}
+  if (type_name == "q5_1") {return 24;}
+  if (type_name == "q5_0") {return 22;}
+  if (type_name == "q4_1") {return 20;}
+  if (type_name == "q4_0") {return 18;}
+  return 0;
+}
+
+  uint64_t
+rendezllama::kv_cache_byte_count(
+    const ModelShape& shape,
+    unsigned token_count,
+    const std::string& key_type,
+    const std::string& value_type)
+{
+  const uint64_t element_count = (
+      (uint64_t)shape.layer_count * shape.kv_embedding_length * token_count);
+  return element_count * (
+      kv_cache_block_byte_count(key_type) +
+      kv_cache_block_byte_count(value_type)) / 32;
+}
+
+/** Estimate the compute buffer for a worst-case ubatch.
+ *
+ * Activations are f32. Without flash attention,
+ * scores and their softmax span every cached token of every head.
+ * This errs on the large side because buffers are reused between layers.
+ **/
+  uint64_t
+rendezllama::compute_byte_count(
+    const ModelShape& shape,
+    unsigned token_count,
+    unsigned ubatch_count,
+    bool flash_attention_on)
+{
+  uint64_t per_ubatch_token = (
+      (uint64_t)shape.vocabulary_size
+      + 2 * (uint64_t)shape.feed_forward_length
+      + 4 * (uint64_t)shape.embedding_length);
+  if (!flash_attention_on) {
+    per_ubatch_token += 2 * (uint64_t)shape.head_count * token_count;
+  }
+  return sizeof(float) * ubatch_count * per_ubatch_token;
+}
+
+/** Number of KV cache cells that llama.cpp allocates for a context.**/
+static
+  uint64_t
+padded_token_count(const MemoryPlan& plan, uint64_t token_count)
+{
+  const unsigned alignment = (
+      plan.flash_attention_on
+      ? plan_flash_attention_token_alignment
+      : plan_token_alignment);
+  return (token_count + alignment - 1) / alignment * alignment;
+}
+
+/** Largest context per session that fits the budget, up to `token_limit`.
+ *
+ * The whole padded context of all sessions must fit.
+ **/
+static
+  unsigned
+fitting_token_count(
+    const ModelShape& shape,
+    const MemoryPlan& plan,
+    unsigned session_count,
+    unsigned token_limit)
+{
+  const uint64_t fixed_byte_count = (
+      plan.weight_byte_count +
+      rendezllama::compute_byte_count(
+          shape, 0, plan.ubatch_count, plan.flash_attention_on));
+  if (fixed_byte_count >= plan.budget_byte_count) {return 0;}
+  const uint64_t per_token_byte_count = (
+      rendezllama::kv_cache_byte_count(
+          shape, 1, plan.kv_cache_key_type, plan.kv_cache_value_type)
+      + rendezllama::compute_byte_count(
+          shape, 1, plan.ubatch_count, plan.flash_attention_on)
+      - rendezllama::compute_byte_count(
+          shape, 0, plan.ubatch_count, plan.flash_attention_on));
+  if (per_token_byte_count == 0) {return token_limit;}
+  const uint64_t total_token_count = (
+      (plan.budget_byte_count - fixed_byte_count) / per_token_byte_count);
+  uint64_t n = std::min<uint64_t>(
+      token_limit, total_token_count / session_count);
+  const uint64_t alignment = padded_token_count(plan, 1);
+  if (n < token_limit && n >= alignment) {
+    n -= n % alignment;
+  }
+  if (padded_token_count(plan, n * session_count) > total_token_count) {
+    // Padding would not fit, so take what does once padded.
+    n = (total_token_count - total_token_count % alignment) / session_count;
+  }
+  return (unsigned)n;
+}
+
+/** Choose context settings that fit `request.memory_budget_mib`.
+ *
+ * First keeps as much of `request.context_token_limit` as possible,
+ * then prefers what generates faster: an f16 KV cache,
+ * no flash attention, and larger ubatches.
+ * Settings given explicitly in `request` are kept as they are.
+ * Returns false if no context fits.
+ **/
+  bool
+rendezllama::plan_memory(
+    MemoryPlan& plan,
+    const ModelShape& shape,
+    const MemoryPlanRequest& request,
+    unsigned session_count)
+{
+  plan = MemoryPlan();
+  plan.budget_byte_count = (uint64_t)request.memory_budget_mib << 20;
+  plan.weight_byte_count = shape.weight_byte_count;
+  session_count = std::max(session_count, 1u);
+
+  bool found = false;
+  std::vector<unsigned> ubatch_counts;
+  for (const PlanChoice& choice : plan_choices) {
+    MemoryPlan candidate = plan;
+    candidate.kv_cache_key_type = (
+        request.kv_cache_key_type.empty()
+        ? choice.key_type : request.kv_cache_key_type);
+    candidate.kv_cache_value_type = (
+        request.kv_cache_value_type.empty()
+        ? choice.value_type : request.kv_cache_value_type);
+    candidate.flash_attention_on = (
+        request.flash_attention_on < 0
+        ? choice.flash_attention_on : (request.flash_attention_on != 0));
+    if (!candidate.flash_attention_on &&
+        kv_cache_block_byte_count(candidate.kv_cache_value_type) < 64)
+    {
+      continue;
+    }
+    ubatch_counts.clear();
+    if (request.ubatch_count > 0) {
+      ubatch_counts.push_back(std::min(request.ubatch_count, request.batch_count));
+    }
+    else {
+      const unsigned ubatch_count_min = (
+          request.flash_attention_on < 0
+          ? choice.ubatch_count_min : plan_ubatch_count_min);
+      for (unsigned n = std::min(request.batch_count, plan_ubatch_count_max);
+           n >= ubatch_count_min;
+           n /= 2)
+      {
+        ubatch_counts.push_back(n);
+      }
+      if (ubatch_counts.empty()) {
+        ubatch_counts.push_back(request.batch_count);
+      }
+    }
+    for (unsigned ubatch_count : ubatch_counts) {
+      candidate.ubatch_count = ubatch_count;
+      candidate.context_token_limit = fitting_token_count(
+          shape, candidate, session_count, request.context_token_limit);
+      if (!found ||
+          candidate.context_token_limit > plan.context_token_limit)
+      {
+        plan = candidate;
+        found = true;
+      }
+      if (plan.context_token_limit >= request.context_token_limit) {break;}
+    }
+    if (plan.context_token_limit >= request.context_token_limit) {break;}
+  }
+  if (!found) {return false;}
+
+  // Estimate what llama.cpp allocates for the padded context.
+  const unsigned token_count = padded_token_count(
+      plan, (uint64_t)plan.context_token_limit * session_count);
+  plan.kv_byte_count = kv_cache_byte_count(
+      shape, token_count, plan.kv_cache_key_type, plan.kv_cache_value_type);
+  plan.compute_byte_count = compute_byte_count(
+      shape, token_count, plan.ubatch_count, plan.flash_attention_on);
+  return plan.context_token_limit > 0;
+}
+
+static
+  void
+put_mib(std::ostream& out, uint64_t byte_count)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.1f MiB", byte_count / (double)(1 << 20));
+  out << buf;
+}
+
+  void
+rendezllama::print_memory_plan(std::ostream& out, const MemoryPlan& plan)
+{
+  out
+    << "memory_plan: context_token_limit=" << plan.context_token_limit
+    << ", kv_cache=" << plan.kv_cache_key_type
+    << "/" << plan.kv_cache_value_type
+    << ", ubatch_count=" << plan.ubatch_count
+    << ", flash_attention_on=" << (plan.flash_attention_on ? 1 : 0)
+    << "\nmemory_estimate: weights ";
+  put_mib(out, plan.weight_byte_count);
+  out << " + kv_cache ";
+  put_mib(out, plan.kv_byte_count);
+  out << " + compute ";
+  put_mib(out, plan.compute_byte_count);
+  out << " = ";
+  put_mib(out,
+          plan.weight_byte_count + plan.kv_byte_count + plan.compute_byte_count);
+  out << " of ";
+  put_mib(out, plan.budget_byte_count);
+  out << " budget\n";
+}
@@ -0,0 +1,73 @@
+#ifndef RENDEZLLAMA_LANGUAGE_MEMORY_PLAN_HH_
+#define RENDEZLLAMA_LANGUAGE_MEMORY_PLAN_HH_
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace rendezllama {
+
+/** Model sizes that memory use depends on.**/
+struct ModelShape {
+  uint64_t weight_byte_count = 0;
+  unsigned layer_count = 0;
+  unsigned head_count = 0;
+  // Per layer and token, for keys and for values.
+  unsigned kv_embedding_length = 0;
+  unsigned embedding_length = 0;
+  unsigned feed_forward_length = 0;
+  unsigned vocabulary_size = 0;
+};
+
+/** A memory budget and the context settings that are given explicitly.
+ *
+ * Empty cache types and a negative `flash_attention_on` are chosen by the plan,
+ * as is `ubatch_count` when it is 0.
+ **/
+struct MemoryPlanRequest {
+  unsigned memory_budget_mib = 0;
+  unsigned context_token_limit = 0;
+  unsigned batch_count = 512;
+  unsigned ubatch_count = 0;
+  std::string kv_cache_key_type;
+  std::string kv_cache_value_type;
+  int flash_attention_on = -1;
+};
+
+/** Context settings chosen to fit a memory budget, with estimated sizes.**/
+struct MemoryPlan {
+  unsigned context_token_limit = 0;
+  std::string kv_cache_key_type;
+  std::string kv_cache_value_type;
+  unsigned ubatch_count = 0;
+  bool flash_attention_on = false;
+  uint64_t budget_byte_count = 0;
+  uint64_t weight_byte_count = 0;
+  uint64_t kv_byte_count = 0;
+  uint64_t compute_byte_count = 0;
+};
+
+unsigned
+kv_cache_block_byte_count(const std::string& type_name);
+uint64_t
+kv_cache_byte_count(
+    const ModelShape& shape,
+    unsigned token_count,
+    const std::string& key_type,
+    const std::string& value_type);
+uint64_t
+compute_byte_count(
+    const ModelShape& shape,
+    unsigned token_count,
+    unsigned ubatch_count,
+    bool flash_attention_on);
+bool
+plan_memory(
+    MemoryPlan& plan,
+    const ModelShape& shape,
+    const MemoryPlanRequest& request,
+    unsigned session_count);
+void
+print_memory_plan(std::ostream& out, const MemoryPlan& plan);
+
+}  // namespace rendezllama
+#endif
@@ -0,0 +1,217 @@
+#include "src/language/scheduler.hh"
+
+#include <algorithm>
+
+using rendezllama::DecodeScheduler;
+
+DecodeScheduler::DecodeScheduler(
+    struct llama_context** ctx,
+    unsigned batch_count,
+    unsigned token_budget,
+    unsigned logit_count)
+  : ctx_(ctx)
+  , batch_capacity_(batch_count)
+  , token_budget_(std::min(token_budget, batch_count))
+  , logit_count_(logit_count)
+  , batch_(llama_batch_init(batch_count, 0, 1))
+{}
+
+DecodeScheduler::~DecodeScheduler() {
+  llama_batch_free(batch_);
+}
+
+/** Number of requests that are waiting or being decoded.**/
+  unsigned
+DecodeScheduler::pending_count()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+/** Evaluate tokens of a sequence starting at a position.
+ *
+ * Blocks until they are all in the KV cache.
+ * Leaves the last evaluated token's logits in `logits`.
+ * Returns how many tokens were evaluated, which is fewer than given
+ * if `stop_flag` was raised, or 0 on failure.
+ **/
+  unsigned
+DecodeScheduler::decode(
+    llama_seq_id seq_id,
+    const llama_token* tokens,
+    unsigned token_count,
+    unsigned pos,
+    std::vector<float>& logits,
+    const std::atomic<bool>* stop_flag)
+{
+  if (token_count == 0) {return 0;}
+  Request req;
+  req.seq_id = seq_id;
+  req.tokens = tokens;
+  req.token_count = token_count;
+  req.pos = pos;
+  req.logits = &logits;
+  req.stop_flag = stop_flag;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.push_back(&req);
+  while (!req.done) {
+    if (leading_) {
+      cond_.wait(lock);
+      continue;
+    }
+    leading_ = true;
+    while (!req.done) {
+      this->pack_batch();
+      lock.unlock();
+      int istat;
+      {
+        std::lock_guard<std::mutex> context_lock(context_mutex_);
+        istat = llama_decode(*ctx_, batch_);
+        if (istat == 0) {
+          for (const auto& batch_end : batch_ends_) {
+            const float* p = llama_get_logits_ith(*ctx_, batch_end.second);
+            batch_end.first->logits->assign(p, p + logit_count_);
+          }
+        }
+        else {
+          // Don't fail every session for one bad request.
+          this->decode_each_packing();
+        }
+      }
+      lock.lock();
+      for (const Packing& packing : batch_packings_) {
+        Request* r = packing.req;
+        if (!r->good || r->offset == r->token_count) {
+          r->done = true;
+        }
+      }
+      pending_.erase(
+          std::remove_if(
+              pending_.begin(), pending_.end(),
+              [](const Request* r) {return r->done;}),
+          pending_.end());
+      cond_.notify_all();
+    }
+    // Let a waiting session lead the next batch.
+    leading_ = false;
+    cond_.notify_all();
+  }
+  return (req.good ? req.token_count : 0);
+}
+
+/** Decide how many tokens of each request go into the next batch.
+ *
+ * Single-token requests are generation steps, so they go first.
+ * Prefills split what is left of `token_limit` evenly,
+ * but every prefill advances by at least a token while there is room.
+ **/
+  void
+rendezllama::plan_decode_batch(
+    std::vector<unsigned>& packed_counts,
+    const std::vector<unsigned>& remaining_counts,
+    unsigned token_limit,
+    unsigned batch_capacity)
+{
+  packed_counts.assign(remaining_counts.size(), 0);
+  unsigned n = 0;
+  unsigned prefill_count = 0;
+  for (size_t i = 0; i < remaining_counts.size(); ++i) {
+    if (remaining_counts[i] > 1) {
+      prefill_count += 1;
+    }
+    else if (remaining_counts[i] == 1 && n < batch_capacity) {
+      packed_counts[i] = 1;
+      n += 1;
+    }
+  }
+  for (size_t i = 0; i < remaining_counts.size(); ++i) {
+    if (prefill_count == 0) {break;}
+    if (remaining_counts[i] <= 1) {continue;}
+    const unsigned room = (token_limit > n ? token_limit - n : 0);
+    const unsigned share = std::max(1u, room / prefill_count);
+    prefill_count -= 1;
+    if (n == batch_capacity) {break;}
+    packed_counts[i] = std::min(
+        std::min(share, batch_capacity - n),
+        remaining_counts[i]);
+    n += packed_counts[i];
+  }
+}
+
+/** Fill the batch from pending requests.
+ *
+ * A lone request can use the whole batch.
+ **/
+  void
+DecodeScheduler::pack_batch()
+{
+  batch_.n_tokens = 0;
+  batch_ends_.clear();
+  batch_packings_.clear();
+  remaining_counts_.clear();
+  for (Request* req : pending_) {
+    if (req->stop_flag && req->stop_flag->load() &&
+        req->token_count - req->offset > 1)
+    {
+      // Stopped. Evaluate one more token for its logits and finish.
+      req->token_count = req->offset + 1;
+    }
+    remaining_counts_.push_back(req->token_count - req->offset);
+  }
+  const unsigned token_limit = (
+      pending_.size() > 1 ? token_budget_ : batch_capacity_);
+  plan_decode_batch(
+      packed_counts_, remaining_counts_, token_limit, batch_capacity_);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (packed_counts_[i] > 0) {
+      this->pack_tokens(pending_[i], packed_counts_[i]);
+    }
+  }
+}
+
+  void
+DecodeScheduler::pack_tokens(Request* req, unsigned n)
+{
+  batch_packings_.push_back(Packing{req, batch_.n_tokens, n});
+  for (unsigned i = 0; i < n; ++i) {
+    const int b = batch_.n_tokens;
+    batch_.token[b] = req->tokens[req->offset];
+    batch_.pos[b] = req->pos + req->offset;
+    batch_.n_seq_id[b] = 1;
+    batch_.seq_id[b][0] = req->seq_id;
+    req->offset += 1;
+    batch_.logits[b] = (req->offset == req->token_count);
+    if (batch_.logits[b]) {
+      batch_ends_.push_back(std::make_pair(req, b));
+    }
+    batch_.n_tokens += 1;
+  }
+}
+
+/** Decode each request's part of a failed batch on its own.
+ *
+ * Only requests that fail again are marked as failed.
+ * Their owners only read that after seeing them done.
+ **/
+  void
+DecodeScheduler::decode_each_packing()
+{
+  for (const Packing& packing : batch_packings_) {
+    llama_batch view = batch_;
+    view.n_tokens = packing.token_count;
+    view.token += packing.batch_offset;
+    view.pos += packing.batch_offset;
+    view.n_seq_id += packing.batch_offset;
+    view.seq_id += packing.batch_offset;
+    view.logits += packing.batch_offset;
+    Request* r = packing.req;
+    if (0 != llama_decode(*ctx_, view)) {
+      r->good = false;
+    }
+    else if (r->offset == r->token_count) {
+      const float* p = llama_get_logits_ith(*ctx_, packing.token_count - 1);
+      r->logits->assign(p, p + logit_count_);
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef RENDEZLLAMA_LANGUAGE_SCHEDULER_HH_
+#define RENDEZLLAMA_LANGUAGE_SCHEDULER_HH_
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+
+namespace rendezllama {
+
+/** Merges the decodes of sessions that share a context.
+ *
+ * Sessions submit tokens for their own sequences and wait.
+ * Whichever session is waiting first leads by packing every pending
+ * submission into one multi-sequence batch per decode.
+ * Long prefills are split into chunks so other sessions keep generating.
+ **/
+class DecodeScheduler {
+ public:
+  DecodeScheduler(
+      struct llama_context** ctx,
+      unsigned batch_count,
+      unsigned token_budget,
+      unsigned logit_count);
+  DecodeScheduler(const DecodeScheduler&) = delete;
+  ~DecodeScheduler();
+  DecodeScheduler& operator=(const DecodeScheduler&) = delete;
+
+  std::mutex& context_mutex() {return context_mutex_;}
+  unsigned pending_count();
+  unsigned decode(
+      llama_seq_id seq_id,
+      const llama_token* tokens,
+      unsigned token_count,
+      unsigned pos,
+      std::vector<float>& logits,
+      const std::atomic<bool>* stop_flag);
+
+ private:
+  struct Request {
+    llama_seq_id seq_id;
+    const llama_token* tokens;
+    unsigned token_count;
+    unsigned pos;
+    std::vector<float>* logits;
+    const std::atomic<bool>* stop_flag;
+    // Tokens already packed into a batch.
+    unsigned offset = 0;
+    bool done = false;
+    bool good = true;
+  };
+
+  /** A request's tokens in the packed batch.**/
+  struct Packing {
+    Request* req;
+    int batch_offset;
+    unsigned token_count;
+  };
+
+  void pack_batch();
+  void pack_tokens(Request* req, unsigned n);
+  void decode_each_packing();
+
+ private:
+  struct llama_context** ctx_;
+  unsigned batch_capacity_;
+  // Tokens per decode while other sessions wait.
+  unsigned token_budget_;
+  unsigned logit_count_;
+  llama_batch batch_;
+  // Requests that get their last token evaluated by the packed batch,
+  // paired with the batch index of that token.
+  std::vector<std::pair<Request*, int>> batch_ends_;
+  std::vector<Packing> batch_packings_;
+  // Reused by pack_batch() to avoid allocating.
+  std::vector<unsigned> remaining_counts_;
+  std::vector<unsigned> packed_counts_;
+  // Guards the context.
+  std::mutex context_mutex_;
+  // Guards everything below.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Request*> pending_;
+  bool leading_ = false;
+};
+
+void
+plan_decode_batch(
+    std::vector<unsigned>& packed_counts,
+    const std::vector<unsigned>& remaining_counts,
+    unsigned token_limit,
+    unsigned batch_capacity);
+
+}  // namespace rendezllama
+#endif
@@ -9,6 +9,10 @@
 
 #include "llama.h"
 
+#include "src/language/latency.hh"
+
+using rendezllama::LatencyPhase;
+using rendezllama::LatencyTimer;
 using rendezllama::Vocabulary;
 typedef Vocabulary::Token_id Token_id;
 
@@ -49,14 +53,72 @@ unsigned Vocabulary::cardinality() const {
   return llama_vocab_n_tokens(vocab_);
 }
 
+/** Hash of all token texts, used to check that saved token ids still apply.**/
+uint64_t Vocabulary::fingerprint() const {
+  // FNV-1a.
+  uint64_t h = 14695981039346656037ull;
+  if (!vocab_) {return h;}
+  const unsigned n = this->cardinality();
+  std::vector<char> piece(64);
+  for (Token_id token_id = 0; token_id < (Token_id)n; ++token_id) {
+    int piece_size = llama_token_to_piece(
+        vocab_, token_id, piece.data(), piece.size(),
+        /*lstrip=*/0, /*special=*/true);
+    if (piece_size < 0) {
+      piece.resize(-piece_size);
+      piece_size = llama_token_to_piece(
+          vocab_, token_id, piece.data(), piece.size(),
+          /*lstrip=*/0, /*special=*/true);
+    }
+    for (int i = 0; i < piece_size; ++i) {
+      h = (h ^ (unsigned char)piece[i]) * 1099511628211ull;
+    }
+    // Separate tokens with a byte that never appears in UTF-8.
+    h = (h ^ 0xff) * 1099511628211ull;
+  }
+  return h;
+}
+
+/** Estimated heap bytes of token tables, including llama.cpp's.
+ *
+ * llama.cpp keeps the text of each token for lookup and for detokenization,
+ * along with attributes and a hash map entry.
+ **/
+size_t Vocabulary::allocated_byte_count() const {
+  size_t n = (
+      bos_token_alias_.capacity() + eos_token_alias_.capacity() +
+      special_tokens_.capacity() * sizeof(SubstitutionRule) +
+      boundary_prefix_.capacity() +
+      boundary_prefix_tokens_.capacity() * sizeof(Token_id));
+  for (const auto& sr : special_tokens_) {
+    n += sr.alias.capacity();
+  }
+  if (!vocab_) {return n;}
+  const unsigned token_count = this->cardinality();
+  for (Token_id token_id = 0; token_id < (Token_id)token_count; ++token_id) {
+    const char* text = llama_vocab_get_text(vocab_, token_id);
+    n += 2 * (sizeof(std::string) + (text ? strlen(text) : 0)) + 64;
+  }
+  return n;
+}
+
 char Vocabulary::last_char_of(Token_id token_id) const {
-  fildesh::ostringstream oss;
-  this->detokenize_to(oss.c_struct(), token_id);
-  const std::string_view s = oss.view();
-  if (!s.empty()) {
-    return s[s.size()-1];
+  for (const auto& sr : special_tokens_) {
+    if (sr.token_id == token_id) {
+      return (sr.alias.empty() ? '\0' : sr.alias.back());
+    }
+  }
+  // Most pieces fit on the stack, which keeps this free of allocations.
+  char buf[64];
+  int n = llama_token_to_piece(
+      vocab_, token_id, buf, sizeof(buf), /*lstrip=*/0, /*special=*/false);
+  if (n >= 0) {
+    return (n > 0 ? buf[n-1] : '\0');
   }
-  return '\0';
+  std::string piece(-n, '\0');
+  n = llama_token_to_piece(
+      vocab_, token_id, &piece[0], piece.size(), /*lstrip=*/0, /*special=*/false);
+  return (n > 0 ? piece[n-1] : '\0');
 }
 
   void
@@ -161,6 +223,7 @@ Vocabulary::tokenize_to(
     std::vector<Token_id>& tokens,
     std::string_view text) const
 {
+  LatencyTimer timer(LatencyPhase::tokenize);
   tokens.clear();
   std::string_view::size_type end = std::string_view::npos;
   std::vector<size_t> next_indices(special_tokens_.size(), end);
@@ -195,12 +258,14 @@ Vocabulary::tokenize_to(
   }
   tokenize_append(tokens, text.substr(beg), vocab_,
                   boundary_prefix_, boundary_prefix_tokens_, tmp_s);
+  timer.set_token_count(tokens.size());
 }
 
   void
 Vocabulary::assign_substitution(std::string_view alias, Token_id token_id)
 {
   assert(!alias.empty());
+  substitution_version_ += 1;
   if (token_id == this->bos_token_id()) {
     bos_token_alias_ = alias;
   }
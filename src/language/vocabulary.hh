@@ -1,5 +1,6 @@
 #ifndef RENDEZLLAMA_LANGUAGE_VOCABULARY_HH_
 #define RENDEZLLAMA_LANGUAGE_VOCABULARY_HH_
+#include <cstdint>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -22,6 +23,8 @@ class Vocabulary {
   Token_id eos_token_id() const;
   Token_id newline_token_id() const;
   unsigned cardinality() const;
+  uint64_t fingerprint() const;
+  size_t allocated_byte_count() const;
 
   char last_char_of(Token_id token_id) const;
 
@@ -46,6 +49,7 @@ class Vocabulary {
   std::string_view eos_token_alias() const {
     return eos_token_alias_;
   }
+  unsigned substitution_version() const {return substitution_version_;}
 
  private:
   const llama_vocab* vocab_ = nullptr;
@@ -55,6 +59,8 @@ class Vocabulary {
   std::string eos_token_alias_;
   struct SubstitutionRule { std::string alias; Token_id token_id; };
   std::vector<SubstitutionRule> special_tokens_;
+  // Changes whenever detokenization might.
+  unsigned substitution_version_ = 0;
 
   std::string boundary_prefix_;
   std::vector<Token_id> boundary_prefix_tokens_;
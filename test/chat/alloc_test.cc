@@ -0,0 +1,189 @@
+#include <cassert>
+
+#include <fildesh/string.hh>
+
+#include "llama.h"
+
+#include "src/chat/display.hh"
+#include "src/chat/guide.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/alloc_count.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::AllocCount;
+using rendezllama::ChatDisplay;
+using rendezllama::ChatGuide;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::Vocabulary;
+
+static const unsigned context_token_limit = 256;
+
+/** Per-token work of the chat loop around decoding and sampling.
+ *
+ * Pretends that `reply` tokens are sampled one after another.
+ **/
+static
+  void
+generate_tokens(
+    unsigned token_count,
+    const std::vector<Vocabulary::Token_id>& reply,
+    ChatTrajectory& traj,
+    ChatGuide& guide,
+    ChatDisplay& disp,
+    fildesh::ostringstream& oss,
+    const ChatOptions& opt,
+    const Vocabulary& vocab)
+{
+  for (unsigned i = 0; i < token_count; ++i) {
+    disp.maybe_insert_answer_prompt(traj, vocab);
+    traj.maybe_rollforget_within_limit(context_token_limit, vocab);
+    traj.push_back(reply[traj.token_count() % reply.size()]);
+    disp.show_new(traj, vocab);
+    oss.truncate();
+    disp.displaystring_to(oss.c_struct(), traj.token(), vocab);
+    const std::string& matched_antiprompt =
+      rendezllama::antiprompt_suffix(oss.view(), opt.antiprompts);
+    assert(matched_antiprompt.empty());
+    assert(vocab.last_char_of(traj.token()) != '\n');
+    assert(!guide.maybe_yield_turn());
+    disp.maybe_remove_answer_prompt(traj, false);
+  }
+}
+
+static
+  void
+steady_state_test(llama_model* model)
+{
+  FildeshX in[1];
+  Vocabulary vocab(model);
+  ChatTrajectory traj(vocab.bos_token_id());
+  ChatOptions opt;
+  ChatGuide guide(vocab, traj, opt);
+  ChatDisplay disp;
+  disp.out_ = open_FildeshOF("/dev/null");
+  fildesh::ostringstream oss;
+
+  *in = FildeshX_of_strlit("\
+    ((chat_prefixes)\n\
+     (m (prefix \"User:\"))\n\
+     (m (prefix \"Char:\"))\n\
+    )\n\
+    ");
+  bool good = rendezllama::slurp_sxpb_initialize_options_close_FildeshX(in, opt, "");
+  assert(good);
+
+  // A reply that never ends a sentence or message.
+  std::vector<Vocabulary::Token_id> reply;
+  vocab.tokenize_to(reply, " and the quick brown fox jumps over the lazy dog");
+  guide.yield_turn(1);
+
+  // Warm up through a rollforget so buffers reach their full size.
+  generate_tokens(context_token_limit + 50, reply, traj, guide, disp, oss, opt, vocab);
+  assert(traj.rollforget_count_ == 1);
+
+  const AllocCount begin = rendezllama::alloc_count();
+  generate_tokens(context_token_limit / 2, reply, traj, guide, disp, oss, opt, vocab);
+  const AllocCount end = rendezllama::alloc_count();
+  assert(traj.rollforget_count_ == 1);
+  assert(end.allocation_count == begin.allocation_count);
+}
+
+/** Sample from injected logits, as if each token was just evaluated.**/
+static
+  void
+sample_tokens(
+    unsigned token_count,
+    const std::vector<float>& logits,
+    ChatTrajectory& traj,
+    Inference& inference)
+{
+  for (unsigned i = 0; i < token_count; ++i) {
+    inference.assign_pending_logits(logits.data());
+    bool good = inference.sample_to_trajectory(traj, false);
+    assert(good);
+  }
+}
+
+/** Sampling only allocates what llama.cpp's samplers do.**/
+static
+  void
+sampling_test(llama_model* model)
+{
+  using rendezllama::inference::AdjustVia;
+  using rendezllama::inference::AdjustViaKind;
+  const unsigned token_count = 64;
+  const unsigned seed = 1;
+  const float min_p = 0.1f;
+  const float temperature = 0.8f;
+  Vocabulary vocab(model);
+  ChatTrajectory traj(vocab.bos_token_id());
+  ChatOptions opt;
+  rendezllama::inference::Sampling sampling;
+  AdjustVia adjust_via;
+  adjust_via.emplace<AdjustViaKind::min_p>(min_p);
+  sampling.adjust_thru.push_back(adjust_via);
+  adjust_via.emplace<AdjustViaKind::temperature>(temperature);
+  sampling.adjust_thru.push_back(adjust_via);
+  sampling.pick_via = rendezllama::inference::Probability();
+  opt.infer_via = sampling;
+
+  std::vector<float> logits(vocab.cardinality());
+  for (size_t i = 0; i < logits.size(); ++i) {
+    logits[i] = (float)(i % 7);
+  }
+
+  // What the same sampler chain allocates on its own.
+  llama_sampler* smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+  llama_sampler_chain_add(smpl, llama_sampler_init_min_p(min_p, 1));
+  llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+  llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+  std::vector<llama_token_data> candidates(vocab.cardinality());
+  AllocCount begin;
+  for (unsigned i = 0; i <= token_count; ++i) {
+    if (i == 1) {begin = rendezllama::alloc_count();}
+    for (llama_token j = 0; j < (llama_token)candidates.size(); ++j) {
+      candidates[j] = llama_token_data{j, logits[j], 0.0f};
+    }
+    llama_token_data_array candidates_data[1] = {{
+      candidates.data(), candidates.size(), /*selected=*/0, /*sorted=*/false,
+    }};
+    llama_sampler_apply(smpl, candidates_data);
+    llama_sampler_accept(smpl, candidates[candidates_data->selected].id);
+  }
+  AllocCount end = rendezllama::alloc_count();
+  llama_sampler_free(smpl);
+  const uint64_t sampler_allocation_count = (
+      end.allocation_count - begin.allocation_count);
+
+  Inference inference(vocab);
+  inference.restore_sampling(opt, model, traj, seed, 0, nullptr);
+  // Warm up so buffers reach their full size, then make room again.
+  sample_tokens(2 * token_count, logits, traj, inference);
+  traj.erase_all_at(1);
+
+  begin = rendezllama::alloc_count();
+  sample_tokens(token_count, logits, traj, inference);
+  end = rendezllama::alloc_count();
+  assert(end.allocation_count - begin.allocation_count == sampler_allocation_count);
+}
+
+int main(int argc, char** argv)
+{
+  assert(argc == 2 && "need model filename");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  llama_model* model = llama_model_load_from_file(argv[1], model_params);
+  assert(model);
+
+  steady_state_test(model);
+  sampling_test(model);
+
+  llama_model_free(model);
+  return 0;
+}
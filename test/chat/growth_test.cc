@@ -0,0 +1,116 @@
+#include <cassert>
+#include <cstdio>
+
+#include "llama.h"
+
+#include "src/chat/display.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/session.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatDisplay;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::MappedFile;
+using rendezllama::Vocabulary;
+
+/** A state that needs more context than allowed fails to load.**/
+static
+  void
+load_too_large_test(
+    llama_model* model,
+    llama_context*& ctx,
+    const ChatOptions& opt,
+    const std::string& filename)
+{
+  Vocabulary vocab(model);
+  const uint64_t fingerprint = vocab.fingerprint();
+  ChatDisplay disp;
+  disp.out_ = open_FildeshOF("/dev/null");
+
+  ChatTrajectory traj(vocab.bos_token_id());
+  std::vector<Vocabulary::Token_id> tokens;
+  vocab.tokenize_to(tokens, " word");
+  while (traj.token_count() <= llama_n_ctx(ctx) + 10) {
+    traj.push_back(tokens.back());
+  }
+  traj.context_token_count_ = traj.token_count();
+  Inference inference(vocab);
+  bool good = rendezllama::save_chat_state(
+      filename, traj, disp, inference, model, ctx, fingerprint);
+  assert(good);
+
+  ChatOptions small_opt = opt;
+  small_opt.context_token_limit = llama_n_ctx(ctx);
+  ChatTrajectory loaded_traj(vocab.bos_token_id());
+  ChatDisplay loaded_disp;
+  loaded_disp.out_ = open_FildeshOF("/dev/null");
+  Inference loaded_inference(vocab);
+  MappedFile state_in;
+  good = state_in.open(filename);
+  assert(good);
+  llama_context* const old_ctx = ctx;
+  good = rendezllama::load_chat_state(
+      state_in.view(), loaded_traj, loaded_disp, loaded_inference,
+      model, ctx, small_opt, fingerprint);
+  assert(!good);
+  assert(ctx == old_ctx);
+  assert(loaded_traj.token_count() == 1);
+  state_in.close();
+  remove(filename.c_str());
+}
+
+/** Growing keeps evaluated tokens and stops at the context limit.**/
+static
+  void
+grow_test(llama_model* model, llama_context*& ctx, const ChatOptions& opt)
+{
+  Vocabulary vocab(model);
+  std::vector<Vocabulary::Token_id> tokens;
+  vocab.tokenize_to(tokens, "The quick brown fox");
+  int istat = llama_decode(
+      ctx, llama_batch_get_one(tokens.data(), tokens.size()));
+  assert(istat == 0);
+  const llama_pos pos_max = llama_kv_cache_seq_pos_max(ctx, 0);
+  assert(pos_max + 1 == (llama_pos)tokens.size());
+
+  const unsigned old_token_count = llama_n_ctx(ctx);
+  bool good = rendezllama::grow_llama_context(ctx, opt, old_token_count);
+  assert(good);
+  assert(llama_n_ctx(ctx) == old_token_count);
+
+  good = rendezllama::grow_llama_context(ctx, opt, old_token_count + 1);
+  assert(good);
+  assert(llama_n_ctx(ctx) == 2 * old_token_count);
+  assert(llama_n_ctx(ctx) <= opt.context_token_limit);
+  assert(llama_kv_cache_seq_pos_max(ctx, 0) == pos_max);
+
+  llama_context* const old_ctx = ctx;
+  good = rendezllama::grow_llama_context(ctx, opt, opt.context_token_limit + 1);
+  assert(!good);
+  assert(ctx == old_ctx);
+}
+
+int main(int argc, char** argv)
+{
+  assert(argc == 3 && "need model filename and scratch filename");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  ChatOptions opt;
+  opt.model_filename = argv[1];
+  opt.context_growth_on = true;
+  auto [model, ctx] = rendezllama::make_llama_context(opt);
+  assert(model && ctx);
+  // Starts small to have room to grow.
+  assert(llama_n_ctx(ctx) < opt.context_token_limit);
+
+  load_too_large_test(model, ctx, opt, argv[2]);
+  grow_test(model, ctx, opt);
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return 0;
+}
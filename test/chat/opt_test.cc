@@ -70,9 +70,40 @@ sentence_terminals_parse_test()
   assert(opt.sentence_terminals.size() == 3);
 }
 
+static
+  void
+memory_plan_test()
+{
+  rendezllama::ChatOptions opt;
+  opt.memory_budget_mib = 4096;
+  opt.context_token_limit = 2048;
+  opt.kv_cache_key_type = "q8_0";
+  const rendezllama::MemoryPlanRequest request =
+    rendezllama::memory_plan_request(opt);
+  assert(request.memory_budget_mib == 4096);
+  assert(request.context_token_limit == 2048);
+  assert(request.kv_cache_key_type == "q8_0");
+  assert(request.kv_cache_value_type.empty());
+  assert(request.flash_attention_on < 0);
+
+  rendezllama::MemoryPlan plan;
+  plan.context_token_limit = 1024;
+  plan.kv_cache_key_type = "q8_0";
+  plan.kv_cache_value_type = "q4_0";
+  plan.ubatch_count = 128;
+  plan.flash_attention_on = true;
+  rendezllama::apply_memory_plan(opt, plan);
+  assert(opt.context_token_limit == 1024);
+  assert(opt.kv_cache_value_type == "q4_0");
+  assert(opt.ubatch_count == 128);
+  assert(opt.flash_attention_on == 1);
+  assert(opt.memory_plan.context_token_limit == 1024);
+}
+
 int main()
 {
   chat_prefixes_parse_test();
   sentence_terminals_parse_test();
+  memory_plan_test();
   return 0;
 }
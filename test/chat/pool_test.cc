@@ -0,0 +1,178 @@
+#include "src/chat/pool.hh"
+
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+
+#include "src/chat/opt.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatOptions;
+using rendezllama::SequencePool;
+
+static
+  bool
+file_exists(const std::string& filename)
+{
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f) {return false;}
+  fclose(f);
+  return true;
+}
+
+static
+  void
+decode_tokens(
+    llama_context* ctx,
+    llama_seq_id seq_id,
+    const std::vector<llama_token>& tokens)
+{
+  llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+  for (unsigned i = 0; i < tokens.size(); ++i) {
+    batch.token[i] = tokens[i];
+    batch.pos[i] = i;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq_id;
+    batch.logits[i] = (i + 1 == tokens.size());
+  }
+  batch.n_tokens = tokens.size();
+  int istat = llama_decode(ctx, batch);
+  assert(istat == 0);
+  llama_batch_free(batch);
+}
+
+/** Two sessions take turns in one resident slot.**/
+static
+  void
+evict_restore_test(llama_context* ctx, const std::string& dirname)
+{
+  const std::vector<llama_token> tokens_a = {1, 100, 200, 300, 400};
+  const std::vector<llama_token> tokens_b = {1, 500, 600};
+  std::mutex context_mutex;
+  std::unique_lock<std::mutex> context_lock(context_mutex);
+  std::string spill_dirname;
+  {
+    SequencePool pool(3, 1, dirname);
+    spill_dirname = pool.spill_dirname();
+    // Spill files go in a new private directory.
+    assert(!spill_dirname.empty());
+    assert(spill_dirname != dirname);
+    const std::string filename_a = spill_dirname + "/session0.kv";
+    const std::string filename_b = spill_dirname + "/session1.kv";
+
+    llama_seq_id seq_id = -1;
+    bool moved = true;
+    pool.add(0);
+    pool.add(1);
+    pool.add(2);
+    bool good = pool.acquire(0, ctx, context_lock, &seq_id, &moved);
+    assert(good && !moved);
+    const llama_seq_id seq_id_a = seq_id;
+    decode_tokens(ctx, seq_id_a, tokens_a);
+
+    // Session 1 evicts session 0, which spills.
+    good = pool.acquire(1, ctx, context_lock, &seq_id, &moved);
+    assert(good && !moved);
+    assert(seq_id == seq_id_a);
+    assert(llama_kv_cache_seq_pos_max(ctx, seq_id) == -1);
+    assert(file_exists(filename_a));
+    decode_tokens(ctx, seq_id, tokens_b);
+
+    // Session 0 comes back with its KV cache, and its spill file is gone.
+    good = pool.acquire(0, ctx, context_lock, &seq_id, &moved);
+    assert(good && moved);
+    assert(llama_kv_cache_seq_pos_max(ctx, seq_id) + 1 == (llama_pos)tokens_a.size());
+    assert(!file_exists(filename_a));
+    assert(file_exists(filename_b));
+
+    // Removing a spilled session deletes its file.
+    pool.remove(1, ctx);
+    assert(!file_exists(filename_b));
+
+    // Spilled again, and cleaned up when the pool goes away.
+    good = pool.acquire(2, ctx, context_lock, &seq_id, &moved);
+    assert(good);
+    assert(file_exists(filename_a));
+  }
+  assert(!file_exists(spill_dirname + "/session0.kv"));
+  assert(0 != remove(spill_dirname.c_str()));
+  llama_kv_cache_clear(ctx);
+}
+
+/** Without a spill directory, an evicted session is lost.**/
+static
+  void
+evict_lost_test(llama_context* ctx)
+{
+  const std::vector<llama_token> tokens_a = {1, 100, 200};
+  std::mutex context_mutex;
+  std::unique_lock<std::mutex> context_lock(context_mutex);
+  SequencePool pool(2, 1, "");
+  assert(pool.spill_dirname().empty());
+  llama_seq_id seq_id = -1;
+  bool moved = false;
+  pool.add(0);
+  pool.add(1);
+  bool good = pool.acquire(0, ctx, context_lock, &seq_id, &moved);
+  assert(good);
+  decode_tokens(ctx, seq_id, tokens_a);
+  good = pool.acquire(1, ctx, context_lock, &seq_id, &moved);
+  assert(good);
+  good = pool.acquire(0, ctx, context_lock, &seq_id, &moved);
+  assert(!good && moved);
+  assert(llama_kv_cache_seq_pos_max(ctx, seq_id) == -1);
+  llama_kv_cache_clear(ctx);
+}
+
+/** One resident slot still has room for a shared priming sequence.**/
+static
+  void
+one_slot_priming_test(ChatOptions opt)
+{
+  opt.context_growth_on = true;
+  auto [model, ctx] = rendezllama::make_llama_context(opt, 1, true);
+  assert(model && ctx);
+  // Sessions that share a context never grow it.
+  assert(!opt.context_growth_on);
+
+  // Like a server, the priming sequence comes after each slot's two.
+  const llama_seq_id priming_seq_id = 2;
+  const std::vector<llama_token> tokens = {1, 100, 200};
+  decode_tokens(ctx, priming_seq_id, tokens);
+
+  std::mutex context_mutex;
+  std::unique_lock<std::mutex> context_lock(context_mutex);
+  SequencePool pool(2, 1, "");
+  llama_seq_id seq_id = -1;
+  bool moved = false;
+  pool.add(0);
+  bool good = pool.acquire(0, ctx, context_lock, &seq_id, &moved);
+  assert(good);
+  assert(seq_id != priming_seq_id);
+  llama_kv_cache_seq_cp(ctx, priming_seq_id, seq_id, 0, tokens.size());
+  assert(llama_kv_cache_seq_pos_max(ctx, seq_id) + 1 == (llama_pos)tokens.size());
+
+  llama_free(ctx);
+  llama_model_free(model);
+}
+
+int main(int argc, char** argv)
+{
+  assert(argc == 3 && "need model filename and scratch directory");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  ChatOptions opt;
+  opt.model_filename = argv[1];
+  opt.context_token_limit = 256;
+  auto [model, ctx] = rendezllama::make_llama_context(opt);
+  assert(model && ctx);
+
+  evict_restore_test(ctx, argv[2]);
+  evict_lost_test(ctx);
+  one_slot_priming_test(opt);
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <cassert>
+#include <cstdio>
+
+#include "llama.h"
+
+#include "src/chat/display.hh"
+#include "src/chat/opt.hh"
+#include "src/chat/session.hh"
+#include "src/chat/trajectory.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatDisplay;
+using rendezllama::ChatOptions;
+using rendezllama::ChatTrajectory;
+using rendezllama::Inference;
+using rendezllama::MappedFile;
+using rendezllama::Vocabulary;
+
+/** Sample from the same logits each time, as if each token was evaluated.**/
+static
+  void
+sample_tokens(
+    unsigned token_count,
+    const std::vector<float>& logits,
+    ChatTrajectory& traj,
+    Inference& inference)
+{
+  for (unsigned i = 0; i < token_count; ++i) {
+    if (!inference.pending_logits()) {
+      inference.assign_pending_logits(logits.data());
+    }
+    bool good = inference.sample_to_trajectory(traj, false);
+    assert(good);
+    traj.context_token_count_ = traj.token_count();
+  }
+  inference.assign_pending_logits(logits.data());
+}
+
+static
+  void
+round_trip_test(llama_model* model, const std::string& filename)
+{
+  Vocabulary vocab(model);
+  ChatOptions opt;
+  const uint64_t fingerprint = vocab.fingerprint();
+  // All tokens are equally likely, so every draw matters.
+  const std::vector<float> logits(vocab.cardinality(), 0.0f);
+
+  ChatTrajectory traj(vocab.bos_token_id());
+  ChatDisplay disp;
+  disp.out_ = open_FildeshOF("/dev/null");
+  Inference inference(vocab);
+  bool good = inference.restore_sampling(
+      opt, model, traj, 12345, 0, logits.data());
+  assert(good);
+  sample_tokens(5, logits, traj, inference);
+  assert(inference.sampling_draw_count() == 5);
+
+  good = rendezllama::save_chat_state(
+      filename, traj, disp, inference, model, nullptr, fingerprint);
+  assert(good);
+  sample_tokens(10, logits, traj, inference);
+
+  ChatTrajectory loaded_traj(vocab.bos_token_id());
+  ChatDisplay loaded_disp;
+  loaded_disp.out_ = open_FildeshOF("/dev/null");
+  Inference loaded_inference(vocab);
+  llama_context* ctx = nullptr;
+  MappedFile state_in;
+  good = state_in.open(filename);
+  assert(good);
+
+  // A different vocabulary fingerprint is rejected, including 0.
+  good = rendezllama::load_chat_state(
+      state_in.view(), loaded_traj, loaded_disp, loaded_inference,
+      model, ctx, opt, 0);
+  assert(!good);
+  good = rendezllama::load_chat_state(
+      state_in.view(), loaded_traj, loaded_disp, loaded_inference,
+      model, ctx, opt, fingerprint);
+  assert(good);
+  state_in.close();
+  assert(loaded_traj.token_count() == 6);
+  assert(loaded_traj.context_token_count_ == 6);
+  assert(loaded_inference.sampling_seed() == 12345);
+  assert(loaded_inference.sampling_draw_count() == 5);
+  assert(loaded_inference.pending_logits());
+
+  // Sampling continues just as it did without the save and load.
+  sample_tokens(10, logits, loaded_traj, loaded_inference);
+  assert(loaded_traj.token_count() == traj.token_count());
+  for (unsigned i = 0; i < traj.token_count(); ++i) {
+    assert(loaded_traj.token_at(i) == traj.token_at(i));
+  }
+  remove(filename.c_str());
+}
+
+/** XTC draws a varying number of random numbers, so it can't be restored.**/
+static
+  void
+xtc_restore_test(llama_model* model)
+{
+  Vocabulary vocab(model);
+  ChatOptions opt;
+  rendezllama::inference::Sampling sampling;
+  sampling.adjust_thru.push_back(rendezllama::inference::AdjustVia(
+      std::in_place_index<rendezllama::inference::AdjustViaKind::xtc>));
+  opt.infer_via = sampling;
+  ChatTrajectory traj(vocab.bos_token_id());
+  Inference inference(vocab);
+  bool good = inference.restore_sampling(opt, model, traj, 12345, 0, nullptr);
+  assert(good);
+  good = inference.restore_sampling(opt, model, traj, 12345, 3, nullptr);
+  assert(!good);
+  assert(inference.sampling_draw_count() == 3);
+}
+
+int main(int argc, char** argv)
+{
+  assert(argc == 3 && "need model filename and scratch filename");
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  llama_model* model = llama_model_load_from_file(argv[1], model_params);
+  assert(model);
+
+  round_trip_test(model, argv[2]);
+  xtc_restore_test(model);
+
+  llama_model_free(model);
+  return 0;
+}
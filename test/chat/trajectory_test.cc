@@ -89,6 +89,8 @@ basic_test()
   assert(traj.token_count() == 80);
   assert(traj.context_token_count_ == 40);
   assert(traj.display_token_count_ == 60);
+  // Evaluated tokens [50..79] shifted to [40..69] and need another eval.
+  assert(traj.redecode_token_count_ == 70);
 
   assert(traj.message_prefix_id_ == 8);
   assert(traj.rfind_last_message_prefix_end_at(49) == 46);
@@ -155,6 +157,7 @@ rollforget_test(llama_model* model)
   traj.maybe_rollforget_within_limit(traj.token_count() - 1, vocabulary);
   assert(traj.token_count() < old_token_count);
   assert(traj.token_count() == old_token_count - expect_forget_count);
+  assert(traj.rollforget_count_ == 1);
 
   assert(traj.transcript_out_->size > 0);
 }
@@ -185,6 +188,175 @@ suffix_test(llama_model* model)
     assert(traj.token_at(i) != vocabulary.eos_token_id());
   }
   assert(traj.endswith_nonempty("EOS\n", vocabulary));
+
+  // Suffix checks follow edits.
+  traj.erase_all_at(traj.token_count()-2);
+  assert(!traj.endswith_nonempty("EOS\n", vocabulary));
+  traj.tokenize_append(" more text\n", vocabulary);
+  assert(traj.endswith_nonempty("text\n", vocabulary));
+  assert(traj.endswith_nonempty("User: blah blah blah more text\n", vocabulary));
+  assert(!traj.endswith_nonempty("xUser: blah blah blah more text\n", vocabulary));
+}
+
+
+static
+  void
+trim_suffix_test(llama_model* model)
+{
+  Vocabulary vocabulary(model);
+
+  {
+    // Suffix spans several tokens and repeats.
+    ChatTrajectory traj(vocabulary.bos_token_id());
+    traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+    traj.tokenize_append(" hello</reply>\n</reply> \n", vocabulary);
+    traj.trim_message_suffix("</reply>\n", vocabulary);
+    assert(traj.endswith_nonempty("User: hello", vocabulary));
+    assert(!traj.endswith_nonempty("</reply>", vocabulary));
+  }
+  {
+    // A partial suffix stays.
+    ChatTrajectory traj(vocabulary.bos_token_id());
+    traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+    traj.tokenize_append(" hello</rep", vocabulary);
+    const auto old_token_count = traj.token_count();
+    traj.trim_message_suffix("</reply>", vocabulary);
+    assert(traj.token_count() == old_token_count);
+    assert(traj.endswith_nonempty("User: hello</rep", vocabulary));
+  }
+  {
+    // Trimming can end within a token, whose leading text is kept.
+    ChatTrajectory traj(vocabulary.bos_token_id());
+    traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+    traj.tokenize_append(" hello</reply>", vocabulary);
+    traj.trim_message_suffix("ly>", vocabulary);
+    assert(traj.endswith_nonempty("User: hello</rep", vocabulary));
+  }
+  {
+    // Nothing to trim.
+    ChatTrajectory traj(vocabulary.bos_token_id());
+    traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+    traj.tokenize_append(" hello", vocabulary);
+    const std::vector<Vocabulary::Token_id> old_tokens = traj.tokens();
+    traj.trim_message_suffix("</reply>", vocabulary);
+    assert(traj.tokens() == old_tokens);
+  }
+}
+
+
+static
+  void
+session_test(llama_model* model)
+{
+  const Vocabulary vocabulary(model);
+  const uint64_t fingerprint = vocabulary.fingerprint();
+  ChatTrajectory traj(vocabulary.bos_token_id());
+  traj.tokenize_append(" Priming prompt.\n", vocabulary);
+  traj.priming_token_count_ = traj.token_count();
+
+  FildeshO session_out[1] = {DEFAULT_FildeshO};
+  // `traj` takes ownership and will free the memory.
+  traj.begin_session_out(session_out, fingerprint);
+
+  traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+  traj.tokenize_append(" Hi.", vocabulary);
+  traj.tokenize_append_message_suffix("", vocabulary);
+  traj.sync_session_out();
+  traj.tokenize_append_message_prefix(1, "Code:", vocabulary);
+  traj.tokenize_append(" Hello", vocabulary);
+  traj.sync_session_out();
+  // Edit logged tokens.
+  traj.erase_all_at(traj.token_count()-1);
+  traj.tokenize_append(" Bye.", vocabulary);
+  traj.insert_all_at(traj.priming_token_count_, {vocabulary.newline_token_id()});
+  traj.sync_session_out();
+
+  {
+    const std::string_view data(session_out->at, session_out->size);
+    ChatTrajectory loaded(0);
+    assert(loaded.assign_session(data, fingerprint));
+    assert(loaded.tokens() == traj.tokens());
+    assert(loaded.priming_token_count_ == traj.priming_token_count_);
+    assert(loaded.message_prefix_id_ == 1);
+    for (unsigned i = traj.priming_token_count_; i < traj.token_count(); ++i) {
+      assert(loaded.rfind_message_prefix_at(i) == traj.rfind_message_prefix_at(i));
+    }
+    assert(loaded.context_token_count_ == 0);
+    assert(loaded.display_token_count_ == loaded.token_count());
+
+    // Wrong vocabulary.
+    assert(!loaded.assign_session(data, fingerprint+1));
+    // Truncated trailing record is ignored.
+    assert(loaded.assign_session(data.substr(0, data.size()-1), fingerprint));
+    assert(loaded.token_count() < traj.token_count());
+  }
+
+  // Rollforget is logged too.
+  traj.rollforget(traj.token_count()-1, vocabulary);
+  traj.sync_session_out();
+  {
+    const std::string_view data(session_out->at, session_out->size);
+    ChatTrajectory loaded(0);
+    assert(loaded.assign_session(data, fingerprint));
+    assert(loaded.tokens() == traj.tokens());
+  }
+}
+
+
+static
+  void
+checkpoint_test(llama_model* model)
+{
+  const Vocabulary vocabulary(model);
+  ChatTrajectory traj(vocabulary.bos_token_id());
+  traj.tokenize_append(" Priming prompt.\n", vocabulary);
+  traj.priming_token_count_ = traj.token_count();
+  traj.tokenize_append_message_prefix(0, "User:", vocabulary);
+  traj.tokenize_append(" Hi.\n", vocabulary);
+  traj.tokenize_append_message_prefix(1, "Code:", vocabulary);
+  traj.tokenize_append(" Hello there.", vocabulary);
+  traj.context_token_count_ = traj.token_count();
+  assert(!traj.undo_checkpoint());
+
+  const std::vector<ChatTrajectory::Token_id> first_tokens = traj.tokens();
+  traj.push_checkpoint();
+  // No duplicate checkpoint when nothing changed.
+  traj.push_checkpoint();
+  assert(traj.checkpoint_count() == 1);
+  traj.erase_all_at(traj.token_count()-2);
+  traj.tokenize_append(" General Kenobi.", vocabulary);
+
+  const std::vector<ChatTrajectory::Token_id> second_tokens = traj.tokens();
+  traj.push_checkpoint();
+  assert(traj.checkpoint_count() == 2);
+  // Edits in the middle are fine too.
+  traj.erase_range(traj.priming_token_count_, traj.priming_token_count_+1);
+  traj.insert_all_at(traj.priming_token_count_, {vocabulary.newline_token_id()});
+
+  assert(traj.undo_checkpoint());
+  assert(traj.tokens() == second_tokens);
+  assert(traj.message_prefix_id_ == 1);
+  assert(traj.undo_checkpoint());
+  assert(traj.tokens() == first_tokens);
+  assert(traj.message_prefix_id_ == 1);
+  assert(traj.context_token_count_ < traj.token_count());
+  assert(traj.kv_restore_token_count_ == 0);
+  assert(!traj.undo_checkpoint());
+
+  // A checkpoint with a backed-up KV cache lets the context be restored.
+  traj.context_token_count_ = traj.token_count();
+  traj.push_checkpoint();
+  traj.last_checkpoint()->kv_backup_on = true;
+  traj.erase_all_at(traj.token_count()-3);
+  assert(traj.undo_checkpoint());
+  assert(traj.tokens() == first_tokens);
+  assert(traj.kv_restore_token_count_ == traj.token_count()-1);
+
+  // Forgetting invalidates checkpoints.
+  traj.push_checkpoint();
+  traj.erase_all_at(traj.token_count()-1);
+  traj.rollforget(traj.token_count()-1, vocabulary);
+  assert(traj.checkpoint_count() == 0);
 }
 
 
@@ -201,6 +373,9 @@ int main(int argc, char** argv)
   basic_test();
   rollforget_test(model);
   suffix_test(model);
+  trim_suffix_test(model);
+  session_test(model);
+  checkpoint_test(model);
 
   llama_model_free(model);
   return 0;
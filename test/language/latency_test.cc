@@ -0,0 +1,97 @@
+#include "src/language/latency.hh"
+
+#include <cassert>
+#include <sstream>
+
+using rendezllama::LatencyHistogram;
+using rendezllama::LatencyPhase;
+using std::chrono::microseconds;
+
+static
+  void
+histogram_quantile_test()
+{
+  LatencyHistogram histogram;
+  assert(histogram.quantile(0.5).count() == 0);
+  for (unsigned i = 0; i < 98; ++i) {
+    histogram.add(microseconds(100));
+  }
+  histogram.add(microseconds(10000));
+  histogram.add(microseconds(10000));
+  assert(histogram.count() == 100);
+  assert(histogram.total() == microseconds(98*100 + 2*10000));
+
+  // Quantiles are upper bounds within a quarter power of 2.
+  const auto p50 = histogram.quantile(0.5);
+  assert(p50 >= microseconds(100));
+  assert(p50 < microseconds(120));
+  const auto p99 = histogram.quantile(0.99);
+  assert(p99 >= microseconds(10000));
+  assert(p99 < microseconds(12000));
+  assert(histogram.quantile(0.98) == p50);
+}
+
+static
+  void
+print_test()
+{
+  rendezllama::LatencyStats stats;
+  std::ostringstream oss;
+  stats.print_to(oss);
+  assert(oss.str().empty());
+
+  stats.record(LatencyPhase::decode, microseconds(50000), 1);
+  stats.record(LatencyPhase::decode, microseconds(50000), 1);
+  stats.print_to(oss);
+  const std::string s = oss.str();
+  assert(s.find("decode: count 2,") == 0);
+  assert(s.find(" 20 tok/s\n") != std::string::npos);
+}
+
+static
+  void
+trace_ring_test()
+{
+  rendezllama::TraceBuffer trace;
+  const auto t = std::chrono::steady_clock::now();
+  // Nothing is recorded until enabled.
+  assert(!trace.enabled());
+  trace.record("early", t, t + microseconds(1), 0);
+  std::ostringstream empty_oss;
+  trace.write_chrome_trace_to(empty_oss);
+  assert(empty_oss.str().find("\"name\"") == std::string::npos);
+  trace.enable(2);
+  assert(trace.enabled());
+  trace.record("first", t, t + microseconds(5), 0);
+  trace.record("second", t + microseconds(5), t + microseconds(7), 3);
+  trace.record("third", t + microseconds(7), t + microseconds(8), 0);
+
+  std::ostringstream oss;
+  trace.write_chrome_trace_to(oss);
+  const std::string s = oss.str();
+  assert(s.find("\"first\"") == std::string::npos);
+  const size_t second_offset = s.find("\"name\":\"second\"");
+  const size_t third_offset = s.find("\"name\":\"third\"");
+  assert(second_offset != std::string::npos);
+  assert(third_offset != std::string::npos);
+  assert(second_offset < third_offset);
+  assert(s.find("\"dur\":2,\"args\":{\"tokens\":3}") != std::string::npos);
+
+  // Clearing forgets old spans but keeps recording new ones.
+  trace.clear();
+  assert(trace.enabled());
+  trace.record("fourth", t + microseconds(8), t + microseconds(9), 0);
+  std::ostringstream cleared_oss;
+  trace.write_chrome_trace_to(cleared_oss);
+  const std::string cleared = cleared_oss.str();
+  assert(cleared.find("\"third\"") == std::string::npos);
+  assert(cleared.find("\"name\":\"fourth\"") != std::string::npos);
+}
+
+int main()
+{
+  histogram_quantile_test();
+  print_test();
+  trace_ring_test();
+  return 0;
+}
@@ -0,0 +1,168 @@
+#include "src/language/memory_plan.hh"
+
+#include <cassert>
+
+using rendezllama::MemoryPlan;
+using rendezllama::MemoryPlanRequest;
+using rendezllama::ModelShape;
+
+/** Roughly a 7B model with 4 GiB of quantized weights.**/
+static
+  ModelShape
+seven_billion_shape()
+{
+  ModelShape shape;
+  shape.weight_byte_count = (uint64_t)4096 << 20;
+  shape.layer_count = 32;
+  shape.head_count = 32;
+  shape.kv_embedding_length = 4096;
+  shape.embedding_length = 4096;
+  shape.feed_forward_length = 11008;
+  shape.vocabulary_size = 32000;
+  return shape;
+}
+
+static
+  uint64_t
+estimated_byte_count(const MemoryPlan& plan)
+{
+  return plan.weight_byte_count + plan.kv_byte_count + plan.compute_byte_count;
+}
+
+static
+  void
+budget_test(
+    unsigned memory_budget_mib,
+    unsigned expect_context_token_limit,
+    const char* expect_kv_type,
+    bool expect_flash_attention_on,
+    unsigned expect_ubatch_count)
+{
+  const ModelShape shape = seven_billion_shape();
+  MemoryPlanRequest request;
+  request.context_token_limit = 4096;
+  request.memory_budget_mib = memory_budget_mib;
+  MemoryPlan plan;
+  bool good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(good);
+  assert(plan.context_token_limit == expect_context_token_limit);
+  assert(plan.kv_cache_key_type == expect_kv_type);
+  assert(plan.kv_cache_value_type == expect_kv_type);
+  assert(plan.flash_attention_on == expect_flash_attention_on);
+  assert(plan.ubatch_count == expect_ubatch_count);
+  assert(estimated_byte_count(plan) <= plan.budget_byte_count);
+}
+
+static
+  void
+explicit_settings_test()
+{
+  const ModelShape shape = seven_billion_shape();
+  MemoryPlanRequest request;
+  request.context_token_limit = 4096;
+  request.memory_budget_mib = 8192;
+  request.kv_cache_key_type = "q8_0";
+  MemoryPlan plan;
+  bool good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(good);
+  assert(plan.context_token_limit == 4096);
+  assert(plan.kv_cache_key_type == "q8_0");
+  assert(plan.kv_cache_value_type == "f16");
+  assert(!plan.flash_attention_on);
+
+  // Quantized values need flash attention, which is explicitly off.
+  request.kv_cache_value_type = "q8_0";
+  request.flash_attention_on = 0;
+  good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(!good);
+}
+
+static
+  void
+sessions_test()
+{
+  const ModelShape shape = seven_billion_shape();
+  MemoryPlanRequest request;
+  request.context_token_limit = 4096;
+  request.memory_budget_mib = 6144;
+  MemoryPlan plan;
+  bool good = rendezllama::plan_memory(plan, shape, request, 4);
+  assert(good);
+  // Each session gets its share of a smaller KV cache.
+  assert(plan.context_token_limit < 4096);
+  assert(plan.context_token_limit % 256 == 0);
+  assert(estimated_byte_count(plan) <= plan.budget_byte_count);
+}
+
+static
+  void
+few_tokens_test()
+{
+  const ModelShape shape = seven_billion_shape();
+  MemoryPlanRequest request;
+  request.context_token_limit = 4096;
+  request.memory_budget_mib = 4128;
+  MemoryPlan plan;
+  bool good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(good);
+  // Fewer tokens fit than flash attention pads to,
+  // but a context without it is padded less.
+  assert(!plan.flash_attention_on);
+  assert(plan.context_token_limit == 32);
+  assert(plan.kv_byte_count == rendezllama::kv_cache_byte_count(
+          shape, 32, "f16", "f16"));
+  assert(estimated_byte_count(plan) <= plan.budget_byte_count);
+
+  // Estimates are for the padded context of all sessions.
+  good = rendezllama::plan_memory(plan, shape, request, 3);
+  assert(good);
+  assert(plan.context_token_limit == 10);
+  assert(plan.kv_byte_count == rendezllama::kv_cache_byte_count(
+          shape, 32, "f16", "f16"));
+  assert(estimated_byte_count(plan) <= plan.budget_byte_count);
+
+  // With flash attention, not even one padded context fits.
+  request.flash_attention_on = 1;
+  good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(!good);
+
+  // Without flash attention, the context is rounded to less padding.
+  request.memory_budget_mib = 4608;
+  request.flash_attention_on = 0;
+  good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(good);
+  assert(!plan.flash_attention_on);
+  assert(plan.context_token_limit > 0);
+  assert(plan.context_token_limit % 32 == 0);
+  assert(estimated_byte_count(plan) <= plan.budget_byte_count);
+}
+
+static
+  void
+too_small_test()
+{
+  const ModelShape shape = seven_billion_shape();
+  MemoryPlanRequest request;
+  request.context_token_limit = 4096;
+  request.memory_budget_mib = 4096;
+  MemoryPlan plan;
+  bool good = rendezllama::plan_memory(plan, shape, request, 1);
+  assert(!good);
+}
+
+int main()
+{
+  // Everything fits with the fastest settings.
+  budget_test(8192, 4096, "f16", false, 512);
+  // Flash attention saves enough.
+  budget_test(6400, 4096, "f16", true, 512);
+  // Quantizing the KV cache saves enough.
+  budget_test(5632, 4096, "q8_0", true, 512);
+  // Nothing fits the whole context, so keep as much as possible.
+  budget_test(4608, 3328, "q4_0", true, 128);
+  explicit_settings_test();
+  sessions_test();
+  few_tokens_test();
+  too_small_test();
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include "src/language/scheduler.hh"
+
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <thread>
+
+#include "src/chat/opt.hh"
+#include "src/language/inference.hh"
+#include "src/language/vocabulary.hh"
+
+using rendezllama::ChatOptions;
+using rendezllama::DecodeScheduler;
+
+static const unsigned batch_count = 64;
+
+static
+  void
+packing_test()
+{
+  std::vector<unsigned> packed;
+
+  // Generation tokens first, then prefills split what is left.
+  rendezllama::plan_decode_batch(packed, {5, 1, 9, 1}, 8, batch_count);
+  assert((packed == std::vector<unsigned>{3, 1, 3, 1}));
+  // A short prefill leaves its share to the others.
+  rendezllama::plan_decode_batch(packed, {2, 50}, 32, batch_count);
+  assert((packed == std::vector<unsigned>{2, 30}));
+  // Every prefill advances even when generation used the budget.
+  rendezllama::plan_decode_batch(packed, {1, 1, 10, 10}, 2, batch_count);
+  assert((packed == std::vector<unsigned>{1, 1, 1, 1}));
+  // Nothing goes past the batch capacity.
+  rendezllama::plan_decode_batch(packed, {1, 1, 1}, 2, 2);
+  assert((packed == std::vector<unsigned>{1, 1, 0}));
+  rendezllama::plan_decode_batch(packed, {100}, batch_count, batch_count);
+  assert((packed == std::vector<unsigned>{batch_count}));
+}
+
+static
+  float
+max_abs_difference(const std::vector<float>& a, const std::vector<float>& b)
+{
+  assert(a.size() == b.size());
+  float d = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    d = std::max(d, std::fabs(a[i] - b[i]));
+  }
+  return d;
+}
+
+/** Decode in other threads after one lone decode, so they share a batch.
+ *
+ * The context is locked until all of them are waiting on the scheduler.
+ **/
+static
+  void
+decode_together(
+    DecodeScheduler& scheduler,
+    const std::vector<llama_seq_id>& seq_ids,
+    const std::vector<std::vector<llama_token>>& tokens,
+    std::vector<std::vector<float>>& logits,
+    std::vector<unsigned>& results)
+{
+  const llama_token lone_token = 1;
+  std::vector<float> lone_logits;
+  results.assign(seq_ids.size(), 0);
+  logits.resize(seq_ids.size());
+  std::vector<std::thread> threads;
+
+  std::unique_lock<std::mutex> context_lock(scheduler.context_mutex());
+  threads.emplace_back([&]() {
+    scheduler.decode(0, &lone_token, 1, 0, lone_logits, nullptr);
+  });
+  while (scheduler.pending_count() < 1) {std::this_thread::yield();}
+  for (size_t i = 0; i < seq_ids.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      results[i] = scheduler.decode(
+          seq_ids[i], tokens[i].data(), tokens[i].size(), 0, logits[i], nullptr);
+    });
+  }
+  while (scheduler.pending_count() < 1 + seq_ids.size()) {
+    std::this_thread::yield();
+  }
+  context_lock.unlock();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+static
+  void
+decode_test(llama_context* ctx)
+{
+  const llama_model* model = llama_get_model(ctx);
+  const unsigned vocabulary_size = llama_vocab_n_tokens(llama_model_get_vocab(model));
+  DecodeScheduler scheduler(&ctx, batch_count, batch_count, vocabulary_size);
+  const std::vector<llama_token> tokens_a = {1, 100, 200, 300, 400};
+  const std::vector<llama_token> tokens_b = {1, 500, 600, 700, 800, 900, 1000};
+
+  // Reference logits from lone decodes.
+  std::vector<float> expect_a;
+  std::vector<float> expect_b;
+  unsigned n = scheduler.decode(
+      1, tokens_a.data(), tokens_a.size(), 0, expect_a, nullptr);
+  assert(n == tokens_a.size());
+  n = scheduler.decode(
+      2, tokens_b.data(), tokens_b.size(), 0, expect_b, nullptr);
+  assert(n == tokens_b.size());
+  assert(max_abs_difference(expect_a, expect_b) > 1e-2);
+  llama_kv_cache_clear(ctx);
+
+  // Each sequence gets its own logits from a shared batch.
+  std::vector<std::vector<float>> logits;
+  std::vector<unsigned> results;
+  decode_together(scheduler, {2, 1}, {tokens_b, tokens_a}, logits, results);
+  assert(results[0] == tokens_b.size());
+  assert(results[1] == tokens_a.size());
+  assert(max_abs_difference(logits[0], expect_b) < 1e-3);
+  assert(max_abs_difference(logits[1], expect_a) < 1e-3);
+  llama_kv_cache_clear(ctx);
+
+  // A bad request fails alone.
+  std::vector<llama_token> tokens_bad = tokens_b;
+  tokens_bad.back() = (llama_token)vocabulary_size;
+  decode_together(scheduler, {1, 2}, {tokens_a, tokens_bad}, logits, results);
+  assert(results[0] == tokens_a.size());
+  assert(results[1] == 0);
+  assert(max_abs_difference(logits[0], expect_a) < 1e-3);
+  llama_kv_cache_clear(ctx);
+
+  // A stopped prefill evaluates one more token.
+  std::atomic<bool> stop_flag(true);
+  std::vector<float> logits_stop;
+  n = scheduler.decode(
+      1, tokens_a.data(), tokens_a.size(), 0, logits_stop, &stop_flag);
+  assert(n == 1);
+  assert(llama_kv_cache_seq_pos_max(ctx, 1) == 0);
+  assert(logits_stop.size() == vocabulary_size);
+  llama_kv_cache_clear(ctx);
+}
+
+int main(int argc, char** argv)
+{
+  assert(argc == 2 && "need model filename");
+  packing_test();
+
+  rendezllama::GlobalScope rendezllama_global_scope;
+  ChatOptions opt;
+  opt.model_filename = argv[1];
+  opt.context_token_limit = 256;
+  opt.batch_count = batch_count;
+  auto [model, ctx] = rendezllama::make_llama_context(opt, 2);
+  assert(model && ctx);
+
+  decode_test(ctx);
+
+  llama_free(ctx);
+  llama_model_free(model);
+  return 0;
+}
@@ -52,6 +52,10 @@ static void tokenize_test(const char* model_filename)
   }
   assert(oss.view() == s);
 
+  // Substitutions don't change the fingerprint.
+  assert(vocabulary.fingerprint() == rendezllama::Vocabulary(model).fingerprint());
+  assert(vocabulary.fingerprint() != rendezllama::Vocabulary(nullptr).fingerprint());
+
   llama_model_free(model);
 }
 